@@ -0,0 +1,115 @@
+#include <cstring>
+
+#include "constants.h"
+#include "chunk.h"
+#include "rules.h"
+#include "bitplane.h"
+
+#if CHUNK_X != 16 || CHUNK_Y != 16 || CHUNK_Z != 16
+#error "Bitplane layout assumes 16x16x16 chunks"
+#endif
+
+namespace Game
+{
+
+const BlockRule BITPLANE_RULES[] =
+{
+	{ BlockType_Air,	{ ANY_BLOCK, ANY_BLOCK, ANY_BLOCK,		BlockType_Sand,	ANY_BLOCK, ANY_BLOCK },	BlockType_Sand },
+	{ BlockType_Sand,	{ ANY_BLOCK, ANY_BLOCK, BlockType_Air,	ANY_BLOCK,		ANY_BLOCK, ANY_BLOCK },	BlockType_Air },
+};
+
+const int NUM_BITPLANE_RULES = sizeof(BITPLANE_RULES) / sizeof(BlockRule);
+
+//Lowest and highest cell of each column in a word
+static const uint64_t COLUMN_BOTTOM	= 0x0001000100010001ULL;
+static const uint64_t COLUMN_TOP	= COLUMN_BOTTOM << (CHUNK_Y - 1);
+
+void ChunkPlanes::load(Block const* buffer, int stride_x, int stride_xz, int y_begin, int y_end)
+{
+	memset(air, 0, sizeof(air));
+	memset(sand, 0, sizeof(sand));
+
+	for(int y=y_begin; y<y_end; ++y)
+	for(int z=0; z<CHUNK_Z; ++z)
+	{
+		auto row = buffer + (y - y_begin) * stride_xz + z * stride_x;
+		for(int x=0; x<CHUNK_X; ++x)
+		{
+			uint64_t m = 1ULL << bit(x, y);
+			switch(row[x].type())
+			{
+				case BlockType_Air:		air[word(x, z)] |= m;	break;
+				case BlockType_Sand:	sand[word(x, z)] |= m;	break;
+				default: break;
+			}
+		}
+	}
+}
+
+void ChunkPlanes::store(uint64_t const* mask, Block* buffer, int stride_x, int stride_xz) const
+{
+	for(int w=0; w<PLANE_WORDS; ++w)
+	{
+		uint64_t m = mask[w];
+		while(m)
+		{
+			int b = __builtin_ctzll(m);
+			m &= m - 1;
+			
+			int x = ((w & 3) << 2) + (b >> CHUNK_Y_S),
+				y = b & (CHUNK_Y - 1),
+				z = w >> 2;
+			
+			buffer[x + z * stride_x + y * stride_xz] =
+				Block( (air[w] >> b) & 1 ? BlockType_Air : BlockType_Sand );
+		}
+	}
+}
+
+void ChunkPlanes::set(int x, int y, int z, Block b)
+{
+	int w = word(x, z);
+	uint64_t m = 1ULL << bit(x, y);
+	
+	air[w] &= ~m;
+	sand[w] &= ~m;
+	
+	if(b.type() == BlockType_Air)
+		air[w] |= m;
+	else if(b.type() == BlockType_Sand)
+		sand[w] |= m;
+}
+
+bool step_planes(
+	ChunkPlanes& next,
+	ChunkPlanes const& current,
+	ChunkPlanes const& above,
+	ChunkPlanes const& below,
+	uint64_t* touched)
+{
+	uint64_t changed = 0;
+
+	for(int w=0; w<PLANE_WORDS; ++w)
+	{
+		uint64_t a = current.air[w],
+				 s = current.sand[w];
+	
+		//Sand directly above each cell and air directly below, pulling the edge rows from the neighbors
+		uint64_t s_above = ((s >> 1) & ~COLUMN_TOP)    | ((above.sand[w] & COLUMN_BOTTOM) << (CHUNK_Y - 1)),
+				 a_below = ((a << 1) & ~COLUMN_BOTTOM) | ((below.air[w] & COLUMN_TOP) >> (CHUNK_Y - 1));
+		
+		//Air with sand on top fills, sand over air empties
+		uint64_t fill = a & s_above,
+				 empty = s & a_below;
+		
+		next.air[w]  = (a & ~fill) | empty;
+		next.sand[w] = (s & ~empty) | fill;
+		
+		touched[w] |= fill | empty;
+		changed |= fill | empty;
+	}
+	
+	return changed != 0;
+}
+
+};
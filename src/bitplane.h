@@ -0,0 +1,54 @@
+#ifndef BITPLANE_H
+#define BITPLANE_H
+
+#include <stdint.h>
+
+#include "constants.h"
+#include "chunk.h"
+#include "rules.h"
+
+namespace Game
+{
+	//Number of 64 bit words in a chunk sized bitplane
+	const int PLANE_WORDS = CHUNK_SIZE / 64;
+
+	//Air and sand occupancy of a chunk, one bit per cell.  Word (x/4 + 4*z) holds the four columns
+	//x..x+3 at depth z, and bit (x%4)*CHUNK_Y + y within it is cell (x,y,z).  Keeping the columns
+	//inside a word turns vertical neighbors into shifts, so a whole word is stepped at once.
+	//Cells in neither plane are solid and never change.
+	struct ChunkPlanes
+	{
+		uint64_t	air[PLANE_WORDS],
+					sand[PLANE_WORDS];
+		
+		//Builds the planes from layers [y_begin, y_end) of a block buffer, starting at layer y_begin of the
+		//buffer.  Other layers are left empty.
+		void load(Block const* buffer, int stride_x, int stride_xz, int y_begin = 0, int y_end = CHUNK_Y);
+		
+		//Writes the cells set in mask back into a block buffer
+		void store(uint64_t const* mask, Block* buffer, int stride_x, int stride_xz) const;
+		
+		//Sets a single cell
+		void set(int x, int y, int z, Block b);
+		
+		//Word and bit of a cell
+		static int word(int x, int z) { return (x >> 2) + (z << 2); }
+		static int bit(int x, int y) { return ((x & 3) << CHUNK_Y_S) + y; }
+	};
+	
+	//The rules step_planes implements, it may only stand in for a rule table built from exactly these
+	extern const BlockRule BITPLANE_RULES[];
+	extern const int NUM_BITPLANE_RULES;
+	
+	//Steps falling sand for one chunk, given the current planes of the chunks above and below.
+	//Matches a RuleTable of BITPLANE_RULES cell for cell.  Changed cells are or'd into touched, returns
+	//true if anything changed.
+	bool step_planes(
+		ChunkPlanes& next,
+		ChunkPlanes const& current,
+		ChunkPlanes const& above,
+		ChunkPlanes const& below,
+		uint64_t* touched);
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include <cstdlib>
+
+#include <tbb/atomic.h>
+#include <tbb/scalable_allocator.h>
+#include <tbb/enumerable_thread_specific.h>
+
+#include "block_intake.h"
+
+using namespace tbb;
+
+namespace Game
+{
+
+BlockIntake::BlockIntake()
+{
+	producers = NULL;
+}
+
+BlockIntake::~BlockIntake()
+{
+	Producer* p = producers;
+	while(p != NULL)
+	{
+		Segment* s = p->head;
+		while(s != NULL)
+		{
+			Segment* next = s->next;
+			delete s;
+			s = next;
+		}
+	
+		Producer* next = p->next;
+		delete p;
+		p = next;
+	}
+}
+
+BlockIntake::Segment* BlockIntake::new_segment()
+{
+	auto s = new Segment();
+	s->count = 0;
+	s->next = NULL;
+	return s;
+}
+
+void BlockIntake::push(BlockRecord const& rec)
+{
+	bool exists;
+	Producer*& p = local_producer.local(exists);
+	
+	//First push from this thread, register a new chain
+	if(!exists || p == NULL)
+	{
+		p = new Producer();
+		p->tail = p->head = new_segment();
+		p->read = 0;
+		
+		Producer* old;
+		do
+		{
+			old = producers;
+			p->next = old;
+		} while(producers.compare_and_swap(p, old) != old);
+	}
+	
+	Segment* s = p->tail;
+	int n = s->count;
+	if(n == SEGMENT_SIZE)
+	{
+		//Once next is set the consumer owns the full segment
+		Segment* ns = new_segment();
+		s->next = ns;
+		p->tail = s = ns;
+		n = 0;
+	}
+	
+	s->records[n] = rec;
+	s->count = n + 1;
+}
+
+void BlockIntake::drain(block_list_t& out)
+{
+	for(Producer* p = producers; p != NULL; p = p->next)
+	{
+		Segment* s = p->head;
+		while(true)
+		{
+			int n = s->count;
+			out.insert(out.end(), s->records + p->read, s->records + n);
+			p->read = n;
+			
+			//Only a full segment which the producer has left behind can be freed
+			if(n < SEGMENT_SIZE)
+				break;
+			Segment* next = s->next;
+			if(next == NULL)
+				break;
+			
+			delete s;
+			p->head = s = next;
+			p->read = 0;
+		}
+	}
+}
+
+};
@@ -0,0 +1,80 @@
+#ifndef BLOCK_INTAKE_H
+#define BLOCK_INTAKE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <tbb/atomic.h>
+#include <tbb/scalable_allocator.h>
+#include <tbb/enumerable_thread_specific.h>
+
+#include "constants.h"
+#include "chunk.h"
+
+namespace Game
+{
+	//A block write, applied by the physics at tick t
+	struct BlockRecord
+	{
+		uint64_t t;
+		int x, y, z;
+		Block b;
+		
+		bool operator==(BlockRecord const& other) const
+		{
+			return t==other.t && x == other.x && y == other.y && z == other.z && b == other.b;
+		}
+		
+		bool operator<(BlockRecord const& other) const
+		{
+			return t < other.t;
+		}
+	};
+	
+	typedef std::vector< BlockRecord, tbb::scalable_allocator<BlockRecord> > block_list_t;
+
+	//Lock free multi producer, single consumer queue of block writes.  Each producer thread appends to
+	//its own chain of fixed size segments and publishes every record with a release store, so producers
+	//never contend with each other or with the consumer.  The consumer walks the chains and frees the
+	//segments their producers have moved past.  Records from one thread come out in the order they
+	//went in.
+	struct BlockIntake
+	{
+		BlockIntake();
+		~BlockIntake();
+		
+		//Adds a record, may be called from any thread
+		void push(BlockRecord const& rec);
+		
+		//Appends every published record to out, only one thread may drain at a time
+		void drain(block_list_t& out);
+		
+	private:
+		static const int SEGMENT_SIZE = 256;
+	
+		struct Segment
+		{
+			BlockRecord records[SEGMENT_SIZE];
+			tbb::atomic<int> count;
+			tbb::atomic<Segment*> next;
+		};
+		
+		//Per thread chain, tail is only touched by the producer, head and read only by the consumer
+		struct Producer
+		{
+			Segment* tail;
+			char pad[64];
+			Segment* head;
+			int read;
+			Producer* next;
+		};
+		
+		static Segment* new_segment();
+		
+		//Every producer which has ever pushed, newest first
+		tbb::atomic<Producer*> producers;
+		tbb::enumerable_thread_specific<Producer*> local_producer;
+	};
+};
+
+#endif
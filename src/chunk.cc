@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <cstdlib>
+#include <algorithm>
 
 #include <tbb/task.h>
 
@@ -37,6 +38,20 @@ const bool BLOCK_TRANSPARENCY[] =
 
 //Block state bytes (can be from 0 to 3)
 const int BLOCK_STATE_BYTES[] =
+{
+	0,		//Air
+	0,		//Stone
+	0,		//Dirt
+	0,		//Grass
+	0,		//Cobblestone
+	0,		//Wood
+	0,		//Log
+	1,		//Water, units short of full
+	0		//Sand
+};
+
+//Block light emission (from 0 to 15)
+const int BLOCK_EMISSION[] =
 {
 	0,		//Air
 	0,		//Stone
@@ -62,14 +77,17 @@ size_t ChunkIDHashCompare::hash(const ChunkID& chunk_id) const
 	return (size_t)h;
 }
 
-//Sets a block in a chunk buffer
-// This is complicated -- Mik
-//FIXME: Not tested
+//Sets a block in a chunk buffer, keeping the intervals merged
 bool ChunkBuffer::set_block(Block b, int x, int y, int z, uint64_t t)
 {
 	int offset = x + z * CHUNK_X + y * CHUNK_X * CHUNK_Z;
 	
-	auto iter = intervals.lower_bound(offset);
+	//Find the interval containing the block
+	auto iter = intervals.upper_bound(offset);
+	if(iter == intervals.begin())
+		return false;
+	--iter;
+	
 	auto c = iter->second;
 	if(b == c)
 		return false;
@@ -86,154 +104,32 @@ bool ChunkBuffer::set_block(Block b, int x, int y, int z, uint64_t t)
 	if(next != intervals.end())
 		r = next->first;
 	
+	//Split the block out of its interval
+	//
+	//Before:       ccccccccccccc
+	//					  ^
+	//					  b
+	//					 
+	//After:        ccccc b ccccccc
+	//
+	if(offset + 1 < r)
+		next = intervals.insert(next, make_pair(offset+1, c));
 	if(l == offset)
-	{
-		//Case: Insert at start of interval
-		
-		if(iter == intervals.begin() ||
-			intervals.lower_bound(l-1)->second != b)
-		{
-			//Case: Prev interval distinct
-			if(r - l == 1)
-			{
-				//Case : Interval length == 1
-				
-				if(next != intervals.end() && b == next->second)
-				{
-					//Case : next interval same
-					//
-					//Before:       aaaaa c bbbbbbb
-					//					  ^
-					//					  b
-					//					 
-					//After:        aaaaa bbbbbbbb
-					//
-					
-					iter->second = b;
-					intervals.erase(next);
-				}
-				else
-				{
-					//Case : next interval distinct
-					//
-					//Before:       aaaaa c ddddd
-					//					  ^
-					//					  b
-					//					 
-					//After:        aaaaa b ddddd
-					//
-					
-					iter->second = b;
-				}
-			}
-			else
-			{
-				//Case : Interval length > 1
-				//
-				//Before:       aaaaa ccccc
-				//					  ^
-				//					  b
-				//					 
-				//After:        aaaaa b cccc
-				//
-				
-				
-				iter->second = b;
-				intervals.insert(make_pair(l+1, c));
-			}
-		}
-		else if(r - l == 1)
-		{
-			//Case : Prev interval same, interval length == 1
-			if(next != intervals.end() && b == next->second)
-			{
-				//Case : next interval same
-				//
-				//Before:       bbbbb c bbbbb
-				//					  ^
-				//					  b
-				//					 
-				//After:        bbbbbbbbbbb
-				//
-				
-				intervals.erase(next);
-				intervals.erase(intervals.lower_bound(offset));
-			}
-			else
-			{
-				//Case : next interval distinct
-				//
-				//Before:       bbbbb c dddddd
-				//					  ^
-				//					  b
-				//					 
-				//After:        bbbbbb dddddd
-				//
-
-				intervals.erase(iter);
-			}
-		}
-		else
-		{
-			//Case : Prev interval same, interval length > 1
-			//
-			//Before:       bbbbb cccccc
-			//					  ^
-			//					  b
-			//					 
-			//After:        bbbbbb ccccc
-			//
-			
-			intervals.erase(iter);
-			intervals.insert(make_pair(offset+1, c));
-		}
-	}
-	else if(r-1 == offset)
-	{
-		//Case: insert at end of interval, interval length is > 1
-		
-		if(next == intervals.end() || next->second == b)
-		{
-			//Case : Next interval distinct
-			//
-			//Before:       ccccccc ddddddd
-			//					  ^
-			//					  b
-			//					 
-			//After:        cccccc b ddddddd
-			//
-
-			intervals.insert(make_pair(offset, b));
-		}
-		else
-		{
-			//Case : Next interval same
-			//
-			//Before:       ccccccc bbbbbb
-			//					  ^
-			//					  b
-			//					 
-			//After:        cccccc bbbbbbb
-			//
-
-			intervals.erase(next);
-			intervals.insert(make_pair(offset, b));
-		}
-	}
+		iter->second = b;
 	else
+		iter = intervals.insert(next, make_pair(offset, b));
+	
+	//Merge with the neighboring intervals
+	if(next != intervals.end() && next->second == b)
+		intervals.erase(next);
+	if(iter != intervals.begin())
 	{
-		//Case:  Insert in middle of interval
-		//
-		//Before:       ccccccccccccc
-		//					  ^
-		//					  b
-		//					 
-		//After:        ccccc b ccccccc
-		//
-
-		intervals.insert(make_pair(offset, b));
-		intervals.insert(make_pair(offset+1, c));
+		auto prev = iter;
+		--prev;
+		if(prev->second == b)
+			intervals.erase(iter);
 	}
+	
 	return true;
 }
 
@@ -322,6 +218,41 @@ void ChunkBuffer::decompress_chunk(Block* data, int stride_x, int stride_xz) con
 	}
 }
 
+//Sets every block in the chunk to b
+void ChunkBuffer::fill(Block b)
+{
+	intervals.clear();
+	pbuffer_data.clear();
+	intervals.insert(make_pair(0, b));
+}
+
+//Walks the runs from the top of the chunk down, a run only has to be read down to one layer below its end
+void ChunkBuffer::column_tops(int8_t* tops) const
+{
+	const int LAYER = CHUNK_X * CHUNK_Z;
+	for(int i=0; i<LAYER; ++i)
+		tops[i] = -1;
+	
+	int left = LAYER, end = CHUNK_SIZE;
+	for(auto iter = intervals.rbegin(); iter != intervals.rend() && left > 0; ++iter)
+	{
+		int start = iter->first;
+		if(iter->second.type() != BlockType_Air)
+		{
+			for(int i=end-1; i>=max(start, end - LAYER); --i)
+			{
+				int c = i & (LAYER - 1);
+				if(tops[c] < 0)
+				{
+					tops[c] = i >> (CHUNK_X_S + CHUNK_Z_S);
+					--left;
+				}
+			}
+		}
+		end = start;
+	}
+}
+
 //Caches protocol buffer data
 void ChunkBuffer::cache_protocol_buffer_data()
 {
@@ -338,7 +269,7 @@ void ChunkBuffer::cache_protocol_buffer_data()
 		int len = right - left;
 		assert(len > 0);
 		
-		while(len > 0x80)
+		while(len >= 0x80)
 		{
 			pbuffer_data.push_back((len & 0x7f) | 0x80);
 			len >>= 7;
@@ -363,6 +294,7 @@ bool ChunkBuffer::serialize_to_protocol_buffer(Network::Chunk& c) const
 
 	c.set_last_modified(timestamp);
 	c.set_data(&pbuffer_data[0], pbuffer_data.size());
+	c.set_format(CHUNK_FORMAT);
 	return true;
 }
 
@@ -373,9 +305,18 @@ void ChunkBuffer::parse_from_protocol_buffer(Network::Chunk const& c)
 		return;
 
 	//Unpack fields from protocol buffer
-	if(c.has_last_modified())
-		timestamp = c.last_modified();
-	pbuffer_data.assign(c.data().begin(), c.data().end());
+	parse_from_data(
+		c.has_last_modified() ? c.last_modified() : timestamp,
+		(const uint8_t*)c.data().data(),
+		c.data().size(),
+		c.has_format() ? c.format() : 0);
+}
+
+//Parses a chunk from a run length encoded buffer
+void ChunkBuffer::parse_from_data(uint64_t t, const uint8_t* data, int size, int format)
+{
+	timestamp = t;
+	pbuffer_data.assign(data, data + size);
 	intervals.clear();
 
 	//Unpack the ranges
@@ -394,15 +335,23 @@ void ChunkBuffer::parse_from_protocol_buffer(Network::Chunk const& c)
 		
 		assert(len > 0);
 		
-		//Unpack the encoded block type
+		//Unpack the encoded block type, format 0 had no state bytes
 		uint8_t type = *(ptr++);
-		Block b(type, ptr);
-		ptr += b.state_bytes();
+		Block b(type);
+		if(format > 0)
+		{
+			b = Block(type, ptr);
+			ptr += b.state_bytes();
+		}
 
 		//Insert the interval and continue
 		intervals.insert(make_pair(i, b));
 		i += len;
 	}
+	
+	//Old records are re-encoded, so only the current format is ever stored or sent
+	if(format != CHUNK_FORMAT)
+		cache_protocol_buffer_data();
 }
 
 //Checks if the interval trees are equivalent
@@ -39,6 +39,13 @@ namespace Game
 	//FIXME: Replace this with a bit flag...
 	extern const int BLOCK_STATE_BYTES[];
 
+	//Version of the run length encoding.  Format 0 stored no state bytes for any block type, format 1
+	//stores BLOCK_STATE_BYTES after each block type.
+	const int CHUNK_FORMAT = 1;
+
+	//Light emitted by a block type, from 0 to 15
+	extern const int BLOCK_EMISSION[];
+
 	//A block object (ie one voxel inside the map)
 	#pragma pack(push)
 	#pragma pack(1)	
@@ -52,10 +59,11 @@ namespace Game
 			int_val(t | (s0<<8) | (s1<<16) | (s2<<24) )
 		{ }
 		
+		//s points at the first state byte
 		Block(uint8_t t, uint8_t* s) : int_val(t)
 		{
 			for(int i=1; i<=BLOCK_STATE_BYTES[t]; ++i)
-				int_val |= (uint32_t)s[i] << (8*i);
+				int_val |= (uint32_t)s[i-1] << (8*i);
 		}
 		
 		Block(const Block& other)
@@ -89,6 +97,7 @@ namespace Game
 		uint8_t type() const		{ return int_val&0xff; }
 		bool transparent() const	{ return BLOCK_TRANSPARENCY[type()]; }
 		int state_bytes() const		{ return BLOCK_STATE_BYTES[type()]; }
+		int emission() const		{ return BLOCK_EMISSION[type()]; }
 		int state(int i) const		{ return (int_val>>(8*(i+1))) & 0xff; }
 	};
 	#pragma pack(pop)
@@ -156,7 +165,7 @@ namespace Game
 	{
 		typedef std::map<int, Block, std::less<int>, tbb::tbb_allocator< std::pair<const int, Block> > >	interval_tree_t;
 	
-		ChunkBuffer() : is_empty(false), valid_flag(false), timestamp(1) {}
+		ChunkBuffer() : is_empty(false), valid_flag(false), timestamp(1), sources(0) {}
 	
 		//Block accessors
 		Block get_block(int x, int y, int z) const;
@@ -165,12 +174,22 @@ namespace Game
 		//Buffer decoding/access
 		void compress_chunk(Block* chunk, int stride_x=CHUNK_X, int stride_xz=CHUNK_X*CHUNK_Z);
 		void decompress_chunk(Block* chunk, int stride_x=CHUNK_X, int stride_xz=CHUNK_X*CHUNK_Z) const;
+		void fill(Block b);
+		
+		//Local y of the highest non-air block of each column, indexed x + z*CHUNK_X, or -1 if the column is empty.
+		//Read from the runs directly, so it costs the number of runs at the top of the chunk.
+		void column_tops(int8_t* tops) const;
 		
 		//Protocol buffer interface
 		void cache_protocol_buffer_data();
 		void parse_from_protocol_buffer(Network::Chunk const&);
 		bool serialize_to_protocol_buffer(Network::Chunk&) const;
 		
+		//Raw run length encoded data (valid after cache_protocol_buffer_data)
+		void parse_from_data(uint64_t t, const uint8_t* data, int size, int format = CHUNK_FORMAT);
+		const uint8_t* encoded_data() const { return pbuffer_data.size() ? &pbuffer_data[0] : NULL; }
+		int encoded_size() const { return pbuffer_data.size(); }
+		
 		//Time stamp accessors
 		uint64_t last_modified() const { return timestamp; }
 		uint64_t set_last_modified(uint64_t t) { return timestamp = t; }
@@ -178,6 +197,8 @@ namespace Game
 		//For surface chunks
 		bool empty_surface() const { return is_empty; }
 		bool set_empty_surface(bool b) { return is_empty = b; }
+		uint64_t source_version() const { return sources; }
+		uint64_t set_source_version(uint64_t v) { return sources = v; }
 		
 		//The internal representation of the interval tree
 		interval_tree_t interval_tree() const { return intervals; }
@@ -193,6 +214,10 @@ namespace Game
 		//Last time this chunk buffer was updated
 		uint64_t	timestamp;
 		
+		//For surface chunks, the sum of the time stamps of the chunks it was built from.
+		//Chunk time stamps only ever increase, so any change to a source changes the sum.
+		uint64_t	sources;
+		
 		//The interval tree
 		
 		interval_tree_t		intervals;
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <algorithm>
+
+#include "constants.h"
+#include "chunk.h"
+#include "chunk_filter.h"
+
+using namespace std;
+
+namespace Game
+{
+
+//Packs and mixes a chunk id into 64 bits
+static uint64_t mix_chunk_id(ChunkID const& chunk_id)
+{
+	uint64_t h = 
+		 ((uint64_t)chunk_id.x & CHUNK_IDX_MASK) |
+		(((uint64_t)chunk_id.y & CHUNK_IDX_MASK) << CHUNK_IDX_S) |
+		(((uint64_t)chunk_id.z & CHUNK_IDX_MASK) << (2*CHUNK_IDX_S));
+	
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+ChunkFilter::ChunkFilter(uint64_t num_bits, int num_hashes) :
+	count(0),
+	hashes(max(num_hashes, 1))
+{
+	//Round up to a power of two, so hash values can be masked
+	uint64_t n = 64;
+	while(n < num_bits)
+		n <<= 1;
+	mask = n - 1;
+	bits.resize(n / 64, 0ULL);
+}
+
+//Adds a chunk to the filter
+void ChunkFilter::insert(ChunkID const& chunk_id)
+{
+	//Double hashing, h1 + i * h2
+	uint64_t h = mix_chunk_id(chunk_id),
+			 h1 = h,
+			 h2 = (h >> 32) | 1ULL;
+	
+	for(int i=0; i<hashes; ++i, h1 += h2)
+	{
+		uint64_t b = h1 & mask;
+		__sync_fetch_and_or(&bits[b>>6], 1ULL << (b & 63));
+	}
+	
+	__sync_fetch_and_add(&count, 1ULL);
+}
+
+//Checks if a chunk may be in the filter
+bool ChunkFilter::may_contain(ChunkID const& chunk_id) const
+{
+	uint64_t h = mix_chunk_id(chunk_id),
+			 h1 = h,
+			 h2 = (h >> 32) | 1ULL;
+	
+	for(int i=0; i<hashes; ++i, h1 += h2)
+	{
+		uint64_t b = h1 & mask;
+		if(!(bits[b>>6] & (1ULL << (b & 63))))
+			return false;
+	}
+	return true;
+}
+
+//Restores a saved bit array
+bool ChunkFilter::load(const uint64_t* words, uint64_t n, int h, uint64_t c)
+{
+	//Bits set with other hashes would give false negatives
+	if(n != bits.size() || h != hashes)
+		return false;
+	copy(words, words + n, bits.begin());
+	count = c;
+	return true;
+}
+
+void ChunkFilter::clear()
+{
+	fill(bits.begin(), bits.end(), 0ULL);
+	count = 0;
+}
+
+};
@@ -0,0 +1,45 @@
+#ifndef CHUNK_FILTER_H
+#define CHUNK_FILTER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "constants.h"
+#include "chunk.h"
+
+namespace Game
+{
+	//A Bloom filter over chunk ids.  Used to skip database probes for chunks that have never
+	//been stored, so lookups for the (very common) never-generated chunks go straight to the
+	//world generator.  False positives just cost a probe, false negatives cannot happen.
+	//Inserts and queries are safe to call concurrently.
+	struct ChunkFilter
+	{
+		ChunkFilter(uint64_t num_bits, int num_hashes);
+	
+		void insert(ChunkID const&);
+		bool may_contain(ChunkID const&) const;
+		
+		//Removes all keys
+		void clear();
+		
+		//Number of inserts since the last clear (an upper bound on the key count)
+		uint64_t size() const { return count; }
+		
+		//Raw bit array, used to save the filter in a map image
+		const uint64_t* data() const { return &bits[0]; }
+		uint64_t num_words() const { return bits.size(); }
+		int num_hashes() const { return hashes; }
+		
+		//Restores the bit array, fails if the size or the number of hashes does not match
+		bool load(const uint64_t* words, uint64_t num_words, int num_hashes, uint64_t count);
+		
+	private:
+		uint64_t	mask, count;
+		int			hashes;
+		std::vector<uint64_t>	bits;
+	};
+};
+
+#endif
@@ -95,6 +95,13 @@ void Config::resetDefaults()
 	//Database paths
 	storeString("login_db_path", "data/login.tch");
 	storeString("map_db_path", "data/map.tch");
+	storeString("surface_db_path", "data/surface.tch");
+	storeString("map_image_path", "data/map.img");
+	
+	//Hot standby replication, a unix socket path for the primary to listen on and for the follower to connect to
+	storeString("replication_listen", "");
+	storeString("replication_follow", "");
+	storeInt("replication_max_queue", 1<<16);
 	
 	//Performance tweaks
 	storeFloat("tick_rate", 1.0 / 20.0);
@@ -109,6 +116,31 @@ void Config::resetDefaults()
 	storeInt("tc_map_free_pool_size", 10);
 	storeInt("tc_map_cache_size", 10 * (1<<20));
 	storeInt("tc_map_extra_memory", 128 * (1<<20));
+	storeInt("map_lazy_load", 1);
+	storeInt("map_filter_bits", (1<<27));
+	storeInt("map_filter_hashes", 5);
+	storeInt("num_generator_threads", 2);
+	storeFloat("generate_request_timeout", 2.0);
+	storeFloat("generate_tick_budget", 0.025);
+	storeFloat("physics_dense_fraction", 0.125);
+	storeString("physics_kernel", "bitplane");
+	storeInt("physics_max_lag", 4);
+	storeInt("physics_full_radius", 4);
+	storeInt("physics_reduced_radius", 12);
+	storeInt("physics_reduced_interval", 4);
+	storeInt("physics_max_catchup", 8);
+	storeInt("fluid_max_updates", 1<<16);
+	storeFloat("fluid_tick_budget", 0.005);
+	storeInt("random_tick_samples", 3);
+	storeInt("random_tick_radius", 4);
+	storeInt("lighting_radius", 3);
+	storeInt("lighting_max_chunks", 16);
+	
+	//World generator
+	storeInt("world_seed", 0);
+	storeFloat("worldgen_height_scale", 24.0);
+	storeFloat("worldgen_cave_threshold", 0.6);
+	storeInt("worldgen_column_cache_size", (1<<12));
 }
 
 };
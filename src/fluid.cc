@@ -0,0 +1,332 @@
+#include <stdint.h>
+#include <cstdio>
+#include <algorithm>
+
+#include <tbb/tick_count.h>
+#include <tbb/spin_mutex.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "physics.h"
+#include "fluid.h"
+
+//Uncomment this line to get dense logging for the fluid updates
+//#define FLUID_DEBUG 1
+
+#ifndef FLUID_DEBUG
+#define DEBUG_PRINTF(...)
+#else
+#define DEBUG_PRINTF(...)  fprintf(stderr,__VA_ARGS__)
+#endif
+
+using namespace std;
+using namespace tbb;
+
+namespace Game
+{
+
+//Horizontal neighbors, the order a cell starts in is rotated by position so floods spread evenly
+static const int FLUID_SIDES[4][2] =
+{
+	{-1, 0},
+	{ 0,-1},
+	{ 1, 0},
+	{ 0, 1}
+};
+
+//Cells which may flow after a cell changes: itself, the one above and its horizontal neighbors
+static const int FLUID_WAKE[6][3] =
+{
+	{ 0, 0, 0},
+	{ 0, 1, 0},
+	{-1, 0, 0},
+	{ 1, 0, 0},
+	{ 0, 0,-1},
+	{ 0, 0, 1}
+};
+
+Fluid::Fluid(Config* cfg, GameMap* map, Physics* phys) :
+	config(cfg),
+	game_map(map),
+	physics(phys),
+	last_scratch(NULL),
+	ticks(0),
+	updates(0),
+	changes(0),
+	throttled(0),
+	conflicts(0),
+	tick_time_total(0.0),
+	tick_time_max(0.0),
+	commit_estimate(0.0)
+{
+	max_updates	= config->readInt("fluid_max_updates");
+	tick_budget	= config->readFloat("fluid_tick_budget");
+}
+
+Fluid::~Fluid()
+{
+	for(auto iter = scratch.begin(); iter != scratch.end(); ++iter)
+		delete iter->second;
+	for(int i=0; i<free_scratch.size(); ++i)
+		delete free_scratch[i];
+}
+
+void Fluid::wake(int x, int y, int z)
+{
+	spin_mutex::scoped_lock L(incoming_lock);
+
+	//The cell below may have been holding the water up
+	Cell below = { x, y-1, z };
+	incoming.push_back(below);
+	for(int i=0; i<6; ++i)
+	{
+		Cell c = { x + FLUID_WAKE[i][0], y + FLUID_WAKE[i][1], z + FLUID_WAKE[i][2] };
+		incoming.push_back(c);
+	}
+}
+
+//Adds a cell to the back of the queue unless it is already waiting
+void Fluid::enqueue(int x, int y, int z)
+{
+	Cell c = { x, y, z };
+	if(queued.insert(c).second)
+		queue.push_back(c);
+}
+
+//Returns the working copy of a chunk, reading it on first use.  Chunks which are not in memory are not
+//loaded, their cells are left out of the tick as if they were solid.
+Fluid::Scratch* Fluid::chunk(int x, int y, int z)
+{
+	ChunkID chunk_id(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z);
+	if(last_scratch != NULL && chunk_id == last_chunk)
+		return last_scratch;
+	
+	auto iter = scratch.find(chunk_id);
+	if(iter == scratch.end())
+	{
+		Scratch* s;
+		if(free_scratch.empty())
+			s = new Scratch();
+		else
+		{
+			s = free_scratch.back();
+			free_scratch.pop_back();
+		}
+		GameMap::const_accessor acc;
+		s->loaded = game_map->find_chunk_buffer(acc, chunk_id);
+		if(s->loaded)
+		{
+			s->version = acc->second->last_modified();
+			acc->second->decompress_chunk(s->blocks);
+		}
+		s->dirty = false;
+		iter = scratch.insert(make_pair(chunk_id, s)).first;
+	}
+	last_scratch = iter->second;
+	last_chunk = chunk_id;
+	return last_scratch;
+}
+
+static inline int cell_offset(int x, int y, int z)
+{
+	return	(x & (CHUNK_X-1)) +
+			((z & (CHUNK_Z-1)) << CHUNK_X_S) +
+			((y & (CHUNK_Y-1)) << (CHUNK_X_S + CHUNK_Z_S));
+}
+
+//Cells outside the map or in unloaded chunks read as stone, so water never moves into them
+Block Fluid::get_cell(int x, int y, int z)
+{
+	if(x < 0 || y < 0 || z < 0 || x >= COORD_MAX_X || y >= COORD_MAX_Y || z >= COORD_MAX_Z)
+		return Block(BlockType_Stone);
+
+	auto s = chunk(x, y, z);
+	if(!s->loaded)
+		return Block(BlockType_Stone);
+	return s->blocks[cell_offset(x, y, z)];
+}
+
+void Fluid::set_cell(int x, int y, int z, Block b)
+{
+	auto s = chunk(x, y, z);
+	s->blocks[cell_offset(x, y, z)] = b;
+	s->dirty = true;
+	
+	Cell c = { x, y, z };
+	changed.push_back(c);
+}
+
+//Moves the water in one cell
+void Fluid::update_cell(Cell const& c)
+{
+	int start = level(get_cell(c.x, c.y, c.z)),
+		l = start;
+	if(l <= 0)
+		return;
+
+	//Pour into the cell below
+	int bl = level(get_cell(c.x, c.y-1, c.z));
+	if(bl >= 0 && bl < FLUID_MAX_LEVEL)
+	{
+		int m = min(l, FLUID_MAX_LEVEL - bl);
+		set_cell(c.x, c.y-1, c.z, water(bl + m));
+		enqueue(c.x, c.y-1, c.z);
+		l -= m;
+	}
+
+	//Level out with the horizontal neighbors
+	int k0 = (c.x + c.z) & 3;
+	for(int i=0; i<4 && l >= 2; ++i)
+	{
+		int k = (k0 + i) & 3,
+			nx = c.x + FLUID_SIDES[k][0],
+			nz = c.z + FLUID_SIDES[k][1];
+
+		int sl = level(get_cell(nx, c.y, nz));
+		if(sl < 0 || l - sl < 2)
+			continue;
+
+		set_cell(nx, c.y, nz, water(sl + 1));
+		enqueue(nx, c.y, nz);
+		--l;
+	}
+
+	if(l == start)
+		return;
+	set_cell(c.x, c.y, c.z, water(l));
+
+	//The water which is left, or the water around the cell that drained, may flow next tick
+	for(int i=0; i<6; ++i)
+	{
+		int x = c.x + FLUID_WAKE[i][0],
+			y = c.y + FLUID_WAKE[i][1],
+			z = c.z + FLUID_WAKE[i][2];
+		if(level(get_cell(x, y, z)) > 0)
+			enqueue(x, y, z);
+	}
+}
+
+void Fluid::tick(uint64_t t)
+{
+	auto start = tick_count::now();
+
+	{
+		spin_mutex::scoped_lock L(incoming_lock);
+		for(int i=0; i<incoming.size(); ++i)
+			enqueue(incoming[i].x, incoming[i].y, incoming[i].z);
+		incoming.clear();
+	}
+
+	if(queue.empty())
+		return;
+
+	//Only the cells queued before this tick are due, the clock is checked every few cells.  The budget
+	//leaves room for writing the chunks back, estimated from the last few commits.
+	double update_budget = tick_budget - commit_estimate;
+	int due = queue.size(), n = 0;
+	for(; n<due && n<max_updates; ++n)
+	{
+		if((n & 63) == 63 && (tick_count::now() - start).seconds() > update_budget)
+			break;
+
+		Cell c = queue.front();
+		queue.pop_front();
+		queued.erase(c);
+
+		updated.push_back(c);
+		update_cell(c);
+	}
+
+	if(n < due)
+	{
+		DEBUG_PRINTF("Fluid over budget, %d of %d cells updated\n", n, due);
+		++throttled;
+	}
+
+	auto commit_start = tick_count::now();
+	commit(t);
+	double commit_time = (tick_count::now() - commit_start).seconds();
+	commit_estimate = 0.75 * commit_estimate + 0.25 * commit_time;
+
+	double elapsed = (tick_count::now() - start).seconds();
+	++ticks;
+	updates += n;
+	tick_time_total += elapsed;
+	tick_time_max = max(tick_time_max, elapsed);
+}
+
+//Writes the changed chunks back to the map in one piece, so water can not be lost or duplicated between chunks
+void Fluid::commit(uint64_t t)
+{
+	vector<GameMap::ChunkCommit> chunks;
+	for(auto iter = scratch.begin(); iter != scratch.end(); ++iter)
+	{
+		auto s = iter->second;
+		if(!s->dirty)
+			continue;
+
+		GameMap::ChunkCommit c = { iter->first, s->version, t, s->blocks, NULL, 0 };
+		chunks.push_back(c);
+	}
+
+	if(changed.empty() || chunks.empty())
+	{
+		//Nothing moved
+	}
+	else if(game_map->commit_chunks(&chunks[0], chunks.size()))
+	{
+		for(int i=0; i<chunks.size(); ++i)
+			game_map->invalidate_surfaces(chunks[i].id);
+
+		sort(changed.begin(), changed.end());
+		changed.erase(unique(changed.begin(), changed.end()), changed.end());
+		changes += changed.size();
+		
+		//Let the physics react to water that moved, sand resting on it may fall
+		if(physics != NULL)
+		{
+			for(int i=0; i<changed.size(); ++i)
+			{
+				auto const& c = changed[i];
+				physics->touch_block(get_cell(c.x, c.y, c.z), c.x, c.y, c.z);
+			}
+		}
+	}
+	else
+	{
+		//Something else wrote one of the chunks since it was read, redo the tick's cells from the map
+		DEBUG_PRINTF("Fluid commit conflict, retrying %d cells\n", (int)updated.size());
+		++conflicts;
+		for(int i=updated.size()-1; i>=0; --i)
+		{
+			Cell c = updated[i];
+			if(queued.insert(c).second)
+				queue.push_front(c);
+		}
+	}
+
+	for(auto iter = scratch.begin(); iter != scratch.end(); ++iter)
+		free_scratch.push_back(iter->second);
+	scratch.clear();
+	last_scratch = NULL;
+	updated.clear();
+	changed.clear();
+}
+
+void Fluid::print_stats()
+{
+	printf("Fluid: %d cells queued, %ld updates and %ld changes over %ld ticks, %ld commit conflicts\n",
+		(int)queue.size(), updates, changes, ticks, conflicts);
+	printf("  Tick time: mean %.2f ms, max %.2f ms, commit %.2f ms, budget %.2f ms / %d cells, %ld ticks throttled\n",
+		ticks > 0 ? 1000.0 * tick_time_total / ticks : 0.0,
+		1000.0 * tick_time_max,
+		1000.0 * commit_estimate,
+		1000.0 * tick_budget, max_updates, throttled);
+
+	ticks = updates = changes = throttled = conflicts = 0;
+	tick_time_total = tick_time_max = 0.0;
+}
+
+};
@@ -0,0 +1,139 @@
+#ifndef FLUID_H
+#define FLUID_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <tbb/tick_count.h>
+#include <tbb/spin_mutex.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "physics.h"
+
+namespace Game
+{
+	//Units of water a block holds
+	const int FLUID_MAX_LEVEL = 8;
+
+	//Water flow.  The first state byte of a water block counts how many units it is short of full, so
+	//a plain water block is full.  A cell first pours as much as fits into the cell below, then gives
+	//one unit to each horizontal neighbor which is at least two units lower.  Volume is conserved and
+	//every flood settles.
+	//
+	//Cells which may flow wait in a queue, each at most once.  A cell woken while the queue is worked
+	//waits for the next tick, so water moves one cell per tick.  A tick stops after fluid_max_updates
+	//cells or fluid_tick_budget seconds including the commit, whichever comes first, and the rest of
+	//the queue carries over.  Water never flows into chunks which are not in memory, nor out of the map.
+	struct Fluid
+	{
+		Fluid(Config* config, GameMap* game_map, Physics* physics);
+		~Fluid();
+
+		//Schedules a cell and its neighbors, may be called from any thread
+		void wake(int x, int y, int z);
+
+		//Works the queue within the budget and commits the result, called once per tick from the world loop
+		void tick(uint64_t t);
+
+		//Cells waiting to be updated
+		int backlog() const { return queue.size(); }
+
+		void print_stats();
+
+		//Units of water in a block, 0 for air and -1 for blocks water can not enter
+		static int level(Block b)
+		{
+			if(b.type() == BlockType_Water)
+				return FLUID_MAX_LEVEL - b.state(0);
+			return b.type() == BlockType_Air ? 0 : -1;
+		}
+
+		//A block holding the given units of water
+		static Block water(int level)
+		{
+			return level <= 0 ? Block(BlockType_Air) : Block(BlockType_Water, FLUID_MAX_LEVEL - level);
+		}
+
+	private:
+
+		struct Cell
+		{
+			int x, y, z;
+
+			bool operator==(Cell const& other) const
+			{
+				return x == other.x && y == other.y && z == other.z;
+			}
+			
+			bool operator<(Cell const& other) const
+			{
+				if(y != other.y) return y < other.y;
+				if(z != other.z) return z < other.z;
+				return x < other.x;
+			}
+		};
+
+		struct CellHash
+		{
+			size_t operator()(Cell const& c) const
+			{
+				return ((size_t)c.x * 73856093) ^ ((size_t)c.y * 19349663) ^ ((size_t)c.z * 83492791);
+			}
+		};
+
+		//A chunk read from the map for the current tick
+		struct Scratch
+		{
+			uint64_t version;
+			bool loaded, dirty;
+			Block blocks[CHUNK_SIZE];
+		};
+		typedef std::unordered_map<ChunkID, Scratch*, ChunkIDHashCompare> scratch_map_t;
+
+		//Interface to separate sytems, physics may be NULL offline
+		Config* config;
+		GameMap* game_map;
+		Physics* physics;
+
+		//Budget per tick, and a running estimate of the time it takes to commit a tick
+		int max_updates;
+		double tick_budget, commit_estimate;
+
+		//Wakes from other threads, moved to the queue at the start of a tick
+		tbb::spin_mutex incoming_lock;
+		std::vector<Cell> incoming;
+
+		//Cells to update in order, queued holds the same cells for coalescing
+		std::deque<Cell> queue;
+		std::unordered_set<Cell, CellHash> queued;
+
+		//Chunks touched by the current tick, scratch buffers are reused between ticks
+		scratch_map_t scratch;
+		std::vector<Scratch*> free_scratch;
+		Scratch* last_scratch;
+		ChunkID last_chunk;
+
+		//Cells updated and changed by the current tick
+		std::vector<Cell> updated, changed;
+
+		//Statistics since the last print
+		uint64_t ticks, updates, changes, throttled, conflicts;
+		double tick_time_total, tick_time_max;
+
+		void enqueue(int x, int y, int z);
+		Scratch* chunk(int x, int y, int z);
+		Block get_cell(int x, int y, int z);
+		void set_cell(int x, int y, int z, Block b);
+		void update_cell(Cell const&);
+		void commit(uint64_t t);
+	};
+};
+
+#endif
+
@@ -1,5 +1,10 @@
 #include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <stdint.h>
 
 #include <tbb/scalable_allocator.h>
@@ -8,12 +13,18 @@
 #include <tbb/spin_rw_mutex.h>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_hash_map.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include "map.pb.h"
 
 #include "constants.h"
 #include "misc.h"
 #include "config.h"
 #include "chunk.h"
+#include "map_image.h"
 #include "game_map.h"
+#include "replication.h"
 
 
 using namespace tbb;
@@ -31,6 +42,17 @@ using namespace std;
 namespace Game
 {
 
+//Chunks a surface chunk is built from, in lock order y-z-x, low to high
+static const int SURFACE_DELTA[][3] =
+{
+	{ 0,-1, 0},
+	{ 0, 0,-1},
+	{-1, 0, 0},
+	{ 0, 0, 0},
+	{ 1, 0, 0},
+	{ 0, 0, 1},
+	{ 0, 1, 0}
+};
 	
 
 //-------------------------------------------------------------------
@@ -40,15 +62,20 @@ namespace Game
 GameMap::GameMap(Config* cfg) : 
 	world_gen(new WorldGen(cfg)), 
 	config(cfg),
+	replicator(NULL),
+	stored_chunks(cfg->readInt("map_filter_bits"), cfg->readInt("map_filter_hashes")),
+	generation_queue(cfg),
 	chunks(config->readInt("num_chunk_buckets")),
 	surface_chunks(config->readInt("num_surface_chunk_buckets"))
 {
 	initialize_db();
+	start_generators();
 }
 
 GameMap::~GameMap()
 {
-	//Close database
+	//Finish in-flight generations and close database
+	stop_generators();
 	shutdown_db();
 	
 	//Iterate over all chunk buffers and deallocate
@@ -62,46 +89,191 @@ GameMap::~GameMap()
 		delete iter->second;
 	}
 	
+	for(auto iter = column_heights.begin(); iter != column_heights.end(); ++iter)
+	{
+		delete iter->second;
+	}
+	
 	delete world_gen;
 }
 
+//Generated terrain height, cached by the world generator
+int GameMap::generated_column_top(int x, int z)
+{
+	return world_gen->column_top(x, z);
+}
+
 //-------------------------------------------------------------------
-// Chunk accessors
+// Heightmaps
 //-------------------------------------------------------------------
 
-//Retrieves a mutable accessor to the chunk buffer
-void GameMap::get_chunk_buffer(accessor& acc, ChunkID const& chunk_id)
+int GameMap::column_top(int x, int z)
 {
-	if(!chunks.find(acc, chunk_id))
+	//Negative coordinates would wrap into another column
+	if(x < 0 || z < 0 || x >= COORD_MAX_X || z >= COORD_MAX_Z)
+		return -1;
+
+	column_map_t::const_accessor acc;
+	if(!column_heights.find(acc, ChunkID(x/CHUNK_X, 0, z/CHUNK_Z)))
+		return -1;
+	return acc->second->top[(x%CHUNK_X) + (z%CHUNK_Z) * CHUNK_X];
+}
+
+bool GameMap::get_column_heights(uint32_t cx, uint32_t cz, int* heights)
+{
+	if(cx >= CHUNK_IDX_MAX || cz >= CHUNK_IDX_MAX)
+		return false;
+
+	column_map_t::const_accessor acc;
+	if(!column_heights.find(acc, ChunkID(cx, 0, cz)))
+		return false;
+	memcpy(heights, acc->second->top, sizeof(acc->second->top));
+	return true;
+}
+
+void GameMap::update_heights(ChunkID const& chunk_id, ChunkBuffer const& chunk)
+{
+	const int LAYER = CHUNK_X * CHUNK_Z;
+	int8_t local[LAYER];
+	chunk.column_tops(local);
+	
+	column_map_t::accessor acc;
+	if(column_heights.insert(acc, ChunkID(chunk_id.x, 0, chunk_id.z)))
 	{
-		if(chunks.insert(acc, chunk_id))
+		acc->second = new ColumnHeights();
+		for(int i=0; i<LAYER; ++i)
+			acc->second->top[i] = -1;
+	}
+	auto column = acc->second;
+	
+	auto& tops = column->chunk_tops[chunk_id.y];
+	tops.assign(local, local + LAYER);
+	
+	int base = chunk_id.y * CHUNK_Y;
+	for(int i=0; i<LAYER; ++i)
+	{
+		int h = local[i] < 0 ? -1 : base + local[i],
+			top = column->top[i];
+		if(h > top)
 		{
-			acc->second = new ChunkBuffer();
-			generate_chunk(acc, chunk_id);
+			column->top[i] = h;
 		}
-		else
+		else if(base <= top && top < base + CHUNK_Y && h < top)
 		{
-			chunks.find(acc, chunk_id);
+			//The top block was removed, the next one down is in this chunk or the first chunk below with a block in the column
+			if(h < 0)
+			{
+				auto iter = column->chunk_tops.find(chunk_id.y);
+				while(iter != column->chunk_tops.begin())
+				{
+					--iter;
+					if(iter->second[i] >= 0)
+					{
+						h = iter->first * CHUNK_Y + iter->second[i];
+						break;
+					}
+				}
+			}
+			column->top[i] = h;
 		}
 	}
 }
 
-//Retrieves a const accessor to the chunk buffer, slightly different since we
-//can't reuse the accessor for the 
-void GameMap::get_chunk_buffer(const_accessor& acc, ChunkID const& chunk_id)
+//Edits a block in place
+bool GameMap::set_block(Block b, uint64_t t, int x, int y, int z)
+{
+	BlockRecord rec = { t, x, y, z, b };
+	return set_blocks(ChunkID(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z), t, &rec, 1);
+}
+
+//Edits a batch of blocks in one chunk under a single lock
+bool GameMap::set_blocks(ChunkID const& chunk_id, uint64_t t, BlockRecord const* writes, int count, Block const* expected)
 {
-	if(!chunks.find(acc, chunk_id))
 	{
-		accessor  mut_acc;
-		if(chunks.insert(mut_acc, chunk_id))
+		accessor acc;
+		get_chunk_buffer(acc, chunk_id);
+		
+		//The new version must differ from the one a running physics batch read, so its commit backs off
+		uint64_t version = max(t, acc->second->last_modified() + 1);
+		bool changed = false;
+		for(int i=0; i<count; ++i)
 		{
-			mut_acc->second = new ChunkBuffer();
-			generate_chunk(mut_acc, chunk_id);
-			mut_acc.release();
+			auto const& w = writes[i];
+			if(expected != NULL && !(acc->second->get_block(w.x%CHUNK_X, w.y%CHUNK_Y, w.z%CHUNK_Z) == expected[i]))
+				continue;
+			if(acc->second->set_block(w.b, w.x%CHUNK_X, w.y%CHUNK_Y, w.z%CHUNK_Z, version))
+				changed = true;
+		}
+		if(!changed)
+			return false;
+		update_heights(chunk_id, *acc->second);
+			
+		if(replicator != NULL)
+		{
+			acc->second->cache_protocol_buffer_data();
+			replicator->push_chunk(chunk_id, *acc->second);
 		}
+	}
+	
+	DEBUG_PRINTF("Set %d blocks in chunk %d,%d,%d\n", count, chunk_id.x, chunk_id.y, chunk_id.z);
+	
+	mark_dirty(chunk_id);
+	invalidate_surfaces(chunk_id);
+	return true;
+}
+
+//Retrieves a chunk only if it is already in memory, without queueing it
+bool GameMap::find_chunk_buffer(const_accessor& acc, ChunkID const& chunk_id)
+{
+	return chunks.find(acc, chunk_id);
+}
+
+//-------------------------------------------------------------------
+// Chunk accessors
+//-------------------------------------------------------------------
+
+//Retrieves a mutable accessor to the chunk buffer
+void GameMap::get_chunk_buffer(accessor& acc, ChunkID const& chunk_id)
+{
+	while(!chunks.find(acc, chunk_id))
+		wait_for_chunk(chunk_id);
+}
+
+//Retrieves a const accessor to the chunk buffer
+void GameMap::get_chunk_buffer(const_accessor& acc, ChunkID const& chunk_id)
+{
+	while(!chunks.find(acc, chunk_id))
+		wait_for_chunk(chunk_id);
+}
+
+//Retrieves a chunk only if it is already in memory, otherwise queues it
+bool GameMap::try_get_chunk_buffer(const_accessor& acc, ChunkID const& chunk_id, float priority)
+{
+	if(chunks.find(acc, chunk_id))
+		return true;
+	
+	request_chunk_async(chunk_id, priority);
+	return false;
+}
+
+//Checks that all the chunks a surface chunk is built from are in memory, queueing any that are not
+bool GameMap::surface_sources_ready(ChunkID const& chunk_id, float priority)
+{
+	bool ready = true;
+	for(int i=0; i<7; ++i)
+	{
+		ChunkID source(
+			chunk_id.x + SURFACE_DELTA[i][0],
+			chunk_id.y + SURFACE_DELTA[i][1],
+			chunk_id.z + SURFACE_DELTA[i][2]);
 		
-		chunks.find(acc, chunk_id);
+		if(!chunks.count(source))
+		{
+			request_chunk_async(source, priority);
+			ready = false;
+		}
 	}
+	return ready;
 }
 
 //Retrieves a surface chunk buffer
@@ -112,7 +284,8 @@ void GameMap::get_surface_chunk_buffer(accessor& acc, ChunkID const& chunk_id)
 		if(surface_chunks.insert(acc, chunk_id))
 		{
 			acc->second = new ChunkBuffer();
-			generate_surface_chunk(acc, chunk_id);
+			if(!load_surface_chunk(acc, chunk_id))
+				generate_surface_chunk(acc, chunk_id);
 			return;
 		}
 		
@@ -133,7 +306,8 @@ void GameMap::get_surface_chunk_buffer(const_accessor& acc, ChunkID const& chunk
 		if(surface_chunks.insert(mut_acc, chunk_id))
 		{
 			mut_acc->second = new ChunkBuffer();
-			generate_surface_chunk(mut_acc, chunk_id);
+			if(!load_surface_chunk(mut_acc, chunk_id))
+				generate_surface_chunk(mut_acc, chunk_id);
 			mut_acc.release();
 		}
 		
@@ -174,11 +348,38 @@ Block GameMap::get_block(int x, int y, int z)
 //-------------------------------------------------------------------
 
 //Chunk copying methods
-void GameMap::get_chunk(ChunkID const& chunk_id, Block* buffer, int stride_x,  int stride_xz)
+uint64_t GameMap::get_chunk(ChunkID const& chunk_id, Block* buffer, int stride_x,  int stride_xz)
 {
 	const_accessor acc;
 	get_chunk_buffer(acc, chunk_id);
 	acc->second->decompress_chunk(buffer, stride_x, stride_xz);
+	return acc->second->last_modified();
+}
+
+//Replaces the contents of a locked chunk, returns true if it changed
+bool GameMap::store_chunk(accessor& acc, ChunkID const& chunk_id, uint64_t t, Block* buffer, int stride_x, int stride_xz)
+{
+	ChunkBuffer::interval_tree_t prev(acc->second->interval_tree());
+	acc->second->compress_chunk(buffer, stride_x, stride_xz);
+
+	if(acc->second->equals(prev))
+	{
+		DEBUG_PRINTF("Chunk %d,%d,%d did not change\n", chunk_id.x, chunk_id.y, chunk_id.z);
+		return false;
+	}
+	
+	acc->second->set_last_modified(t);
+	update_heights(chunk_id, *acc->second);
+	
+	//Forward the new version to the follower while the chunk is still locked, so updates to
+	//the same chunk are streamed in order
+	if(replicator != NULL)
+	{
+		acc->second->cache_protocol_buffer_data();
+		replicator->push_chunk(chunk_id, *acc->second);
+	}
+	
+	return true;
 }
 
 //Updates a chunk
@@ -189,61 +390,157 @@ bool GameMap::update_chunk(ChunkID const& chunk_id, uint64_t t, Block* buffer, i
 	{
 		accessor acc;
 		get_chunk_buffer(acc, chunk_id);
-	
-		ChunkBuffer::interval_tree_t prev(acc->second->interval_tree());
-		acc->second->compress_chunk(buffer, stride_x, stride_xz);
-	
-		if(acc->second->equals(prev))
-		{
-			DEBUG_PRINTF("Chunk %d,%d,%d did not change\n", chunk_id.x, chunk_id.y, chunk_id.z);
+		if(!store_chunk(acc, chunk_id, t, buffer, stride_x, stride_xz))
 			return false;
-		}
-		
-		acc->second->set_last_modified(t);
 	}
 	
-	DEBUG_PRINTF("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
-	
 	DEBUG_PRINTF("Chunk %d,%d,%d changed, invalidating surface\n", chunk_id.x, chunk_id.y, chunk_id.z);
 	
 	//Mark the chunk as dirty
 	mark_dirty(chunk_id);
+	invalidate_surfaces(chunk_id);
+	return true;
+}
+
+//Updates a group of chunks computed from earlier versions
+bool GameMap::commit_chunks(ChunkCommit const* chunks, int count)
+{
+	//Lock the chunks in y-z-x order, the same as surface generation
+	vector<int> order(count);
+	for(int i=0; i<count; ++i)
+		order[i] = i;
+	sort(order.begin(), order.end(), [&](int a, int b) { return chunks[a].id < chunks[b].id; });
 	
-	const static int delta[][3] =
+	vector<bool> changed(count);
+	vector<Block*> merged(count, (Block*)NULL);
+	bool ok = true;
 	{
-		{ 0,-1, 0},
-		{ 0, 0,-1},
-		{-1, 0, 0},
-		{ 0, 0, 0},
-		{ 1, 0, 0},
-		{ 0, 0, 1},
-		{ 0, 1, 0} 
-	};
-	
+		accessor* acc = new accessor[count];
+		for(int i=0; i<count && ok; ++i)
+		{
+			auto const& c = chunks[order[i]];
+			get_chunk_buffer(acc[i], c.id);
+			if(acc[i]->second->last_modified() == c.version)
+				continue;
+			
+			DEBUG_PRINTF("Chunk %d,%d,%d was modified since version %ld\n", c.id.x, c.id.y, c.id.z, c.version);
+			if(c.changes == NULL)
+			{
+				ok = false;
+				break;
+			}
+			
+			//Replay the changed cells over the newer version, unless one of them was also written
+			merged[i] = new Block[CHUNK_SIZE];
+			acc[i]->second->decompress_chunk(merged[i]);
+			for(int j=0; j<c.num_changes && ok; ++j)
+			{
+				int k = c.changes[j].offset;
+				if(merged[i][k] != c.changes[j].prev)
+				{
+					DEBUG_PRINTF("Chunk %d,%d,%d cell %d was written by both\n", c.id.x, c.id.y, c.id.z, k);
+					ok = false;
+				}
+				merged[i][k] = c.blocks[k];
+			}
+		}
+		
+		//Stamps never go backwards, a batch may have read a chunk after a player edit stamped it with a later tick
+		for(int i=0; i<count && ok; ++i)
+		{
+			auto const& c = chunks[order[i]];
+			uint64_t t = max(c.t, acc[i]->second->last_modified() + 1);
+			changed[i] = store_chunk(acc[i], c.id, t, merged[i] != NULL ? merged[i] : c.blocks, CHUNK_X, CHUNK_X * CHUNK_Z);
+		}
+		delete[] acc;
+	}
 	
+	for(int i=0; i<count; ++i)
+		delete[] merged[i];
 	
-	//Invalidate surface chunk (if it exists)
+	for(int i=0; i<count && ok; ++i)
+	{
+		if(changed[i])
+			mark_dirty(chunks[order[i]].id);
+	}
+	return ok;
+}
+
+//Invalidates all surface chunks which depend on the given chunk
+void GameMap::invalidate_surfaces(ChunkID const& chunk_id)
+{
 	for(int i=0; i<7; ++i)
 	{
 		accessor surface_acc;
 		if(surface_chunks.find(surface_acc, ChunkID(
-			chunk_id.x + delta[i][0],
-			chunk_id.y + delta[i][1],
-			chunk_id.z + delta[i][2]) ) )
+			chunk_id.x + SURFACE_DELTA[i][0],
+			chunk_id.y + SURFACE_DELTA[i][1],
+			chunk_id.z + SURFACE_DELTA[i][2]) ) )
 		{
 			surface_acc->second->set_valid(false);
-			surface_acc.release();
 		}
-		else
+	}
+}
+
+//Applies a chunk received from the replication stream.  Older versions are ignored, so
+//records may safely be replayed.
+bool GameMap::apply_chunk(Network::Chunk const& c)
+{
+	if(!c.has_data())
+		return false;
+
+	ChunkID chunk_id(c.x(), c.y(), c.z());
+	
+	{
+		accessor acc;
+		if(chunks.insert(acc, chunk_id))
+		{
+			acc->second = new ChunkBuffer();
+		}
+		else if(acc->second->valid() && acc->second->last_modified() > c.last_modified())
 		{
-			DEBUG_PRINTF("no surface\n");
+			return false;
 		}
+		
+		acc->second->parse_from_protocol_buffer(c);
+		acc->second->set_valid(true);
+		update_heights(chunk_id, *acc->second);
 	}
 	
-		
+	mark_dirty(chunk_id);
+	invalidate_surfaces(chunk_id);
 	return true;
 }
 
+//Visits every chunk record in the map database, stops early if visit returns false
+bool GameMap::read_stored_chunks(function<bool (Network::Chunk const&)> const& visit)
+{
+	auto key = tcxstrnew();
+	auto value = tcxstrnew();
+	bool result = true;
+	
+	tchdbiterinit(map_db);
+	while(tchdbiternext3(map_db, key, value))
+	{
+		if(tcxstrsize(key) != 3*sizeof(uint32_t))
+			continue;
+		
+		Network::Chunk pbuffer;
+		if(!pbuffer.ParseFromArray(tcxstrptr(value), tcxstrsize(value)))
+			continue;
+		
+		if(!visit(pbuffer))
+		{
+			result = false;
+			break;
+		}
+	}
+	
+	tcxstrdel(key);
+	tcxstrdel(value);
+	return result;
+}
+
 
 //Retrieves a chunk protocol buffer
 Network::Chunk* GameMap::get_chunk_pbuffer(ChunkID const& chunk_id)
@@ -276,8 +573,20 @@ Network::Chunk* GameMap::get_chunk_pbuffer(ChunkID const& chunk_id)
 
 
 //Protocol buffer methods
-Network::ServerPacket* GameMap::get_net_chunk(ChunkID const& chunk_id, uint64_t timestamp)
+Network::ServerPacket* GameMap::get_net_chunk(ChunkID const& chunk_id, uint64_t timestamp, float priority)
 {
+	//Streaming never waits on generation, if the surface chunk would need chunks which are
+	//not in memory yet they get queued and the caller tries again later
+	{
+		const_accessor acc;
+		if(!surface_chunks.find(acc, chunk_id) || !acc->second->valid())
+		{
+			acc.release();
+			if(!surface_sources_ready(chunk_id, priority))
+				return NULL;
+		}
+	}
+
 	//Use const accessor first to avoid exclusive locking
 	const_accessor acc;
 	get_surface_chunk_buffer(acc, chunk_id);
@@ -318,15 +627,218 @@ Network::ServerPacket* GameMap::get_net_chunk(ChunkID const& chunk_id, uint64_t
 // Chunk generation
 //-------------------------------------------------------------------
 
+ChunkFuture::ChunkFuture() : done(false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	ref_count = 1;
+}
+
+ChunkFuture::~ChunkFuture()
+{
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void ChunkFuture::wait()
+{
+	MutexLock L(&lock);
+	while(!done)
+		pthread_cond_wait(&cond, &lock);
+}
+
+void ChunkFuture::complete()
+{
+	MutexLock L(&lock);
+	done = true;
+	pthread_cond_broadcast(&cond);
+}
+
+//Registers interest in a chunk which is not in memory.  Returns a future with a reference held
+//for the caller, or NULL if the chunk showed up in the mean time.  If owner is set, nobody else
+//is generating the chunk and the caller must see to it; the future then carries a second
+//reference for whoever runs the generation.
+ChunkFuture* GameMap::request_chunk(ChunkID const& chunk_id, bool& owner)
+{
+	future_map_t::accessor acc;
+	if(!generating.insert(acc, chunk_id))
+	{
+		owner = false;
+		acc->second->acquire();
+		return acc->second;
+	}
+	
+	//A generation may have just finished and retired its future
+	if(chunks.count(chunk_id))
+	{
+		generating.erase(acc);
+		return NULL;
+	}
+	
+	owner = true;
+	acc->second = new ChunkFuture();
+	acc->second->acquire();
+	return acc->second;
+}
+
+//Blocks until a chunk is in memory.  If no one is working on the chunk yet, it is generated on the
+//calling thread so blocking callers never wait behind the generator queue.
+void GameMap::wait_for_chunk(ChunkID const& chunk_id)
+{
+	bool owner;
+	auto future = request_chunk(chunk_id, owner);
+	if(future == NULL)
+		return;
+	
+	ChunkFuture* queued;
+	if(owner)
+		run_generation(chunk_id, future);
+	else if(generation_queue.take(chunk_id, queued))
+		run_generation(chunk_id, queued);
+	else
+		future->wait();
+	future->release();
+}
+
+//Queues a chunk for the generator threads if it is not in memory, or bumps its priority if it is queued
+void GameMap::request_chunk_async(ChunkID const& chunk_id, float priority)
+{
+	if(chunks.count(chunk_id) || generation_queue.refresh(chunk_id, priority))
+		return;
+
+	bool owner;
+	auto future = request_chunk(chunk_id, owner);
+	if(future == NULL)
+		return;
+	
+	//The queued request carries the generator's reference, ours is dropped either way
+	if(owner)
+		generation_queue.push(chunk_id, future, priority);
+	future->release();
+}
+
+//Abandons a queued generation nobody is waiting for, the chunk can be requested again later
+bool GameMap::drop_generation(ChunkID const& chunk_id, ChunkFuture* future)
+{
+	//New waiters only acquire the future while holding its entry, so the count is stable here
+	future_map_t::accessor acc;
+	if(!generating.find(acc, chunk_id) || future->references() > 1)
+		return false;
+	
+	generating.erase(acc);
+	future->complete();
+	future->release();
+	return true;
+}
+
+//Loads or generates a chunk without holding any map locks, then publishes it and wakes up waiters
+void GameMap::run_generation(ChunkID const& chunk_id, ChunkFuture* future)
+{
+	auto chunk = new ChunkBuffer();
+	if(!load_chunk(chunk, chunk_id))
+		generate_chunk(chunk, chunk_id);
+	
+	{
+		accessor acc;
+		if(chunks.insert(acc, chunk_id))
+		{
+			acc->second = chunk;
+			update_heights(chunk_id, *chunk);
+		}
+		else
+			delete chunk;	//Replicated while we were generating, keep that version
+	}
+	
+	//Retire the future only after the chunk is visible, see request_chunk
+	generating.erase(chunk_id);
+	future->complete();
+	future->release();
+}
+
+void GameMap::start_generators()
+{
+	struct GeneratorWorker
+	{
+		GameMap* game_map;
+		
+		void operator()()
+		{
+			auto& queue = game_map->generation_queue;
+		
+			while(game_map->generators_running)
+			{
+				ChunkID chunk_id;
+				ChunkFuture* future;
+				bool stale;
+				
+				if(!queue.has_budget() || !queue.pop(chunk_id, future, stale))
+				{
+					this_thread::sleep_for(tick_count::interval_t(0.001));
+					continue;
+				}
+				
+				//Players moved on before we got to it
+				if(stale && game_map->drop_generation(chunk_id, future))
+				{
+					queue.count_dropped();
+					continue;
+				}
+				
+				auto start = tick_count::now();
+				game_map->run_generation(chunk_id, future);
+				queue.charge((tick_count::now() - start).seconds());
+			}
+		}
+	};
+	
+	generators_running = true;
+	
+	//Streaming depends on the generator threads, so always run at least one
+	int n = max(1, (int)config->readInt("num_generator_threads"));
+	for(int i=0; i<n; ++i)
+		generator_threads.push_back(new thread((GeneratorWorker){this}));
+}
+
+void GameMap::stop_generators()
+{
+	generators_running = false;
+	
+	for(int i=0; i<generator_threads.size(); ++i)
+	{
+		generator_threads[i]->join();
+		delete generator_threads[i];
+	}
+	generator_threads.clear();
+	
+	//Resolve whatever is left so nobody is left waiting
+	ChunkID chunk_id;
+	ChunkFuture* future;
+	bool stale;
+	while(generation_queue.pop(chunk_id, future, stale))
+	{
+		if(!drop_generation(chunk_id, future))
+			run_generation(chunk_id, future);
+	}
+}
+
 //Generates a chunk, if it exists
-void GameMap::generate_chunk(accessor& acc, ChunkID const& chunk_id)
+void GameMap::generate_chunk(ChunkBuffer* chunk, ChunkID const& chunk_id)
 {
-	Block buffer[CHUNK_SIZE];
-	world_gen->generate_chunk(chunk_id, buffer, CHUNK_X, CHUNK_X*CHUNK_Y);
+	//Chunks of a single block type can be stored without expanding them
+	Block uniform;
+	if(world_gen->uniform_chunk(chunk_id, uniform))
+	{
+		chunk->fill(uniform);
+	}
+	else
+	{
+		Block buffer[CHUNK_SIZE];
+		world_gen->generate_chunk(chunk_id, buffer, CHUNK_X, CHUNK_X*CHUNK_Y);
+		chunk->compress_chunk(buffer, CHUNK_X, CHUNK_X*CHUNK_Y);
+	}
 	
-	acc->second->compress_chunk(buffer, CHUNK_X, CHUNK_X*CHUNK_Y);
-	acc->second->set_last_modified(1);
-	acc->second->set_valid(true);
+	chunk->set_last_modified(1);
+	chunk->set_valid(true);
 	
 	mark_dirty(chunk_id);
 }
@@ -353,7 +865,7 @@ void GameMap::generate_surface_chunk(accessor& acc, ChunkID const& chunk_id)
 	//Lock the neighboring chunks and cache them
 	const_accessor chunks[7];
 	Block* buffer = (Block*)scalable_malloc(sizeof(Block)*CHUNK_SIZE*3*3*3);
-	uint64_t timestamp = 1;	
+	uint64_t timestamp = 1, source_version = 0;
 
 	//Lock the surrounding buffers for reading, always use order y-z-x
 	for(int i=0; i<7; ++i)
@@ -370,6 +882,7 @@ void GameMap::generate_surface_chunk(accessor& acc, ChunkID const& chunk_id)
 		Block* ptr = buffer + ix + iz * stride_x + iy * stride_xz;
 		chunks[i]->second->decompress_chunk(ptr, stride_x, stride_xz);
 		timestamp = max(timestamp, chunks[i]->second->last_modified());
+		source_version += chunks[i]->second->last_modified();
 	}
 	
 	//Traverse to find surface chunks
@@ -423,6 +936,7 @@ void GameMap::generate_surface_chunk(accessor& acc, ChunkID const& chunk_id)
 	acc->second->compress_chunk(buffer + CHUNK_X + CHUNK_Z * stride_x + CHUNK_Y * stride_xz, stride_x, stride_xz);
 	acc->second->cache_protocol_buffer_data();
 	acc->second->set_empty_surface(empty);
+	acc->second->set_source_version(source_version);
 	acc->second->set_valid(true);
 	
 	if(!acc->second->equals(psurface))
@@ -430,6 +944,8 @@ void GameMap::generate_surface_chunk(accessor& acc, ChunkID const& chunk_id)
 		acc->second->set_last_modified(timestamp);
 	}
 	
+	mark_surface_dirty(chunk_id);
+	
 	//Release locks in reverse order
 	for(int i=6; i>=0; --i)
 	{
@@ -449,8 +965,8 @@ void GameMap::initialize_db()
 	//Initialize the map database
 	map_db = tchdbnew();
 	
-	//Set options
-	//tchdbsetmutex(map_db);	//Not needed, will use our own mutex to synchronize database
+	//Set options, chunks may be loaded on demand from any thread so the database needs its mutex
+	tchdbsetmutex(map_db);
 	tchdbtune(map_db,
 		config->readInt("tc_map_buckets"),				//Number of buckets
 		config->readInt("tc_map_alignment"),			//Record alignment
@@ -463,39 +979,101 @@ void GameMap::initialize_db()
 	//Open the map database
 	tchdbopen(map_db, config->readString("map_db_path").c_str(), HDBOWRITER | HDBOCREAT);
 	
-	//Iterate over all previous map entries and cache them
+	//Surface chunks are loaded on demand from many threads, so this one needs its mutex
+	surface_db = tchdbnew();
+	tchdbsetmutex(surface_db);
+	tchdbtune(surface_db,
+		config->readInt("tc_map_buckets"),
+		config->readInt("tc_map_alignment"),
+		config->readInt("tc_map_free_pool_size"),
+		HDBTLARGE | HDBTDEFLATE);
+	tchdbsetcache(surface_db, config->readInt("tc_map_cache_size"));
+	tchdbopen(surface_db, config->readString("surface_db_path").c_str(), HDBOWRITER | HDBOCREAT);
+	
+	//Iterate over all previous map entries and cache them (or just index them if loading lazily)
 	tchdbiterinit(map_db);
 	
-	//Restore the state of the map
-	auto key = tcxstrnew();
-	auto value = tcxstrnew();
+	//Try mapping the image from the last shutdown, the stamp is consumed so it can only be used once
+	auto image_path = config->readString("map_image_path");
+	if(config->readInt("map_lazy_load") && image_path.size() > 0)
+	{
+		int sz;
+		ScopeFree stamp(tchdbget(map_db, MAP_IMAGE_STAMP_KEY, strlen(MAP_IMAGE_STAMP_KEY), &sz));
+		if(stamp.ptr != NULL && sz == sizeof(uint64_t) &&
+			image.open(image_path, *(uint64_t*)stamp.ptr))
+		{
+			tchdbout(map_db, MAP_IMAGE_STAMP_KEY, strlen(MAP_IMAGE_STAMP_KEY));
+			tchdbsync(map_db);
+			
+			//A filter saved with other settings is rebuilt from the keys
+			if(!image.load_filter(stored_chunks))
+			{
+				printf("Map image chunk index does not match map_filter_bits/map_filter_hashes, reindexing\n");
+				stored_chunks.clear();
+			}
+		}
+	}
 	
-	printf("Loading chunks");
-
-	while(true)
+	if(image.is_open() && stored_chunks.size() > 0)
 	{
-		if(!tchdbiternext3(map_db, key, value))
-			break;
+		printf("Restored chunk index from map image, %ld chunks\n", stored_chunks.size());
+	}
+	else if(config->readInt("map_lazy_load"))
+	{
+		printf("Indexing chunks");
 		
-		ScopeDelete<Network::Chunk> pbuffer(new Network::Chunk());
-		pbuffer.ptr->ParseFromArray(tcxstrptr(value), tcxstrsize(value));
+		while(true)
+		{
+			int sz;
+			ScopeFree key(tchdbiternext(map_db, &sz));
+			if(key.ptr == NULL)
+				break;
+			if(sz != 3*sizeof(uint32_t))
+				continue;
+			
+			auto arr = (uint32_t*)key.ptr;
+			stored_chunks.insert(ChunkID(arr[0], arr[1], arr[2]));
+		}
 		
-		ChunkID chunk_id(pbuffer.ptr->x(), pbuffer.ptr->y(), pbuffer.ptr->z());
+		printf("Done! %ld chunks\n", stored_chunks.size());
+	}
+	else
+	{
+		//Restore the state of the map
+		auto key = tcxstrnew();
+		auto value = tcxstrnew();
 		
-		auto chunk_buffer = new ChunkBuffer();
-		chunk_buffer->parse_from_protocol_buffer(*pbuffer.ptr);
+		printf("Loading chunks");
+
+		while(true)
+		{
+			if(!tchdbiternext3(map_db, key, value))
+				break;
+			if(tcxstrsize(key) != 3*sizeof(uint32_t))
+				continue;
+			
+			ScopeDelete<Network::Chunk> pbuffer(new Network::Chunk());
+			pbuffer.ptr->ParseFromArray(tcxstrptr(value), tcxstrsize(value));
+			
+			ChunkID chunk_id(pbuffer.ptr->x(), pbuffer.ptr->y(), pbuffer.ptr->z());
+			
+			auto chunk_buffer = new ChunkBuffer();
+			chunk_buffer->parse_from_protocol_buffer(*pbuffer.ptr);
+			
+			accessor acc;
+			chunks.insert(acc, make_pair(chunk_id, chunk_buffer) );
+			update_heights(chunk_id, *chunk_buffer);
+			stored_chunks.insert(chunk_id);
+			
+			printf(".");
+		}
 		
-		accessor acc;
-		chunks.insert(acc, make_pair(chunk_id, chunk_buffer) );
+		tcxstrdel(key);
+		tcxstrdel(value);
 		
-		printf(".");
+		printf("Done!\n");
 	}
 	
-	tcxstrdel(key);
-	tcxstrdel(value);
-	
-	printf("Done!\n");
-	
 	//Worker thread, this operates in the background and constantly writes updated chunks to the database
 	struct DBWorker
 	{
@@ -503,36 +1081,9 @@ void GameMap::initialize_db()
 		
 		void operator()()
 		{
-			//Static buffer object
-			uint8_t	buffer[(sizeof(Block) + 2) * CHUNK_SIZE + 256];
-		
 			while(game_map->running)
 			{
-				write_set_t	pending(256);
-				{
-					spin_rw_mutex::scoped_lock L(game_map->write_set_lock, true);
-					pending.swap(game_map->pending_writes);
-				}
-	
-				for(auto iter=pending.begin(); iter!=pending.end(); ++iter)
-				{
-					auto key = iter->first;
-					
-					//DEBUG_PRINTF("Serializing chunk: %d,%d,%d\n", key.x, key.y, key.z);
-					
-					//Serialize the protocol buffer to an array
-					auto pbuffer = game_map->get_chunk_pbuffer(key);
-					int bs = pbuffer->ByteSize();
-					pbuffer->SerializeToArray(buffer, sizeof(buffer));
-					delete pbuffer;
-					
-					//Store in tokyo cabinet
-					uint32_t arr[3];
-					arr[0] = key.x;
-					arr[1] = key.y;
-					arr[2] = key.z;
-					tchdbput(game_map->map_db, (void*)arr, sizeof(arr), buffer, bs);
-				}
+				game_map->flush();
 				
 				//Sleep
 				this_thread::sleep_for(tick_count::interval_t((double)game_map->config->readFloat("map_db_write_rate")));
@@ -553,9 +1104,144 @@ void GameMap::shutdown_db()
 	assert(db_worker_thread->joinable());
 	db_worker_thread->join();
 	delete db_worker_thread;
+	
+	//Write out anything modified since the last pass of the worker
+	flush();
+	
+	//Save a map image for the next start up
+	image.close();
+	auto image_path = config->readString("map_image_path");
+	if(image_path.size() > 0)
+		write_image(image_path);
 
 	tchdbclose(map_db);
 	tchdbdel(map_db);
+	
+	tchdbclose(surface_db);
+	tchdbdel(surface_db);
+}
+
+//Writes an image of the map, must only be called after the final flush with no other threads running
+void GameMap::write_image(string const& path)
+{
+	MapImageWriter writer;
+	if(!writer.open(path))
+	{
+		printf("Could not create map image %s\n", path.c_str());
+		return;
+	}
+	
+	for(auto iter = chunks.begin(); iter != chunks.end(); ++iter)
+	{
+		if(iter->second->encoded_size() == 0)
+			iter->second->cache_protocol_buffer_data();
+		writer.add_chunk(iter->first, *iter->second);
+	}
+	
+	for(auto iter = surface_chunks.begin(); iter != surface_chunks.end(); ++iter)
+	{
+		if(!iter->second->valid())
+			continue;
+		if(iter->second->encoded_size() == 0)
+			iter->second->cache_protocol_buffer_data();
+		writer.add_surface(iter->first, *iter->second);
+	}
+	
+	//Tie the image to the current contents of the database
+	uint64_t stamp = ((uint64_t)rand() << 32) ^ ((uint64_t)rand() << 16) ^ (uint64_t)time(NULL);
+	if(writer.finish(stamp, stored_chunks))
+	{
+		tchdbput(map_db, MAP_IMAGE_STAMP_KEY, strlen(MAP_IMAGE_STAMP_KEY), &stamp, sizeof(stamp));
+		tchdbsync(map_db);
+	}
+}
+
+//Writes all pending chunks and surface chunks to the database, returns the number of records written.
+//Records are serialized in parallel and then stored sequentially.
+int GameMap::flush()
+{
+	typedef vector<ChunkID, scalable_allocator<ChunkID> > key_list_t;
+	
+	tbb::mutex::scoped_lock F(flush_lock);
+	
+	key_list_t keys, surface_keys;
+	{
+		write_set_t	pending(256), pending_surface(256);
+		{
+			spin_rw_mutex::scoped_lock L(write_set_lock, true);
+			pending.swap(pending_writes);
+			pending_surface.swap(pending_surface_writes);
+		}
+		
+		for(auto iter=pending.begin(); iter!=pending.end(); ++iter)
+			keys.push_back(iter->first);
+		for(auto iter=pending_surface.begin(); iter!=pending_surface.end(); ++iter)
+			surface_keys.push_back(iter->first);
+	}
+	
+	if(keys.size() == 0 && surface_keys.size() == 0)
+		return 0;
+	
+	vector<string> records(keys.size()), surface_records(surface_keys.size());
+	
+	//Serialize chunks
+	parallel_for(blocked_range<int>(0, keys.size(), 64), [&](blocked_range<int> rng)
+	{
+		for(auto i=rng.begin(); i!=rng.end(); ++i)
+		{
+			ScopeDelete<Network::Chunk> pbuffer(get_chunk_pbuffer(keys[i]));
+			pbuffer.ptr->SerializeToString(&records[i]);
+		}
+	});
+	
+	//Serialize surface chunks, skipping any that were invalidated since they were built
+	parallel_for(blocked_range<int>(0, surface_keys.size(), 64), [&](blocked_range<int> rng)
+	{
+		for(auto i=rng.begin(); i!=rng.end(); ++i)
+		{
+			Map::SurfaceChunk record;
+			{
+				const_accessor acc;
+				if(!surface_chunks.find(acc, surface_keys[i]) ||
+					!acc->second->valid() ||
+					!acc->second->serialize_to_protocol_buffer(*record.mutable_chunk()))
+				{
+					continue;
+				}
+				record.set_source_version(acc->second->source_version());
+				record.set_empty(acc->second->empty_surface());
+			}
+			record.SerializeToString(&surface_records[i]);
+		}
+	});
+	
+	//Store in tokyo cabinet
+	int count = 0;
+	for(int i=0; i<keys.size(); ++i)
+	{
+		uint32_t arr[3];
+		arr[0] = keys[i].x;
+		arr[1] = keys[i].y;
+		arr[2] = keys[i].z;
+		tchdbput(map_db, (void*)arr, sizeof(arr), records[i].data(), records[i].size());
+		stored_chunks.insert(keys[i]);
+		++count;
+	}
+	
+	for(int i=0; i<surface_keys.size(); ++i)
+	{
+		if(surface_records[i].size() == 0)
+			continue;
+	
+		uint32_t arr[3];
+		arr[0] = surface_keys[i].x;
+		arr[1] = surface_keys[i].y;
+		arr[2] = surface_keys[i].z;
+		tchdbput(surface_db, (void*)arr, sizeof(arr), surface_records[i].data(), surface_records[i].size());
+		++count;
+	}
+	
+	return count;
 }
 
 //Marks a chunk for disk serialization
@@ -565,5 +1251,127 @@ void GameMap::mark_dirty(ChunkID const& chunk_id)
 	pending_writes.insert(make_pair(chunk_id, true));
 }
 
+//Tries to load a chunk from the database, returns false if the chunk was never stored
+bool GameMap::load_chunk(ChunkBuffer* chunk, ChunkID const& chunk_id)
+{
+	//Chunks in the map image can be read straight out of the mapping
+	auto entry = image.find_chunk(chunk_id);
+	if(entry != NULL)
+	{
+		chunk->parse_from_data(entry->timestamp, image.entry_data(entry), entry->size);
+		chunk->set_valid(true);
+		return true;
+	}
+
+	//Most misses are for chunks which were never generated, skip the probe for those
+	if(!stored_chunks.may_contain(chunk_id))
+		return false;
+
+	uint32_t arr[3];
+	arr[0] = chunk_id.x;
+	arr[1] = chunk_id.y;
+	arr[2] = chunk_id.z;
+	
+	int sz;
+	ScopeFree data(tchdbget(map_db, (void*)arr, sizeof(arr), &sz));
+	if(data.ptr == NULL)
+		return false;
+	
+	Network::Chunk pbuffer;
+	if(!pbuffer.ParseFromArray(data.ptr, sz) || !pbuffer.has_data())
+		return false;
+	
+	chunk->parse_from_protocol_buffer(pbuffer);
+	chunk->set_valid(true);
+	return true;
+}
+
+//Marks a surface chunk for disk serialization
+void GameMap::mark_surface_dirty(ChunkID const& chunk_id)
+{
+	spin_rw_mutex::scoped_lock L(write_set_lock, false);
+	pending_surface_writes.insert(make_pair(chunk_id, true));
+}
+
+//Tries to restore a surface chunk from the database.  The record is only accepted if
+//none of the chunks it was built from have changed since it was written.
+bool GameMap::load_surface_chunk(accessor& acc, ChunkID const& chunk_id)
+{
+	uint64_t record_version, record_timestamp;
+	bool record_empty;
+	const uint8_t* record_data;
+	int record_size, record_format = CHUNK_FORMAT;
+
+	//Look in the map image first, then in the database
+	Map::SurfaceChunk record;
+	ScopeFree data(NULL);
+	auto entry = image.find_surface(chunk_id);
+	if(entry != NULL)
+	{
+		record_version = entry->source_version;
+		record_timestamp = entry->timestamp;
+		record_empty = (entry->flags & MAP_IMAGE_EMPTY_SURFACE) != 0;
+		record_data = image.entry_data(entry);
+		record_size = entry->size;
+	}
+	else
+	{
+		uint32_t arr[3];
+		arr[0] = chunk_id.x;
+		arr[1] = chunk_id.y;
+		arr[2] = chunk_id.z;
+		
+		int sz;
+		data.ptr = tchdbget(surface_db, (void*)arr, sizeof(arr), &sz);
+		if(data.ptr == NULL)
+			return false;
+		
+		if(!record.ParseFromArray(data.ptr, sz) ||
+			!record.has_source_version() ||
+			!record.chunk().has_data())
+		{
+			return false;
+		}
+		
+		record_version = record.source_version();
+		record_timestamp = record.chunk().last_modified();
+		record_empty = record.empty();
+		record_data = (const uint8_t*)record.chunk().data().data();
+		record_size = record.chunk().data().size();
+		record_format = record.chunk().has_format() ? record.chunk().format() : 0;
+	}
+	
+	//Validate against the current source chunks, always lock in order y-z-x
+	uint64_t source_version = 0;
+	{
+		const_accessor chunks[7];
+		for(int i=0; i<7; ++i)
+		{
+			get_chunk_buffer(chunks[i],
+							ChunkID(chunk_id.x+SURFACE_DELTA[i][0],
+									chunk_id.y+SURFACE_DELTA[i][1],
+									chunk_id.z+SURFACE_DELTA[i][2]));
+			source_version += chunks[i]->second->last_modified();
+		}
+		
+		for(int i=6; i>=0; --i)
+		{
+			chunks[i].release();
+		}
+	}
+	
+	if(source_version != record_version)
+	{
+		DEBUG_PRINTF("Stale surface chunk %d,%d,%d\n", chunk_id.x, chunk_id.y, chunk_id.z);
+		return false;
+	}
+	
+	acc->second->parse_from_data(record_timestamp, record_data, record_size, record_format);
+	acc->second->set_empty_surface(record_empty);
+	acc->second->set_source_version(source_version);
+	acc->second->set_valid(true);
+	return true;
+}
+
 
 };
@@ -2,9 +2,13 @@
 #define GAME_MAP_H
 
 #include <stdint.h>
+#include <map>
+
+#include <functional>
 
 #include <tbb/atomic.h>
 #include <tbb/compat/thread>
+#include <tbb/mutex.h>
 #include <tbb/spin_rw_mutex.h>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_hash_map.h>
@@ -15,10 +19,35 @@
 #include "constants.h"
 #include "config.h"
 #include "chunk.h"
+#include "block_intake.h"
+#include "chunk_filter.h"
+#include "map_image.h"
+#include "generation_queue.h"
 #include "worldgen.h"
 
 namespace Game
 {
+	struct ReplicationPrimary;
+	
+	//An in-flight chunk generation.  Every requester holds a reference while it waits.
+	struct ChunkFuture
+	{
+		ChunkFuture();
+		~ChunkFuture();
+		
+		void wait();
+		void complete();
+		
+		void acquire() { ++ref_count; }
+		void release() { if(--ref_count == 0) delete this; }
+		int references() const { return ref_count; }
+		
+	private:
+		pthread_mutex_t lock;
+		pthread_cond_t	cond;
+		bool			done;
+		tbb::atomic<int> ref_count;
+	};
 	
 	//This is basically a data structure which implements a caching/indexing system for chunks
 	//The goal is to keep the entire database in memory at all times for maximum performance.
@@ -34,17 +63,42 @@ namespace Game
 		GameMap(Config* config);
 		~GameMap();
 		
-		//Accessor methods
+		//Accessor methods, these block until the chunk has been loaded or generated
 		void get_chunk_buffer(accessor&, ChunkID const&);
 		void get_chunk_buffer(const_accessor&, ChunkID const&);
 		void get_surface_chunk_buffer(accessor&, ChunkID const&);
 		void get_surface_chunk_buffer(const_accessor&, ChunkID const&);
 		
+		//Non-blocking accessors.  If the chunk is not in memory yet, these queue it for the
+		//generator threads and return false.  Lower priorities are generated first.
+		bool try_get_chunk_buffer(const_accessor&, ChunkID const&, float priority = 0.0f);
+		bool find_chunk_buffer(const_accessor&, ChunkID const&);
+		bool surface_sources_ready(ChunkID const&, float priority = 0.0f);
+		void request_chunk_async(ChunkID const&, float priority = 0.0f);
+		void print_generation_stats() { generation_queue.print_stats(); }
+		
 		//Block accessor methods
 		Block get_block(int x, int y, int z);
 		
-		//Chunk update methods
-		void get_chunk(
+		//Height of the generated surface block at x,z, which ignores any edits
+		int generated_column_top(int x, int z);
+		
+		//Heightmaps, kept up to date by every write to the map.  column_top returns the y of the highest
+		//non-air block at x,z among the chunks in memory, or -1 if there is none or x,z is off the map, and
+		//never loads a chunk.
+		//get_column_heights copies the CHUNK_X * CHUNK_Z heights of a chunk column, indexed x + z*CHUNK_X,
+		//and returns false if no chunk of the column is in memory.
+		int column_top(int x, int z);
+		bool get_column_heights(uint32_t cx, uint32_t cz, int* heights);
+		
+		//Writes blocks straight into their chunk, returns true if anything changed.  Used for player edits,
+		//which must show up before the next physics batch.  All the writes to set_blocks lie in the given chunk,
+		//if expected is given a write is skipped unless the block it replaces is still expected[i].
+		bool set_block(Block b, uint64_t t, int x, int y, int z);
+		bool set_blocks(ChunkID const&, uint64_t t, BlockRecord const* writes, int count, Block const* expected = NULL);
+		
+		//Chunk update methods, get_chunk returns the time stamp of the version it read
+		uint64_t get_chunk(
 			ChunkID const&, 
 			Block* buffer, 
 			int stride_x = CHUNK_X, 
@@ -57,14 +111,47 @@ namespace Game
 			int stride_x = CHUNK_X,
 			int stride_xz = CHUNK_X * CHUNK_Z);
 		
+		//A cell changed by a commit, offset is its index in chunk order
+		struct CellChange
+		{
+			uint16_t offset;
+			Block prev;
+		};
+		
+		//A chunk computed from the version read by get_chunk.  If the cells it changed are listed, the
+		//commit is merged into a newer version of the chunk as long as none of those cells moved on.
+		struct ChunkCommit
+		{
+			ChunkID id;
+			uint64_t version, t;
+			Block* blocks;
+			CellChange const* changes;
+			int num_changes;
+		};
+		
+		//Replaces a group of chunks all or nothing, returns false if any of them changed since it was read
+		//and could not be merged.  Each chunk is stamped t, or one past its version if that is later.  The
+		//caller invalidates the surfaces of the chunks it committed.
+		bool commit_chunks(ChunkCommit const* chunks, int count);
+		void invalidate_surfaces(ChunkID const&);
+		
 		//Retrieves a chunk's protocol buffer
 		Network::Chunk* get_chunk_pbuffer(ChunkID const&);
 
-		//Protocol buffer methods
-		Network::ServerPacket* get_net_chunk(ChunkID const&, uint64_t timestamp);
+		//Protocol buffer methods, returns NULL if there is nothing to send or the chunk is not ready
+		Network::ServerPacket* get_net_chunk(ChunkID const&, uint64_t timestamp, float priority = 0.0f);
 		
 		//Saves the state of the map
 		void serialize();
+		
+		//Writes all modified chunks to the database immediately.  Flushes run one at a time, so a flush
+		//returns only after any flush already in progress, such as the database worker's, has stored its chunks.
+		int flush();
+		
+		//Replication methods
+		void set_replicator(ReplicationPrimary* r) { replicator = r; }
+		bool read_stored_chunks(std::function<bool (Network::Chunk const&)> const& visit);
+		bool apply_chunk(Network::Chunk const&);
 					
 	private:
 		//The world generator and config stuff
@@ -74,14 +161,40 @@ namespace Game
 		//Database/persistence stuff
 		typedef tbb::concurrent_unordered_map<ChunkID, bool, ChunkIDHashCompare> write_set_t;
 		TCHDB*	map_db;
+		TCHDB*	surface_db;
+		ChunkFilter stored_chunks;
+		MapImage image;
 		tbb::spin_rw_mutex	write_set_lock;
-		write_set_t pending_writes;
+		write_set_t pending_writes, pending_surface_writes;
+		
+		//Held from taking the write sets until their records are stored, so a later serialization of a chunk
+		//is never overwritten by an earlier one
+		tbb::mutex flush_lock;
 		std::thread* db_worker_thread;
 		tbb::atomic<bool> running;
+		ReplicationPrimary* replicator;
 		
 		void initialize_db();
 		void shutdown_db();
 		void mark_dirty(ChunkID const&);
+		void mark_surface_dirty(ChunkID const&);
+		bool store_chunk(accessor&, ChunkID const&, uint64_t t, Block* buffer, int stride_x, int stride_xz);
+		bool load_chunk(ChunkBuffer*, ChunkID const&);
+		void write_image(std::string const& path);
+		bool load_surface_chunk(accessor&, ChunkID const&);
+		
+		//Heightmap of a chunk column, along with the highest block of each column within each of its chunks
+		//so a removed top block can be replaced without reading the chunks below
+		struct ColumnHeights
+		{
+			int top[CHUNK_X * CHUNK_Z];
+			std::map<uint32_t, std::vector<int8_t> > chunk_tops;
+		};
+		typedef tbb::concurrent_hash_map<ChunkID, ColumnHeights*, ChunkIDHashCompare> column_map_t;
+		column_map_t column_heights;
+		
+		//Folds a chunk into the heightmap of its column, called with the chunk locked.  Lock columns after chunks.
+		void update_heights(ChunkID const&, ChunkBuffer const&);
 		
 		//The game map
 		// When operating on surface chunks and chunk remember the locking order:
@@ -91,8 +204,24 @@ namespace Game
 		chunk_map_t chunks, surface_chunks;
 		
 		//Chunk generation stuff
-		void generate_chunk(accessor&, ChunkID const&);
+		void generate_chunk(ChunkBuffer*, ChunkID const&);
 		void generate_surface_chunk(accessor&, ChunkID const&);
+		
+		//In-flight generations, at most one per chunk.  Lock generating before chunks.
+		typedef tbb::concurrent_hash_map<ChunkID, ChunkFuture*, ChunkIDHashCompare> future_map_t;
+		future_map_t generating;
+		
+		//Background generation
+		GenerationQueue generation_queue;
+		std::vector<std::thread*> generator_threads;
+		tbb::atomic<bool> generators_running;
+		
+		ChunkFuture* request_chunk(ChunkID const&, bool& owner);
+		void wait_for_chunk(ChunkID const&);
+		void run_generation(ChunkID const&, ChunkFuture*);
+		bool drop_generation(ChunkID const&, ChunkFuture*);
+		void start_generators();
+		void stop_generators();
 	};
 	
 };
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <tbb/tick_count.h>
+#include <tbb/spin_mutex.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "generation_queue.h"
+
+using namespace std;
+using namespace tbb;
+
+namespace Game
+{
+
+GenerationQueue::GenerationQueue(Config* config) :
+	start_time(tick_count::now()),
+	window(0),
+	window_spent(0.0),
+	generated(0),
+	dropped(0),
+	overruns(0),
+	windows_throttled(0),
+	wait_total(0.0),
+	wait_max(0.0)
+{
+	request_timeout	= config->readFloat("generate_request_timeout");
+	tick_rate		= config->readFloat("tick_rate");
+	tick_budget		= config->readFloat("generate_tick_budget");
+}
+
+GenerationQueue::~GenerationQueue()
+{
+}
+
+void GenerationQueue::push_entry(ChunkID const& chunk_id, float priority)
+{
+	Entry e = { priority, chunk_id };
+	heap.push_back(e);
+	push_heap(heap.begin(), heap.end());
+}
+
+void GenerationQueue::push(ChunkID const& chunk_id, ChunkFuture* future, float priority)
+{
+	auto now = tick_count::now();
+	
+	Request req;
+	req.future = future;
+	req.priority = priority;
+	req.queued = req.last_requested = req.priority_set = now;
+	
+	spin_mutex::scoped_lock L(lock);
+	requests[chunk_id] = req;
+	push_entry(chunk_id, priority);
+}
+
+bool GenerationQueue::refresh(ChunkID const& chunk_id, float priority)
+{
+	auto now = tick_count::now();
+
+	spin_mutex::scoped_lock L(lock);
+	auto iter = requests.find(chunk_id);
+	if(iter == requests.end())
+		return false;
+	
+	auto& req = iter->second;
+	req.last_requested = now;
+	
+	//Keep the most urgent priority any session asked for, but let it rise again once it is old
+	//so a chunk does not stay urgent after the player who needed it walked off
+	if(priority < req.priority || (now - req.priority_set).seconds() > 0.5 * request_timeout)
+	{
+		if(priority != req.priority)
+			push_entry(chunk_id, priority);
+		req.priority = priority;
+		req.priority_set = now;
+	}
+	
+	return true;
+}
+
+bool GenerationQueue::pop(ChunkID& chunk_id, ChunkFuture*& future, bool& stale)
+{
+	auto now = tick_count::now();
+
+	spin_mutex::scoped_lock L(lock);
+	while(heap.size() > 0)
+	{
+		pop_heap(heap.begin(), heap.end());
+		Entry e = heap.back();
+		heap.pop_back();
+		
+		//Skip entries which were superseded by a refresh or taken
+		auto iter = requests.find(e.chunk_id);
+		if(iter == requests.end() || iter->second.priority != e.priority)
+			continue;
+		
+		auto& req = iter->second;
+		chunk_id = e.chunk_id;
+		future = req.future;
+		stale = (now - req.last_requested).seconds() > request_timeout;
+		
+		if(!stale)
+		{
+			double wait = (now - req.queued).seconds();
+			wait_total += wait;
+			wait_max = max(wait_max, wait);
+			generated++;
+		}
+		
+		requests.erase(iter);
+		return true;
+	}
+	
+	return false;
+}
+
+bool GenerationQueue::take(ChunkID const& chunk_id, ChunkFuture*& future)
+{
+	spin_mutex::scoped_lock L(lock);
+	auto iter = requests.find(chunk_id);
+	if(iter == requests.end())
+		return false;
+	
+	//The heap entry is skipped once it reaches the top
+	future = iter->second.future;
+	requests.erase(iter);
+	return true;
+}
+
+//Starts a new budget window when the tick changes
+void GenerationQueue::update_window(tick_count now)
+{
+	int64_t w = (int64_t)((now - start_time).seconds() / tick_rate);
+	if(w != window)
+	{
+		window = w;
+		window_spent = 0.0;
+	}
+}
+
+bool GenerationQueue::has_budget()
+{
+	spin_mutex::scoped_lock L(lock);
+	update_window(tick_count::now());
+	
+	if(window_spent < tick_budget)
+		return true;
+	
+	windows_throttled++;
+	return false;
+}
+
+void GenerationQueue::charge(double seconds)
+{
+	spin_mutex::scoped_lock L(lock);
+	update_window(tick_count::now());
+	
+	//A generation which started within budget but ended past it is an overrun
+	bool was_under = window_spent < tick_budget;
+	window_spent += seconds;
+	if(was_under && window_spent > tick_budget)
+		overruns++;
+}
+
+void GenerationQueue::count_dropped()
+{
+	spin_mutex::scoped_lock L(lock);
+	dropped++;
+}
+
+void GenerationQueue::print_stats()
+{
+	spin_mutex::scoped_lock L(lock);
+	printf("Generation queue: depth %d, %ld generated, %ld stale dropped\n",
+		(int)requests.size(), generated, dropped);
+	printf("Wait: mean %.2f ms, max %.2f ms\n",
+		generated > 0 ? 1000.0 * wait_total / generated : 0.0,
+		1000.0 * wait_max);
+	printf("Budget: %.2f ms per tick, %ld overruns, %ld throttled polls\n",
+		1000.0 * tick_budget, overruns, windows_throttled);
+	
+	//Reset the window
+	generated = dropped = overruns = windows_throttled = 0;
+	wait_total = wait_max = 0.0;
+}
+
+};
@@ -0,0 +1,85 @@
+#ifndef GENERATION_QUEUE_H
+#define GENERATION_QUEUE_H
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+#include <tbb/tick_count.h>
+#include <tbb/spin_mutex.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+
+namespace Game
+{
+	struct ChunkFuture;
+
+	//Priority queue of chunks waiting for the background generators.  Lower priorities are served
+	//first.  Requests which are not refreshed within generate_request_timeout are considered stale,
+	//and the generators share a CPU budget of generate_tick_budget seconds per tick.
+	struct GenerationQueue
+	{
+		GenerationQueue(Config* config);
+		~GenerationQueue();
+		
+		//Adds a new request, the queue takes over the future's generator reference
+		void push(ChunkID const&, ChunkFuture*, float priority);
+		
+		//Marks a queued request as still wanted, returns false if it is not queued
+		bool refresh(ChunkID const&, float priority);
+		
+		//Removes the most urgent request.  stale is set if nobody asked for the chunk recently.
+		bool pop(ChunkID&, ChunkFuture*&, bool& stale);
+		
+		//Removes a specific request if it has not been started yet
+		bool take(ChunkID const&, ChunkFuture*&);
+		
+		//Budget accounting for the generator threads
+		bool has_budget();
+		void charge(double seconds);
+		
+		void count_dropped();
+		void print_stats();
+		
+	private:
+		struct Request
+		{
+			ChunkFuture*	future;
+			float			priority;
+			tbb::tick_count	queued, last_requested, priority_set;
+		};
+		
+		//Heap entries, outdated entries are skipped when they reach the top
+		struct Entry
+		{
+			float		priority;
+			ChunkID		chunk_id;
+			
+			bool operator<(Entry const& other) const { return priority > other.priority; }
+		};
+		
+		typedef std::unordered_map<ChunkID, Request, ChunkIDHashCompare> request_map_t;
+		
+		tbb::spin_mutex		lock;
+		request_map_t		requests;
+		std::vector<Entry>	heap;
+		
+		double request_timeout, tick_rate, tick_budget;
+		
+		//Budget for the current tick
+		tbb::tick_count	start_time;
+		int64_t			window;
+		double			window_spent;
+		
+		//Statistics since the last print
+		uint64_t generated, dropped, overruns, windows_throttled;
+		double wait_total, wait_max;
+		
+		void push_entry(ChunkID const&, float priority);
+		void update_window(tbb::tick_count now);
+	};
+};
+
+#endif
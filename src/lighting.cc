@@ -0,0 +1,676 @@
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include <tbb/tick_count.h>
+#include <tbb/queuing_rw_mutex.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "lighting.h"
+
+//Uncomment this line to get dense logging for the lighting
+//#define LIGHTING_DEBUG 1
+
+#ifndef LIGHTING_DEBUG
+#define DEBUG_PRINTF(...)
+#else
+#define DEBUG_PRINTF(...)  fprintf(stderr,__VA_ARGS__)
+#endif
+
+using namespace std;
+using namespace tbb;
+
+namespace Game
+{
+
+static inline int cell_offset(int x, int y, int z)
+{
+	return	(x & (CHUNK_X-1)) +
+			((z & (CHUNK_Z-1)) << CHUNK_X_S) +
+			((y & (CHUNK_Y-1)) << (CHUNK_X_S + CHUNK_Z_S));
+}
+
+static inline int column_offset(int x, int z)
+{
+	return (x & (CHUNK_X-1)) + ((z & (CHUNK_Z-1)) << CHUNK_X_S);
+}
+
+Lighting::Lighting(Config* cfg, GameMap* map) :
+	config(cfg),
+	game_map(map),
+	last_chunk(NULL),
+	ticks(0),
+	chunks_lit(0),
+	chunks_changed(0),
+	chunks_evicted(0),
+	cells_changed(0),
+	cells_visited(0),
+	tick_time_total(0.0),
+	tick_time_max(0.0)
+{
+	radius		= config->readInt("lighting_radius");
+	max_chunks	= config->readInt("lighting_max_chunks");
+}
+
+Lighting::~Lighting()
+{
+	for(auto iter = chunks.begin(); iter != chunks.end(); ++iter)
+		delete iter->second;
+	for(auto iter = columns.begin(); iter != columns.end(); ++iter)
+		delete iter->second;
+}
+
+//Returns the lit chunk holding a cell, or NULL if it has not been lit
+Lighting::LightChunk* Lighting::find_chunk(int x, int y, int z)
+{
+	if(x < 0 || y < 0 || z < 0)
+		return NULL;
+
+	ChunkID chunk_id(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z);
+	if(last_chunk != NULL && chunk_id == last_chunk_id)
+		return last_chunk;
+
+	auto iter = chunks.find(chunk_id);
+	if(iter == chunks.end())
+		return NULL;
+	last_chunk = iter->second;
+	last_chunk_id = chunk_id;
+	return last_chunk;
+}
+
+//Returns the heightmap of a chunk column, starting it from the generated terrain
+Lighting::Column* Lighting::get_column(ChunkID const& chunk_id)
+{
+	ChunkID column_id(chunk_id.x, 0, chunk_id.z);
+	auto iter = columns.find(column_id);
+	if(iter != columns.end())
+		return iter->second;
+
+	auto column = new Column();
+	for(int z=0; z<CHUNK_Z; ++z)
+	for(int x=0; x<CHUNK_X; ++x)
+	{
+		int i = x + z * CHUNK_X;
+		column->ground[i] = game_map->generated_column_top(chunk_id.x * CHUNK_X + x, chunk_id.z * CHUNK_Z + z);
+		column->top[i] = column->ground[i];
+	}
+	column->lit = 0;
+	columns.insert(make_pair(column_id, column));
+	return column;
+}
+
+uint8_t Lighting::get_light(LightChunk* c, int offset, int channel) const
+{
+	return channel == 0 ? c->light[offset] & 0xf : c->light[offset] >> 4;
+}
+
+void Lighting::set_light(LightChunk* c, int offset, int channel, int level)
+{
+	if(channel == 0)
+		c->light[offset] = (c->light[offset] & 0xf0) | level;
+	else
+		c->light[offset] = (c->light[offset] & 0x0f) | (level << 4);
+	++c->light_version;
+}
+
+int Lighting::source_level(LightChunk* c, int offset, int x, int y, int z, int channel)
+{
+	if(channel == 0)
+		return c->attr[offset] & 0xf;
+	if(c->attr[offset] & OPAQUE)
+		return 0;
+
+	auto iter = columns.find(ChunkID(x/CHUNK_X, 0, z/CHUNK_Z));
+	return iter != columns.end() && y > iter->second->top[column_offset(x, z)] ? LIGHT_MAX : 0;
+}
+
+//Chunks which were never lit are taken to hold the generated terrain, solid at and below the surface
+int Lighting::find_top(Column* column, int x, int y, int z)
+{
+	int ground = column->ground[column_offset(x, z)];
+	while(true)
+	{
+		int bottom = y & ~(CHUNK_Y-1);
+		auto c = find_chunk(x, y, z);
+		if(c == NULL)
+		{
+			if(y <= ground)
+				return y;
+			if(bottom <= ground)
+				return ground;
+			y = bottom - 1;
+			continue;
+		}
+
+		for(; y>=bottom; --y)
+		{
+			if(c->attr[cell_offset(x, y, z)] & OPAQUE)
+				return y;
+		}
+	}
+}
+
+void Lighting::set_top(Column* column, int x, int z, int top)
+{
+	int& current = column->top[column_offset(x, z)];
+	int prev = current;
+	if(top == prev)
+		return;
+	current = top;
+
+	//Cells which are no longer above the top lose their skylight, cells which are now above it get it back
+	int lo = min(prev, top) + 1,
+		hi = max(prev, top);
+	for(int y=lo; y<=hi; )
+	{
+		auto c = find_chunk(x, y, z);
+		int end = min(hi, y | (CHUNK_Y-1));
+		if(c == NULL)
+		{
+			y = end + 1;
+			continue;
+		}
+
+		for(; y<=end; ++y)
+		{
+			int offset = cell_offset(x, y, z);
+			if(c->attr[offset] & OPAQUE)
+				continue;
+
+			int l = get_light(c, offset, 1);
+			LightNode n = { x, y, z, l };
+			if(top > prev)
+			{
+				if(l == 0)
+					continue;
+				set_light(c, offset, 1, 0);
+				remove_queue[1].push_back(n);
+			}
+			else if(l < LIGHT_MAX)
+			{
+				set_light(c, offset, 1, LIGHT_MAX);
+				n.level = LIGHT_MAX;
+				add_queue[1].push_back(n);
+			}
+		}
+	}
+}
+
+void Lighting::push_neighbors(int x, int y, int z)
+{
+	for(int i=0; i<6; ++i)
+	{
+		int nx = x + LIGHT_NEIGHBORS[i][0],
+			ny = y + LIGHT_NEIGHBORS[i][1],
+			nz = z + LIGHT_NEIGHBORS[i][2];
+		auto c = find_chunk(nx, ny, nz);
+		if(c == NULL)
+			continue;
+
+		int offset = cell_offset(nx, ny, nz);
+		for(int channel=0; channel<2; ++channel)
+		{
+			int l = get_light(c, offset, channel);
+			if(l > 0)
+			{
+				LightNode n = { nx, ny, nz, l };
+				add_queue[channel].push_back(n);
+			}
+		}
+	}
+}
+
+//Clears the light that came from the queued cells.  Neighbors which are at least as bright were lit from
+//somewhere else and are queued to spread again, sources keep their own level.
+void Lighting::remove_light(int channel)
+{
+	auto& queue = remove_queue[channel];
+	for(int k=0; k<queue.size(); ++k)
+	{
+		LightNode n = queue[k];
+		++cells_visited;
+
+		for(int i=0; i<6; ++i)
+		{
+			int nx = n.x + LIGHT_NEIGHBORS[i][0],
+				ny = n.y + LIGHT_NEIGHBORS[i][1],
+				nz = n.z + LIGHT_NEIGHBORS[i][2];
+			auto c = find_chunk(nx, ny, nz);
+			if(c == NULL)
+				continue;
+
+			int offset = cell_offset(nx, ny, nz),
+				l = get_light(c, offset, channel);
+			if(l == 0)
+				continue;
+
+			LightNode m = { nx, ny, nz, l };
+			if(l < n.level)
+			{
+				set_light(c, offset, channel, 0);
+				queue.push_back(m);
+
+				int s = source_level(c, offset, nx, ny, nz, channel);
+				if(s > 0)
+				{
+					set_light(c, offset, channel, s);
+					m.level = s;
+					add_queue[channel].push_back(m);
+				}
+			}
+			else
+			{
+				add_queue[channel].push_back(m);
+			}
+		}
+	}
+	queue.clear();
+}
+
+void Lighting::spread_light(int channel)
+{
+	auto& queue = add_queue[channel];
+	for(int k=0; k<queue.size(); ++k)
+	{
+		LightNode n = queue[k];
+		auto c = find_chunk(n.x, n.y, n.z);
+		if(c == NULL)
+			continue;
+
+		int l = get_light(c, cell_offset(n.x, n.y, n.z), channel);
+		if(l <= 1)
+			continue;
+		++cells_visited;
+
+		for(int i=0; i<6; ++i)
+		{
+			int nx = n.x + LIGHT_NEIGHBORS[i][0],
+				ny = n.y + LIGHT_NEIGHBORS[i][1],
+				nz = n.z + LIGHT_NEIGHBORS[i][2];
+			auto d = find_chunk(nx, ny, nz);
+			if(d == NULL)
+				continue;
+
+			int offset = cell_offset(nx, ny, nz);
+			if((d->attr[offset] & OPAQUE) || get_light(d, offset, channel) >= l - 1)
+				continue;
+
+			set_light(d, offset, channel, l - 1);
+			LightNode m = { nx, ny, nz, l - 1 };
+			queue.push_back(m);
+		}
+	}
+	queue.clear();
+}
+
+//Lights a chunk for the first time from the blocks in the scratch buffer
+void Lighting::light_chunk(ChunkID const& chunk_id, uint64_t version)
+{
+	auto c = new LightChunk();
+	c->version = version;
+	c->light_version = 1;
+	for(int i=0; i<CHUNK_SIZE; ++i)
+		c->attr[i] = (blocks[i].transparent() ? 0 : OPAQUE) | (blocks[i].emission() & 0xf);
+	memset(c->light, 0, sizeof(c->light));
+	chunks.insert(make_pair(chunk_id, c));
+
+	int bx = chunk_id.x * CHUNK_X,
+		by = chunk_id.y * CHUNK_Y,
+		bz = chunk_id.z * CHUNK_Z;
+
+	//Fold the chunk into the heightmap of its column
+	auto column = get_column(chunk_id);
+	++column->lit;
+	for(int z=0; z<CHUNK_Z; ++z)
+	for(int x=0; x<CHUNK_X; ++x)
+	{
+		int h = -1;
+		for(int y=CHUNK_Y-1; y>=0; --y)
+		{
+			if(c->attr[cell_offset(x, y, z)] & OPAQUE)
+			{
+				h = by + y;
+				break;
+			}
+		}
+
+		int top = column->top[column_offset(x, z)];
+		if(h > top)
+			set_top(column, bx + x, bz + z, h);
+		else if(by <= top && top < by + CHUNK_Y && h < top)
+			set_top(column, bx + x, bz + z, find_top(column, bx + x, top, bz + z));
+	}
+
+	//Start from the chunk's own sources and let them spread
+	for(int y=0; y<CHUNK_Y; ++y)
+	for(int z=0; z<CHUNK_Z; ++z)
+	for(int x=0; x<CHUNK_X; ++x)
+	{
+		int offset = cell_offset(x, y, z),
+			wx = bx + x, wy = by + y, wz = bz + z;
+		for(int channel=0; channel<2; ++channel)
+		{
+			int s = source_level(c, offset, wx, wy, wz, channel);
+			if(s == 0)
+				continue;
+			set_light(c, offset, channel, s);
+			LightNode n = { wx, wy, wz, s };
+			add_queue[channel].push_back(n);
+		}
+	}
+
+	//The light of the lit neighbors flows in across the faces
+	for(int f=0; f<6; ++f)
+	for(int v=0; v<CHUNK_X; ++v)
+	for(int u=0; u<CHUNK_X; ++u)
+	{
+		int x, y, z;
+		if(LIGHT_NEIGHBORS[f][0] != 0)
+		{
+			x = LIGHT_NEIGHBORS[f][0] < 0 ? -1 : CHUNK_X;
+			y = u;
+			z = v;
+		}
+		else if(LIGHT_NEIGHBORS[f][1] != 0)
+		{
+			x = u;
+			y = LIGHT_NEIGHBORS[f][1] < 0 ? -1 : CHUNK_Y;
+			z = v;
+		}
+		else
+		{
+			x = u;
+			y = v;
+			z = LIGHT_NEIGHBORS[f][2] < 0 ? -1 : CHUNK_Z;
+		}
+
+		auto d = find_chunk(bx + x, by + y, bz + z);
+		if(d == NULL)
+			continue;
+
+		int offset = cell_offset(x, y, z);
+		for(int channel=0; channel<2; ++channel)
+		{
+			int l = get_light(d, offset, channel);
+			if(l > 1)
+			{
+				LightNode n = { bx + x, by + y, bz + z, l };
+				add_queue[channel].push_back(n);
+			}
+		}
+	}
+
+	for(int channel=0; channel<2; ++channel)
+	{
+		remove_light(channel);
+		spread_light(channel);
+	}
+
+	DEBUG_PRINTF("Lit chunk %d,%d,%d\n", chunk_id.x, chunk_id.y, chunk_id.z);
+}
+
+//Relights the cells of a chunk whose opacity or emission differs from the blocks in the scratch buffer
+void Lighting::relight_chunk(ChunkID const& chunk_id, LightChunk* c, uint64_t version)
+{
+	c->version = version;
+
+	vector<int> changed;
+	for(int i=0; i<CHUNK_SIZE; ++i)
+	{
+		attr[i] = (blocks[i].transparent() ? 0 : OPAQUE) | (blocks[i].emission() & 0xf);
+		if(attr[i] != c->attr[i])
+			changed.push_back(i);
+	}
+	if(changed.empty())
+		return;
+
+	//The old attributes are kept in the scratch buffer, so every cell sees the chunk's new blocks while relighting
+	for(int k=0; k<changed.size(); ++k)
+		swap(attr[changed[k]], c->attr[changed[k]]);
+
+	int bx = chunk_id.x * CHUNK_X,
+		by = chunk_id.y * CHUNK_Y,
+		bz = chunk_id.z * CHUNK_Z;
+	auto column = get_column(chunk_id);
+
+	for(int k=0; k<changed.size(); ++k)
+	{
+		int offset = changed[k];
+		uint8_t prev = attr[offset],
+				now = c->attr[offset];
+		int x = bx + (offset & (CHUNK_X-1)),
+			z = bz + ((offset >> CHUNK_X_S) & (CHUNK_Z-1)),
+			y = by + (offset >> (CHUNK_X_S + CHUNK_Z_S));
+
+		//Block light, a blocked or dimmer cell takes its light with it
+		int l = get_light(c, offset, 0),
+			e = now & 0xf;
+		if(((now & OPAQUE) || e < l) && l > 0)
+		{
+			set_light(c, offset, 0, 0);
+			LightNode n = { x, y, z, l };
+			remove_queue[0].push_back(n);
+		}
+		if(e > 0 && e > get_light(c, offset, 0))
+		{
+			set_light(c, offset, 0, e);
+			LightNode n = { x, y, z, e };
+			add_queue[0].push_back(n);
+		}
+
+		if(!((prev ^ now) & OPAQUE))
+			continue;
+
+		//Skylight, which also moves the top of the column when the highest block changes
+		int top = column->top[column_offset(x, z)];
+		if(now & OPAQUE)
+		{
+			int s = get_light(c, offset, 1);
+			if(s > 0)
+			{
+				set_light(c, offset, 1, 0);
+				LightNode n = { x, y, z, s };
+				remove_queue[1].push_back(n);
+			}
+			if(y > top)
+				set_top(column, x, z, y);
+		}
+		else
+		{
+			if(y == top)
+				set_top(column, x, z, find_top(column, x, y - 1, z));
+			push_neighbors(x, y, z);
+		}
+	}
+
+	for(int channel=0; channel<2; ++channel)
+	{
+		remove_light(channel);
+		spread_light(channel);
+	}
+
+	cells_changed += changed.size();
+	DEBUG_PRINTF("Relit %d cells in chunk %d,%d,%d\n", (int)changed.size(), chunk_id.x, chunk_id.y, chunk_id.z);
+}
+
+//Chunks within one chunk of the radius are kept, so a player walking along a chunk border does not relight it
+//over and over.  The light which spread from a dropped chunk into its neighbors stays until they are relit.
+void Lighting::evict(vector<ChunkID> const& observers)
+{
+	int64_t keep = radius + 1;
+	for(auto iter = chunks.begin(); iter != chunks.end(); )
+	{
+		auto const& c = iter->first;
+		bool near = false;
+		for(int i=0; i<observers.size() && !near; ++i)
+		{
+			auto const& o = observers[i];
+			near =	abs((int64_t)c.x - (int64_t)o.x) <= keep &&
+					abs((int64_t)c.y - (int64_t)o.y) <= keep &&
+					abs((int64_t)c.z - (int64_t)o.z) <= keep;
+		}
+		if(near)
+		{
+			++iter;
+			continue;
+		}
+
+		DEBUG_PRINTF("Dropping light for chunk %d,%d,%d\n", c.x, c.y, c.z);
+		auto column = columns.find(ChunkID(c.x, 0, c.z));
+		if(column != columns.end() && --column->second->lit <= 0)
+		{
+			delete column->second;
+			columns.erase(column);
+		}
+		delete iter->second;
+		iter = chunks.erase(iter);
+		++chunks_evicted;
+	}
+	last_chunk = NULL;
+}
+
+void Lighting::tick(vector<ChunkID> const& observers)
+{
+	//With nobody around everything is out of range
+	if(observers.empty())
+	{
+		if(!chunks.empty())
+		{
+			queuing_rw_mutex::scoped_lock L(light_lock, true);
+			evict(observers);
+		}
+		return;
+	}
+
+	auto start = tick_count::now();
+
+	nearby.clear();
+	for(int i=0; i<observers.size(); ++i)
+	{
+		auto const& o = observers[i];
+		for(int dy=-radius; dy<=radius; ++dy)
+		for(int dz=-radius; dz<=radius; ++dz)
+		for(int dx=-radius; dx<=radius; ++dx)
+		{
+			int64_t cx = (int64_t)o.x + dx,
+					cy = (int64_t)o.y + dy,
+					cz = (int64_t)o.z + dz;
+			if(cx < 0 || cy < 0 || cz < 0 || cx >= CHUNK_IDX_MAX || cy >= CHUNK_IDX_MAX || cz >= CHUNK_IDX_MAX)
+				continue;
+			nearby.push_back(ChunkID(cx, cy, cz));
+		}
+	}
+	sort(nearby.begin(), nearby.end());
+	nearby.erase(unique(nearby.begin(), nearby.end()), nearby.end());
+
+	queuing_rw_mutex::scoped_lock L(light_lock, true);
+
+	//Top down, so the chunks above have settled the heightmap before the ones below are lit
+	int lit = 0;
+	for(int i=nearby.size()-1; i>=0; --i)
+	{
+		auto const& chunk_id = nearby[i];
+		auto iter = chunks.find(chunk_id);
+		auto c = iter == chunks.end() ? NULL : iter->second;
+		if(c == NULL && lit >= max_chunks)
+			continue;
+
+		//Only chunks which are already in memory, the lighting never waits for the generator
+		uint64_t version;
+		{
+			GameMap::const_accessor acc;
+			if(!game_map->find_chunk_buffer(acc, chunk_id))
+				continue;
+			version = acc->second->last_modified();
+			if(c != NULL && c->version == version)
+				continue;
+			acc->second->decompress_chunk(blocks);
+		}
+
+		if(c == NULL)
+		{
+			light_chunk(chunk_id, version);
+			++lit;
+			++chunks_lit;
+		}
+		else
+		{
+			relight_chunk(chunk_id, c, version);
+			++chunks_changed;
+		}
+	}
+
+	evict(observers);
+
+	double elapsed = (tick_count::now() - start).seconds();
+	++ticks;
+	tick_time_total += elapsed;
+	tick_time_max = max(tick_time_max, elapsed);
+}
+
+uint64_t Lighting::get_chunk_light(ChunkID const& chunk_id, uint8_t* light)
+{
+	queuing_rw_mutex::scoped_lock L(light_lock, false);
+
+	auto iter = chunks.find(chunk_id);
+	if(iter == chunks.end())
+		return 0;
+	memcpy(light, iter->second->light, CHUNK_SIZE);
+	return iter->second->light_version;
+}
+
+uint64_t Lighting::get_boundary(ChunkID const& chunk_id, int face, uint8_t* light)
+{
+	queuing_rw_mutex::scoped_lock L(light_lock, false);
+
+	auto iter = chunks.find(chunk_id);
+	if(iter == chunks.end())
+		return 0;
+
+	auto c = iter->second;
+	for(int v=0; v<CHUNK_X; ++v)
+	for(int u=0; u<CHUNK_X; ++u)
+	{
+		int x, y, z;
+		if(LIGHT_NEIGHBORS[face][0] != 0)
+		{
+			x = LIGHT_NEIGHBORS[face][0] < 0 ? 0 : CHUNK_X-1;
+			y = u;
+			z = v;
+		}
+		else if(LIGHT_NEIGHBORS[face][1] != 0)
+		{
+			x = u;
+			y = LIGHT_NEIGHBORS[face][1] < 0 ? 0 : CHUNK_Y-1;
+			z = v;
+		}
+		else
+		{
+			x = u;
+			y = v;
+			z = LIGHT_NEIGHBORS[face][2] < 0 ? 0 : CHUNK_Z-1;
+		}
+		light[u + v * CHUNK_X] = c->light[cell_offset(x, y, z)];
+	}
+	return c->light_version;
+}
+
+void Lighting::print_stats()
+{
+	printf("Lighting: %d chunks lit, %ld new, %ld relit and %ld dropped over %ld ticks, %ld cells changed, %ld cells visited\n",
+		(int)chunks.size(), chunks_lit, chunks_changed, chunks_evicted, ticks, cells_changed, cells_visited);
+	printf("  Tick time: mean %.2f ms, max %.2f ms\n",
+		ticks > 0 ? 1000.0 * tick_time_total / ticks : 0.0,
+		1000.0 * tick_time_max);
+
+	ticks = chunks_lit = chunks_changed = chunks_evicted = cells_changed = cells_visited = 0;
+	tick_time_total = tick_time_max = 0.0;
+}
+
+};
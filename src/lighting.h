@@ -0,0 +1,157 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+#include <tbb/queuing_rw_mutex.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+
+namespace Game
+{
+	//Brightest light level
+	const int LIGHT_MAX = 15;
+	
+	//Neighbors of a cell, also the order of the faces of a chunk
+	const int LIGHT_NEIGHBORS[6][3] =
+	{
+		{-1, 0, 0},
+		{ 1, 0, 0},
+		{ 0,-1, 0},
+		{ 0, 1, 0},
+		{ 0, 0,-1},
+		{ 0, 0, 1}
+	};
+
+	//Block light and skylight for the chunks near the players.  Each cell holds two levels from 0 to 15,
+	//block light in the low nibble and skylight in the high one.  Blocks emit their BLOCK_EMISSION, and a
+	//cell above the highest opaque block of its column gets full skylight.  Light spreads to the six
+	//neighbors of a cell, one level dimmer per step, and stops at opaque blocks.
+	//
+	//Chunks are lit once when a player first comes within lighting_radius chunks of them, at most
+	//lighting_max_chunks per tick.  Afterwards the versions of the chunks near the players are checked every
+	//tick, and the cells whose opacity or emission changed are relit by removing and re-adding their light
+	//breadth first.  The work for an edit scales with the volume of light it changes, not with the size of
+	//the chunk.  Light crosses chunk borders freely but is not spread into chunks which have not been lit.
+	//Chunks more than one chunk outside the radius of every player are dropped, and lit again when a player
+	//comes back.
+	//
+	//The light is not sent anywhere yet.  It follows from the blocks, so a promoted follower lights its own
+	//replica, and the clients still light the chunks they receive themselves.
+	struct Lighting
+	{
+		Lighting(Config* config, GameMap* game_map);
+		~Lighting();
+
+		//Lights new chunks and relights changed ones around the observers, called once per tick from the world loop
+		void tick(std::vector<ChunkID> const& observers);
+
+		//Copies the light of a chunk, returns its light version or 0 if the chunk has not been lit.  The version
+		//increases whenever the light in the chunk changes.  May be called from any thread.
+		uint64_t get_chunk_light(ChunkID const&, uint8_t* light);
+
+		//Copies the CHUNK_X * CHUNK_X layer of a chunk facing the given neighbor, in LIGHT_NEIGHBORS order.
+		//This is what a follower or client needs to light a chunk next to one it does not have.
+		uint64_t get_boundary(ChunkID const&, int face, uint8_t* light);
+
+		void print_stats();
+
+		//Light levels of a cell
+		static int block_light(uint8_t l)	{ return l & 0xf; }
+		static int sky_light(uint8_t l)		{ return l >> 4; }
+
+	private:
+
+		//Per cell flags, the emission is stored in the low nibble
+		static const uint8_t OPAQUE = 0x80;
+
+		struct LightChunk
+		{
+			//Map version the light was computed from, and a counter bumped when the light changes
+			uint64_t version, light_version;
+			uint8_t attr[CHUNK_SIZE];
+			uint8_t light[CHUNK_SIZE];
+		};
+		typedef std::unordered_map<ChunkID, LightChunk*, ChunkIDHashCompare> light_map_t;
+
+		//Skylight heightmap of a chunk column.  top is the highest opaque block in the column, ground the
+		//generated surface, which stands in for the chunks that have not been lit.
+		struct Column
+		{
+			int top[CHUNK_X * CHUNK_Z];
+			int ground[CHUNK_X * CHUNK_Z];
+
+			//Lit chunks in the column, the column is dropped with the last of them
+			int lit;
+		};
+		typedef std::unordered_map<ChunkID, Column*, ChunkIDHashCompare> column_map_t;
+
+		//A cell waiting to be spread or removed, with the level it had
+		struct LightNode
+		{
+			int x, y, z;
+			int level;
+		};
+		typedef std::vector<LightNode> node_list_t;
+
+		//Interface to separate sytems
+		Config* config;
+		GameMap* game_map;
+
+		int radius, max_chunks;
+
+		//Held for writing while the light is updated
+		tbb::queuing_rw_mutex light_lock;
+		light_map_t chunks;
+		column_map_t columns;
+
+		//Last chunk found by position
+		LightChunk* last_chunk;
+		ChunkID last_chunk_id;
+
+		//Breadth first queues for each channel, block light is channel 0 and skylight channel 1
+		node_list_t add_queue[2], remove_queue[2];
+
+		//Scratch space for the current tick
+		std::vector<ChunkID> nearby;
+		Block blocks[CHUNK_SIZE];
+		uint8_t attr[CHUNK_SIZE];
+
+		//Statistics since the last print
+		uint64_t ticks, chunks_lit, chunks_changed, chunks_evicted, cells_changed, cells_visited;
+		double tick_time_total, tick_time_max;
+
+		LightChunk* find_chunk(int x, int y, int z);
+		Column* get_column(ChunkID const&);
+		uint8_t get_light(LightChunk* c, int offset, int channel) const;
+		void set_light(LightChunk* c, int offset, int channel, int level);
+		
+		//Level a cell has on its own, from emission or direct skylight
+		int source_level(LightChunk* c, int offset, int x, int y, int z, int channel);
+
+		//Highest opaque block at or below y in a column
+		int find_top(Column* column, int x, int y, int z);
+
+		//Moves the top of a column, turning the direct skylight on or off for the cells in between
+		void set_top(Column* column, int x, int z, int top);
+
+		//Queues the light of the six neighbors of a cell to spread into it
+		void push_neighbors(int x, int y, int z);
+
+		//Drops the chunks which are out of range of every observer
+		void evict(std::vector<ChunkID> const& observers);
+
+		void light_chunk(ChunkID const&, uint64_t version);
+		void relight_chunk(ChunkID const&, LightChunk*, uint64_t version);
+		void remove_light(int channel);
+		void spread_light(int channel);
+	};
+};
+
+#endif
+
@@ -479,6 +479,40 @@ void console_loop()
 			printf("Resetting configuration file to defaults\n");
 			config->resetDefaults();
 		}
+		else if(command == "promote")
+		{
+			printf("Promoting follower\n");
+			world->stop_follower();
+			init_app();
+		}
+		else if(command == "genstat")
+		{
+			world->print_generation_stats();
+		}
+		else if(command == "physstat")
+		{
+			world->print_physics_stats();
+		}
+		else if(command == "physrec")
+		{
+			//physrec <file> <x0> <y0> <z0> <x1> <y1> <z1> records a box of chunks, physrec stop ends it
+			string path;
+			cin >> path;
+			if(path == "stop")
+			{
+				world->stop_physics_recording();
+			}
+			else
+			{
+				int lo[3], hi[3];
+				cin >> lo[0] >> lo[1] >> lo[2] >> hi[0] >> hi[1] >> hi[2];
+				world->start_physics_recording(path, ChunkID(lo[0], lo[1], lo[2]), ChunkID(hi[0], hi[1], hi[2]));
+			}
+		}
+		else if(command == "replstat")
+		{
+			world->print_replication_stats();
+		}
 		else if(command == "help")
 		{
 			printf("Read source code for documentation\n");
@@ -507,6 +541,9 @@ int main(int argc, char** argv)
 	string config_file = "data/config.tch";	
 	if(argc > 1)
 		config_file = string(argv[1]);
+	
+	//In follow mode the server mirrors a primary's map until it is promoted
+	bool follow = argc > 2 && string(argv[2]) == "follow";
 
 	printf("Allocating objects\n");
 	auto GC = ScopeDelete<Config>(config = new Config(config_file));
@@ -514,16 +551,31 @@ int main(int argc, char** argv)
 	auto GL = ScopeDelete<LoginDB>(login_db = new LoginDB(config));
 	auto GS = ScopeDelete<HttpServer>(server = new HttpServer(config, post_callback, websocket_callback));
 
-	init_app();
-	
-	if(app_running)
+	if(follow)
 	{
+		printf("Following replication primary\n");
+		if(!world->start_follower())
+			printf("Failed to start replication follower\n");
+		
 		console_loop();
-		shutdown_app();
+		world->stop_follower();
+		
+		if(app_running)
+			shutdown_app();
 	}
 	else
 	{
-		printf("Error initiailizing server, shutting down\n");
+		init_app();
+	
+		if(app_running)
+		{
+			console_loop();
+			shutdown_app();
+		}
+		else
+		{
+			printf("Error initiailizing server, shutting down\n");
+		}
 	}
 	
 	//Kill protocol buffer library
@@ -0,0 +1,282 @@
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "chunk.h"
+#include "chunk_filter.h"
+#include "map_image.h"
+
+using namespace std;
+
+#define MAP_IMAGE_DEBUG 1
+
+#ifndef MAP_IMAGE_DEBUG
+#define DEBUG_PRINTF(...)
+#else
+#define DEBUG_PRINTF(...)  fprintf(stderr,__VA_ARGS__)
+#endif
+
+namespace Game
+{
+
+static const char MAP_IMAGE_MAGIC[8] = { 'M', 'H', 'M', 'A', 'P', 'I', 'M', 'G' };
+
+//-------------------------------------------------------------------
+// Reader
+//-------------------------------------------------------------------
+
+MapImage::MapImage() : base(NULL), length(0), header(NULL)
+{
+}
+
+MapImage::~MapImage()
+{
+	close();
+}
+
+//Maps an image file and checks that it is consistent
+bool MapImage::open(string const& path, uint64_t stamp)
+{
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(MapImageHeader))
+	{
+		::close(fd);
+		return false;
+	}
+	
+	//Pages are faulted in lazily as chunks are looked up
+	void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(ptr == MAP_FAILED)
+		return false;
+	
+	base = (const uint8_t*)ptr;
+	length = st.st_size;
+	auto h = (MapImageHeader const*)base;
+	
+	//Validate header
+	const char* error = NULL;
+	if(memcmp(h->magic, MAP_IMAGE_MAGIC, sizeof(MAP_IMAGE_MAGIC)) != 0)
+		error = "bad magic";
+	else if(h->version != MAP_IMAGE_VERSION || h->chunk_size != CHUNK_SIZE)
+		error = "wrong version";
+	else if(h->file_size != length)
+		error = "truncated";
+	else if(h->stamp != stamp)
+		error = "stale (does not match map database)";
+	else if(h->chunk_offset + h->num_chunks * sizeof(MapImageEntry) > length ||
+			h->surface_offset + h->num_surfaces * sizeof(MapImageEntry) > length ||
+			h->filter_offset + h->filter_words * sizeof(uint64_t) > length)
+		error = "bad index";
+	
+	if(error != NULL)
+	{
+		printf("Rejecting map image %s: %s\n", path.c_str(), error);
+		munmap((void*)base, length);
+		base = NULL;
+		length = 0;
+		return false;
+	}
+	
+	header = h;
+	
+	printf("Mapped image %s, %ld chunks, %ld surface chunks\n", path.c_str(), header->num_chunks, header->num_surfaces);
+	return true;
+}
+
+void MapImage::close()
+{
+	if(base != NULL)
+		munmap((void*)base, length);
+	base = NULL;
+	length = 0;
+	header = NULL;
+}
+
+//Binary search in a sorted entry table
+static MapImageEntry const* find_entry(MapImageEntry const* table, uint64_t n, ChunkID const& chunk_id)
+{
+	MapImageEntry key;
+	key.x = chunk_id.x;
+	key.y = chunk_id.y;
+	key.z = chunk_id.z;
+	
+	auto iter = lower_bound(table, table + n, key);
+	if(iter == table + n ||
+		iter->x != key.x ||
+		iter->y != key.y ||
+		iter->z != key.z)
+	{
+		return NULL;
+	}
+	return iter;
+}
+
+MapImageEntry const* MapImage::find_chunk(ChunkID const& chunk_id) const
+{
+	if(header == NULL)
+		return NULL;
+	return find_entry((MapImageEntry const*)(base + header->chunk_offset), header->num_chunks, chunk_id);
+}
+
+MapImageEntry const* MapImage::find_surface(ChunkID const& chunk_id) const
+{
+	if(header == NULL)
+		return NULL;
+	return find_entry((MapImageEntry const*)(base + header->surface_offset), header->num_surfaces, chunk_id);
+}
+
+bool MapImage::load_filter(ChunkFilter& filter) const
+{
+	if(header == NULL)
+		return false;
+	return filter.load((const uint64_t*)(base + header->filter_offset), header->filter_words,
+		header->filter_hashes, header->filter_count);
+}
+
+//-------------------------------------------------------------------
+// Writer
+//-------------------------------------------------------------------
+
+MapImageWriter::MapImageWriter() : fp(NULL), offset(0), failed(false)
+{
+}
+
+MapImageWriter::~MapImageWriter()
+{
+	if(fp != NULL)
+	{
+		fclose(fp);
+		unlink(tmp_path.c_str());
+	}
+}
+
+//Starts writing an image, the file only replaces the old image once it is complete
+bool MapImageWriter::open(string const& p)
+{
+	path = p;
+	tmp_path = p + ".tmp";
+	
+	fp = fopen(tmp_path.c_str(), "wb");
+	if(fp == NULL)
+		return false;
+	
+	//Reserve space for the header
+	MapImageHeader header;
+	memset(&header, 0, sizeof(header));
+	failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+	offset = sizeof(header);
+	return !failed;
+}
+
+bool MapImageWriter::add_entry(vector<MapImageEntry>& table, ChunkID const& chunk_id, ChunkBuffer const& chunk, uint32_t flags)
+{
+	if(fp == NULL || failed || chunk.encoded_size() == 0)
+		return false;
+
+	MapImageEntry e;
+	memset(&e, 0, sizeof(e));
+	e.x = chunk_id.x;
+	e.y = chunk_id.y;
+	e.z = chunk_id.z;
+	e.flags = flags;
+	e.timestamp = chunk.last_modified();
+	e.source_version = chunk.source_version();
+	e.offset = offset;
+	e.size = chunk.encoded_size();
+	
+	if(fwrite(chunk.encoded_data(), 1, e.size, fp) != e.size)
+	{
+		failed = true;
+		return false;
+	}
+	
+	offset += e.size;
+	table.push_back(e);
+	return true;
+}
+
+//Adds a chunk, its protocol buffer data must be cached
+void MapImageWriter::add_chunk(ChunkID const& chunk_id, ChunkBuffer const& chunk)
+{
+	add_entry(chunks, chunk_id, chunk, 0);
+}
+
+//Adds a surface chunk
+void MapImageWriter::add_surface(ChunkID const& chunk_id, ChunkBuffer const& chunk)
+{
+	add_entry(surfaces, chunk_id, chunk, chunk.empty_surface() ? MAP_IMAGE_EMPTY_SURFACE : 0);
+}
+
+//Writes the index and header, then moves the image into place
+bool MapImageWriter::finish(uint64_t stamp, ChunkFilter const& filter)
+{
+	if(fp == NULL)
+		return false;
+
+	sort(chunks.begin(), chunks.end());
+	sort(surfaces.begin(), surfaces.end());
+
+	//Align the index
+	while(!failed && (offset & 7))
+	{
+		failed = fputc(0, fp) == EOF;
+		++offset;
+	}
+	
+	MapImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAP_IMAGE_MAGIC, sizeof(MAP_IMAGE_MAGIC));
+	header.version			= MAP_IMAGE_VERSION;
+	header.chunk_size		= CHUNK_SIZE;
+	header.stamp			= stamp;
+	header.num_chunks		= chunks.size();
+	header.chunk_offset		= offset;
+	header.num_surfaces		= surfaces.size();
+	header.surface_offset	= header.chunk_offset + chunks.size() * sizeof(MapImageEntry);
+	header.filter_words		= filter.num_words();
+	header.filter_count		= filter.size();
+	header.filter_hashes	= filter.num_hashes();
+	header.filter_offset	= header.surface_offset + surfaces.size() * sizeof(MapImageEntry);
+	header.file_size		= header.filter_offset + filter.num_words() * sizeof(uint64_t);
+	
+	if(!failed && chunks.size() > 0)
+		failed = fwrite(&chunks[0], sizeof(MapImageEntry), chunks.size(), fp) != chunks.size();
+	if(!failed && surfaces.size() > 0)
+		failed = fwrite(&surfaces[0], sizeof(MapImageEntry), surfaces.size(), fp) != surfaces.size();
+	if(!failed)
+		failed = fwrite(filter.data(), sizeof(uint64_t), filter.num_words(), fp) != filter.num_words();
+	if(!failed)
+		failed = fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1;
+	if(!failed)
+		failed = fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+	
+	fclose(fp);
+	fp = NULL;
+	
+	if(failed || rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		printf("Failed to write map image %s\n", path.c_str());
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	
+	printf("Wrote map image %s, %ld chunks, %ld surface chunks, %ld bytes\n", path.c_str(), 
+		header.num_chunks, header.num_surfaces, header.file_size);
+	return true;
+}
+
+};
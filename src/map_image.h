@@ -0,0 +1,114 @@
+#ifndef MAP_IMAGE_H
+#define MAP_IMAGE_H
+
+#include <stdint.h>
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "chunk.h"
+#include "chunk_filter.h"
+
+namespace Game
+{
+	//Version of the map image format, bump this whenever the layout or chunk encoding changes
+	#define MAP_IMAGE_VERSION		3
+
+	//A map image is a snapshot of the in-memory map, written on shutdown and mmapped on start up
+	//so the server can begin serving without reloading the database.  All references within the
+	//file are byte offsets from the start of the file.
+	//
+	//Layout:
+	//	MapImageHeader
+	//	Run length encoded chunk data (same encoding as Network::Chunk::data)
+	//	MapImageEntry[num_chunks]		sorted by chunk id
+	//	MapImageEntry[num_surfaces]		sorted by chunk id
+	//	uint64_t[filter_words]			bits of the stored chunk filter
+	//
+	//An image is only valid together with the map database it was written after.  The stamp in
+	//the header must match the stamp record in the database, which is removed as soon as the
+	//image is accepted so that a later restart can never pick up a stale image.
+	struct MapImageHeader
+	{
+		char		magic[8];
+		uint32_t	version, chunk_size;
+		uint64_t	stamp, file_size;
+		uint64_t	num_chunks, chunk_offset;
+		uint64_t	num_surfaces, surface_offset;
+		uint64_t	filter_words, filter_count, filter_offset;
+		uint32_t	filter_hashes, pad;
+	};
+	
+	struct MapImageEntry
+	{
+		uint32_t	x, y, z, flags;
+		uint64_t	timestamp, source_version;
+		uint64_t	offset;
+		uint32_t	size, pad;
+		
+		bool operator<(MapImageEntry const& other) const
+		{
+			if(x != other.x)	return x < other.x;
+			if(y != other.y)	return y < other.y;
+			return z < other.z;
+		}
+	};
+	
+	//Key of the stamp record in the map database
+	#define MAP_IMAGE_STAMP_KEY			"image_stamp"
+	
+	//Entry flags
+	#define MAP_IMAGE_EMPTY_SURFACE		1
+	
+	//Read only view of a map image
+	struct MapImage
+	{
+		MapImage();
+		~MapImage();
+		
+		//Maps an image, fails if it is missing, corrupt or does not match the stamp
+		bool open(std::string const& path, uint64_t stamp);
+		void close();
+		bool is_open() const { return header != NULL; }
+		
+		//Looks up a chunk/surface chunk, returns NULL if it is not in the image
+		MapImageEntry const* find_chunk(ChunkID const&) const;
+		MapImageEntry const* find_surface(ChunkID const&) const;
+		
+		//Retrieves the encoded data for an entry
+		const uint8_t* entry_data(MapImageEntry const* e) const { return base + e->offset; }
+		
+		//Restores the stored chunk filter
+		bool load_filter(ChunkFilter&) const;
+		
+	private:
+		const uint8_t*			base;
+		uint64_t				length;
+		MapImageHeader const*	header;
+	};
+	
+	//Writes a map image.  Data is streamed out as chunks are added, the index is written at the end.
+	struct MapImageWriter
+	{
+		MapImageWriter();
+		~MapImageWriter();
+	
+		bool open(std::string const& path);
+		void add_chunk(ChunkID const&, ChunkBuffer const&);
+		void add_surface(ChunkID const&, ChunkBuffer const&);
+		bool finish(uint64_t stamp, ChunkFilter const&);
+		
+	private:
+		std::string		path, tmp_path;
+		FILE*			fp;
+		uint64_t		offset;
+		bool			failed;
+		std::vector<MapImageEntry>	chunks, surfaces;
+		
+		bool add_entry(std::vector<MapImageEntry>&, ChunkID const&, ChunkBuffer const&, uint32_t flags);
+	};
+};
+
+#endif
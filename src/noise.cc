@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <emmintrin.h>
 
 static int64_t grad3[12][3] = {
 {1,1,0},
@@ -20,9 +21,34 @@ static int64_t grad3[12][3] = {
 {0,-1,-1}};
 
 int64_t seed = 0;
+
+//Permutation table for the batch noise functions, doubled to avoid wrapping indices
+static int32_t perm[512];
+
+static void init_perm()
+{
+	for(int i=0; i<256; ++i)
+		perm[i] = i;
+	
+	//Fisher-Yates shuffle driven by the seeded hash
+	for(int i=255; i>0; --i)
+	{
+		int j = (uint32_t)pseudorand(i) % (i + 1);
+		int32_t tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+	
+	for(int i=0; i<256; ++i)
+		perm[i+256] = perm[i];
+}
+
+static struct PermInit { PermInit() { init_perm(); } } perm_init;
+
 void setNoiseSeed(int64_t i)
 {
 	seed = i;
+	init_perm();
 }
 
 int32_t pseudorand(int32_t a)
@@ -270,3 +296,278 @@ float simplexNoise3D(float xin, float yin, float zin, int64_t octaves)
 	
 	return retval + (.5 * simplexNoise3D(xin * 2, yin * 2, zin * 2, octaves - 1));
 }
+
+
+//-------------------------------------------------------------------
+// Batch noise
+//-------------------------------------------------------------------
+
+//Floor for floats which fit in an int32 (SSE2 has no round instruction)
+static inline __m128 floor_ps(__m128 x)
+{
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+}
+
+//Selects a where mask is set, otherwise b
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 negate_if(__m128i bit, __m128 v)
+{
+	__m128 mask = _mm_castsi128_ps(_mm_cmpeq_epi32(bit, _mm_setzero_si128()));
+	return select_ps(mask, v, _mm_sub_ps(_mm_setzero_ps(), v));
+}
+
+//2D gradients, 8 directions picked by the low bits of the hash
+static inline __m128 grad2_ps(__m128i h, __m128 x, __m128 y)
+{
+	__m128 lo = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_and_si128(h, _mm_set1_epi32(7)), _mm_set1_epi32(4)));
+	__m128 u = select_ps(lo, x, y);
+	__m128 v = select_ps(lo, y, x);
+	return _mm_add_ps(
+		negate_if(_mm_and_si128(h, _mm_set1_epi32(1)), u),
+		negate_if(_mm_and_si128(h, _mm_set1_epi32(2)), _mm_add_ps(v, v)));
+}
+
+//3D gradients, the 12 cube edge directions (with 4 repeated) picked by the low 4 bits of the hash
+static inline __m128 grad3_ps(__m128i h, __m128 x, __m128 y, __m128 z)
+{
+	h = _mm_and_si128(h, _mm_set1_epi32(15));
+	__m128 lt8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+	__m128 lt4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+	__m128 use_x = _mm_castsi128_ps(_mm_or_si128(
+		_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+		_mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+	__m128 u = select_ps(lt8, x, y);
+	__m128 v = select_ps(lt4, y, select_ps(use_x, x, z));
+	return _mm_add_ps(
+		negate_if(_mm_and_si128(h, _mm_set1_epi32(1)), u),
+		negate_if(_mm_and_si128(h, _mm_set1_epi32(2)), v));
+}
+
+//Falloff kernel for one simplex corner
+static inline __m128 corner_ps(__m128 r2, __m128 t0, __m128 g)
+{
+	__m128 t = _mm_max_ps(_mm_sub_ps(t0, r2), _mm_setzero_ps());
+	t = _mm_mul_ps(t, t);
+	return _mm_mul_ps(_mm_mul_ps(t, t), g);
+}
+
+//Hashes lattice points through the permutation table
+static inline __m128i hash2(__m128i i, __m128i j)
+{
+	int32_t ii[4], jj[4], h[4];
+	_mm_storeu_si128((__m128i*)ii, i);
+	_mm_storeu_si128((__m128i*)jj, j);
+	for(int l=0; l<4; ++l)
+		h[l] = perm[(ii[l] & 255) + perm[jj[l] & 255]];
+	return _mm_loadu_si128((__m128i*)h);
+}
+
+static inline __m128i hash3(__m128i i, __m128i j, __m128i k)
+{
+	int32_t ii[4], jj[4], kk[4], h[4];
+	_mm_storeu_si128((__m128i*)ii, i);
+	_mm_storeu_si128((__m128i*)jj, j);
+	_mm_storeu_si128((__m128i*)kk, k);
+	for(int l=0; l<4; ++l)
+		h[l] = perm[(ii[l] & 255) + perm[(jj[l] & 255) + perm[kk[l] & 255]]];
+	return _mm_loadu_si128((__m128i*)h);
+}
+
+//Single octave of 2D simplex noise for 4 points
+static inline __m128 simplex2_ps(__m128 x, __m128 y)
+{
+	const __m128 F2 = _mm_set1_ps(0.366025404f);
+	const __m128 G2 = _mm_set1_ps(0.211324865f);
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	__m128 s = _mm_mul_ps(_mm_add_ps(x, y), F2);
+	__m128 i = floor_ps(_mm_add_ps(x, s));
+	__m128 j = floor_ps(_mm_add_ps(y, s));
+	
+	__m128 t = _mm_mul_ps(_mm_add_ps(i, j), G2);
+	__m128 x0 = _mm_sub_ps(x, _mm_sub_ps(i, t));
+	__m128 y0 = _mm_sub_ps(y, _mm_sub_ps(j, t));
+	
+	//Pick the triangle
+	__m128 lower = _mm_cmpgt_ps(x0, y0);
+	__m128 i1 = _mm_and_ps(lower, one);
+	__m128 j1 = _mm_andnot_ps(lower, one);
+	
+	__m128 x1 = _mm_add_ps(_mm_sub_ps(x0, i1), G2);
+	__m128 y1 = _mm_add_ps(_mm_sub_ps(y0, j1), G2);
+	__m128 x2 = _mm_add_ps(_mm_sub_ps(x0, one), _mm_add_ps(G2, G2));
+	__m128 y2 = _mm_add_ps(_mm_sub_ps(y0, one), _mm_add_ps(G2, G2));
+	
+	__m128i ii = _mm_cvttps_epi32(i), jj = _mm_cvttps_epi32(j);
+	__m128i ione = _mm_set1_epi32(1);
+	__m128i h0 = hash2(ii, jj);
+	__m128i h1 = hash2(_mm_add_epi32(ii, _mm_cvttps_epi32(i1)), _mm_add_epi32(jj, _mm_cvttps_epi32(j1)));
+	__m128i h2 = hash2(_mm_add_epi32(ii, ione), _mm_add_epi32(jj, ione));
+	
+	const __m128 half = _mm_set1_ps(0.5f);
+	__m128 n = corner_ps(_mm_add_ps(_mm_mul_ps(x0, x0), _mm_mul_ps(y0, y0)), half, grad2_ps(h0, x0, y0));
+	n = _mm_add_ps(n, corner_ps(_mm_add_ps(_mm_mul_ps(x1, x1), _mm_mul_ps(y1, y1)), half, grad2_ps(h1, x1, y1)));
+	n = _mm_add_ps(n, corner_ps(_mm_add_ps(_mm_mul_ps(x2, x2), _mm_mul_ps(y2, y2)), half, grad2_ps(h2, x2, y2)));
+	
+	return _mm_mul_ps(n, _mm_set1_ps(40.0f));
+}
+
+//Single octave of 3D simplex noise for 4 points
+static inline __m128 simplex3_ps(__m128 x, __m128 y, __m128 z)
+{
+	const __m128 F3 = _mm_set1_ps(1.0f/3.0f);
+	const __m128 G3 = _mm_set1_ps(1.0f/6.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+	__m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(x, y), z), F3);
+	__m128 i = floor_ps(_mm_add_ps(x, s));
+	__m128 j = floor_ps(_mm_add_ps(y, s));
+	__m128 k = floor_ps(_mm_add_ps(z, s));
+	
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(i, j), k), G3);
+	__m128 x0 = _mm_sub_ps(x, _mm_sub_ps(i, t));
+	__m128 y0 = _mm_sub_ps(y, _mm_sub_ps(j, t));
+	__m128 z0 = _mm_sub_ps(z, _mm_sub_ps(k, t));
+	
+	//Rank the coordinates to pick the tetrahedron, same cases as simplexNoise3D
+	__m128 x_ge_y = _mm_cmpge_ps(x0, y0);
+	__m128 y_ge_z = _mm_cmpge_ps(y0, z0);
+	__m128 x_ge_z = _mm_cmpge_ps(x0, z0);
+	__m128 y_gt_x = _mm_xor_ps(x_ge_y, all);
+	
+	__m128 i1 = _mm_and_ps(_mm_and_ps(x_ge_y, x_ge_z), one);
+	__m128 j1 = _mm_and_ps(_mm_and_ps(y_gt_x, y_ge_z), one);
+	__m128 k1 = _mm_andnot_ps(_mm_or_ps(x_ge_z, y_ge_z), one);
+	__m128 i2 = _mm_and_ps(_mm_or_ps(x_ge_y, x_ge_z), one);
+	__m128 j2 = _mm_and_ps(_mm_or_ps(y_gt_x, y_ge_z), one);
+	__m128 k2 = _mm_andnot_ps(_mm_and_ps(x_ge_z, y_ge_z), one);
+	
+	__m128 G3_2 = _mm_add_ps(G3, G3), G3_3 = _mm_add_ps(G3_2, G3);
+	__m128 x1 = _mm_add_ps(_mm_sub_ps(x0, i1), G3);
+	__m128 y1 = _mm_add_ps(_mm_sub_ps(y0, j1), G3);
+	__m128 z1 = _mm_add_ps(_mm_sub_ps(z0, k1), G3);
+	__m128 x2 = _mm_add_ps(_mm_sub_ps(x0, i2), G3_2);
+	__m128 y2 = _mm_add_ps(_mm_sub_ps(y0, j2), G3_2);
+	__m128 z2 = _mm_add_ps(_mm_sub_ps(z0, k2), G3_2);
+	__m128 x3 = _mm_add_ps(_mm_sub_ps(x0, one), G3_3);
+	__m128 y3 = _mm_add_ps(_mm_sub_ps(y0, one), G3_3);
+	__m128 z3 = _mm_add_ps(_mm_sub_ps(z0, one), G3_3);
+	
+	__m128i ii = _mm_cvttps_epi32(i), jj = _mm_cvttps_epi32(j), kk = _mm_cvttps_epi32(k);
+	__m128i ione = _mm_set1_epi32(1);
+	__m128i h0 = hash3(ii, jj, kk);
+	__m128i h1 = hash3(
+		_mm_add_epi32(ii, _mm_cvttps_epi32(i1)),
+		_mm_add_epi32(jj, _mm_cvttps_epi32(j1)),
+		_mm_add_epi32(kk, _mm_cvttps_epi32(k1)));
+	__m128i h2 = hash3(
+		_mm_add_epi32(ii, _mm_cvttps_epi32(i2)),
+		_mm_add_epi32(jj, _mm_cvttps_epi32(j2)),
+		_mm_add_epi32(kk, _mm_cvttps_epi32(k2)));
+	__m128i h3 = hash3(_mm_add_epi32(ii, ione), _mm_add_epi32(jj, ione), _mm_add_epi32(kk, ione));
+	
+	#define R2(X,Y,Z) _mm_add_ps(_mm_add_ps(_mm_mul_ps(X,X), _mm_mul_ps(Y,Y)), _mm_mul_ps(Z,Z))
+	const __m128 t0 = _mm_set1_ps(0.6f);
+	__m128 n = corner_ps(R2(x0,y0,z0), t0, grad3_ps(h0, x0, y0, z0));
+	n = _mm_add_ps(n, corner_ps(R2(x1,y1,z1), t0, grad3_ps(h1, x1, y1, z1)));
+	n = _mm_add_ps(n, corner_ps(R2(x2,y2,z2), t0, grad3_ps(h2, x2, y2, z2)));
+	n = _mm_add_ps(n, corner_ps(R2(x3,y3,z3), t0, grad3_ps(h3, x3, y3, z3)));
+	#undef R2
+	
+	return _mm_mul_ps(n, _mm_set1_ps(32.0f));
+}
+
+//Each octave is shifted so that the octaves are not correlated at the origin
+#define OCTAVE_SHIFT	17.31f
+
+void simplexNoise2DBatch(float x, float z, float step, int nx, int nz, int64_t octaves, float* out)
+{
+	const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+
+	for(int j=0; j<nz; ++j)
+	for(int i=0; i<nx; i+=4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		float freq = 1.0f, amp = 1.0f, norm = 0.0f;
+		
+		for(int64_t o=0; o<octaves; ++o)
+		{
+			float shift = o * OCTAVE_SHIFT;
+			__m128 px = _mm_add_ps(_mm_mul_ps(
+				_mm_add_ps(_mm_set1_ps(x + i*step), _mm_mul_ps(lane, _mm_set1_ps(step))),
+				_mm_set1_ps(freq)), _mm_set1_ps(shift));
+			__m128 pz = _mm_set1_ps((z + j*step) * freq + shift);
+			
+			sum = _mm_add_ps(sum, _mm_mul_ps(simplex2_ps(px, pz), _mm_set1_ps(amp)));
+			norm += amp;
+			freq *= 2.0f;
+			amp *= 0.5f;
+		}
+		
+		if(norm > 0.0f)
+			sum = _mm_mul_ps(sum, _mm_set1_ps(1.0f / norm));
+		
+		//Partial groups at the end of a row
+		if(i + 4 <= nx)
+		{
+			_mm_storeu_ps(out + i + j*nx, sum);
+		}
+		else
+		{
+			float tmp[4];
+			_mm_storeu_ps(tmp, sum);
+			for(int l=0; i+l<nx; ++l)
+				out[i + l + j*nx] = tmp[l];
+		}
+	}
+}
+
+void simplexNoise3DBatch(float x, float y, float z, float step, int nx, int ny, int nz, int64_t octaves, float* out)
+{
+	const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+
+	for(int j=0; j<ny; ++j)
+	for(int k=0; k<nz; ++k)
+	for(int i=0; i<nx; i+=4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		float freq = 1.0f, amp = 1.0f, norm = 0.0f;
+		
+		for(int64_t o=0; o<octaves; ++o)
+		{
+			float shift = o * OCTAVE_SHIFT;
+			__m128 px = _mm_add_ps(_mm_mul_ps(
+				_mm_add_ps(_mm_set1_ps(x + i*step), _mm_mul_ps(lane, _mm_set1_ps(step))),
+				_mm_set1_ps(freq)), _mm_set1_ps(shift));
+			__m128 py = _mm_set1_ps((y + j*step) * freq + shift);
+			__m128 pz = _mm_set1_ps((z + k*step) * freq + shift);
+			
+			sum = _mm_add_ps(sum, _mm_mul_ps(simplex3_ps(px, py, pz), _mm_set1_ps(amp)));
+			norm += amp;
+			freq *= 2.0f;
+			amp *= 0.5f;
+		}
+		
+		if(norm > 0.0f)
+			sum = _mm_mul_ps(sum, _mm_set1_ps(1.0f / norm));
+		
+		float* ptr = out + i + nx*(k + nz*j);
+		if(i + 4 <= nx)
+		{
+			_mm_storeu_ps(ptr, sum);
+		}
+		else
+		{
+			float tmp[4];
+			_mm_storeu_ps(tmp, sum);
+			for(int l=0; i+l<nx; ++l)
+				ptr[l] = tmp[l];
+		}
+	}
+}
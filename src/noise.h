@@ -12,4 +12,15 @@ float simplexNoise3D(float xin, float yin, float zin, int64_t octaves);
 int32_t pseudorand(int32_t a);
 int64_t pseudorand_var(int64_t i, ...);
 
+//Batch fractal simplex noise.  Evaluates a whole grid of samples at once, 4 at a time with SSE2, hashing
+//lattice points through a permutation table built from the noise seed.  Sample (i,j,k) is taken at
+//(x + i*step, y + j*step, z + k*step) and each octave doubles the frequency and halves the amplitude.
+//Results are normalized to roughly [-1, 1].  These do not reproduce the scalar functions above.
+
+//Evaluates an nx by nz grid, out[i + j*nx] = noise(x + i*step, z + j*step)
+void simplexNoise2DBatch(float x, float z, float step, int nx, int nz, int64_t octaves, float* out);
+
+//Evaluates an nx by ny by nz grid in chunk order (x, then z, then y), out[i + nx*(k + nz*j)] = noise(x + i*step, y + j*step, z + k*step)
+void simplexNoise3DBatch(float x, float y, float z, float step, int nx, int ny, int nz, int64_t octaves, float* out);
+
 #endif
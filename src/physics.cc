@@ -1,3 +1,7 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
 #include <vector>
 #include <algorithm>
 
@@ -9,6 +13,8 @@
 #include "config.h"
 #include "chunk.h"
 #include "game_map.h"
+#include "rules.h"
+#include "bitplane.h"
 #include "physics.h"
 
 #define PHYSICS_DEBUG 1
@@ -26,32 +32,101 @@ using namespace tbb;
 namespace Game
 {
 
+const uint16_t Physics::ALL_CELLS;
+
+//Block rules, checked in order for each cell
+static const BlockRule BLOCK_RULES[] =
+{
+	//center			left		right		bottom			top				front		back			result
+	
+	//Sand falls into air
+	{ BlockType_Air,	{ ANY_BLOCK, ANY_BLOCK, ANY_BLOCK,		BlockType_Sand,	ANY_BLOCK, ANY_BLOCK },	BlockType_Sand },
+	{ BlockType_Sand,	{ ANY_BLOCK, ANY_BLOCK, BlockType_Air,	ANY_BLOCK,		ANY_BLOCK, ANY_BLOCK },	BlockType_Air },
+};
+
+static const int NUM_BLOCK_RULES = sizeof(BLOCK_RULES) / sizeof(BlockRule);
+
+//The compiled rules
+static const RuleTable RULE_TABLE(BLOCK_RULES, NUM_BLOCK_RULES);
+
+//Neighborhood of a cell, including the cell itself
+static const int CELL_NEIGHBORS[7][3] =
+{
+	{ 0, 0, 0},
+	{-1, 0, 0},
+	{ 1, 0, 0},
+	{ 0,-1, 0},
+	{ 0, 1, 0},
+	{ 0, 0,-1},
+	{ 0, 0, 1},
+};
+
+//Index of a cell within its chunk, in chunk order
+static inline uint16_t cell_index(int x, int y, int z)
+{
+	return	(x & (CHUNK_X-1)) +
+			((z & (CHUNK_Z-1)) << CHUNK_X_S) +
+			((y & (CHUNK_Y-1)) << (CHUNK_X_S + CHUNK_Z_S));
+}
+
 Physics::Physics(Config* cfg, GameMap* gmap) : config(cfg), game_map(gmap), base_tick(0)
 {
+	batch_state = Batch_Idle;
+	batch_due = false;
+	due_tick = 0;
+	lag = 0;
+	batches_run = batches_merged = stalls = 0;
+	commit_conflicts = 0;
+	last_batch_time = max_batch_time = last_commit_time = 0.0;
+	for(int i=0; i<Phase_Count; ++i)
+		phase_usec[i] = 0;
+	
+	record_start = record_stop = false;
+	recording = NULL;
 
+	dense_fraction = config->readFloat("physics_dense_fraction");
+	bitplane_kernel = config->readString("physics_kernel") == "bitplane";
+	max_lag = config->readInt("physics_max_lag");
+	
+	lod_enabled = false;
+	full_radius = config->readInt("physics_full_radius");
+	reduced_radius = config->readInt("physics_reduced_radius");
+	reduced_interval = config->readInt("physics_reduced_interval");
+	max_catchup = config->readInt("physics_max_catchup");
+	regions_run = regions_deferred = catchup_steps = 0;
+	
+	//The bitplane kernel only knows how sand falls
+	if(bitplane_kernel && !RULE_TABLE.same_rules(BITPLANE_RULES, NUM_BITPLANE_RULES))
+	{
+		printf("Physics rules are not supported by the bitplane kernel, using scalar updates\n");
+		bitplane_kernel = false;
+	}
 }
 
 Physics::~Physics()
 {
+	physics_tasks.wait();
+	
+	for(int i=0; i<staged.size(); ++i)
+		scalable_free(staged[i].blocks);
+	
+	if(recording != NULL)
+		delete recording;
 }
 
 void Physics::set_block(Block b, uint64_t t, int x, int y, int z)
 {
 	DEBUG_PRINTF("Writing block: %d, %d,%d,%d\n", b.int_val, x, y, z);
 
-	ChunkID c(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z);
+	intake.push( (BlockRecord){t, x, y, z, b} );
+}
 
-	queuing_rw_mutex::scoped_lock L(chunk_set_lock, false);
-	
-	for(int dx=-1; dx<=1; ++dx)
-	for(int dy=-1; dy<=1; ++dy)
-	for(int dz=-1; dz<=1; ++dz)
-	{
-		ChunkID n(c.x+dx, c.y+dy, c.z+dz);
-		active_chunks.insert(make_pair(n, true));
-	}
+//Writes at tick 0 are already in the map, they go through the intake so they are woken and recorded in order
+void Physics::touch_block(Block b, int x, int y, int z)
+{
+	DEBUG_PRINTF("Touching block: %d, %d,%d,%d\n", b.int_val, x, y, z);
 
-	pending_blocks.push_back( (BlockRecord){t, x, y, z, b} );
+	intake.push( (BlockRecord){0, x, y, z, b} );
 }
 
 //Marks a chunk for update
@@ -68,36 +143,390 @@ void Physics::mark_chunk(ChunkID const& c)
 		
 		DEBUG_PRINTF("Marking chunk %d,%d,%d\n", n.x, n.y, n.z);
 	}
+	
+	//Without finer information every cell in the chunk is active
+	spin_mutex::scoped_lock AL(active_cells_lock);
+	auto& cells = active_cells[c];
+	cells.clear();
+	cells.push_back(ALL_CELLS);
 }
 
-//Updates a chunk
-void Physics::update(uint64_t t)
+void Physics::set_observers(vector<ChunkID> const& chunks)
+{
+	spin_mutex::scoped_lock L(observers_lock);
+	observers.assign(chunks.begin(), chunks.end());
+	lod_enabled = true;
+}
+
+//Chebyshev distance in chunks from a region to the nearest observer
+static int observer_distance(vector<ChunkID, scalable_allocator<ChunkID> > const& region, vector<ChunkID, scalable_allocator<ChunkID> > const& observers)
+{
+	int d = INT_MAX;
+	for(int i=0; i<region.size(); ++i)
+	for(int j=0; j<observers.size(); ++j)
+	{
+		int dx = abs((int)(region[i].x - observers[j].x)),
+			dy = abs((int)(region[i].y - observers[j].y)),
+			dz = abs((int)(region[i].z - observers[j].z));
+		d = min(d, max(dx, max(dy, dz)));
+	}
+	return d;
+}
+
+//Adds a single cell to the active set
+void Physics::activate_cell(int x, int y, int z)
+{
+	auto& cells = active_cells[ChunkID(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z)];
+	if(cells.size() == 1 && cells[0] == ALL_CELLS)
+		return;
+	cells.push_back(cell_index(x, y, z));
+}
+
+//Advances the physics pipeline by one tick
+void Physics::tick(uint64_t ticks)
+{
+	//Only run the physics once every 16 updates
+	if((ticks % 16) == 0)
+	{
+		//Still waiting on the last request, skip ahead to the new one
+		if(batch_due)
+		{
+			DEBUG_PRINTF("Physics behind, merging batch %ld into %ld\n", due_tick, ticks - 16);
+			++batches_merged;
+			
+			//Too far behind, wait for the running batch so the simulation can not starve
+			if(++lag >= max_lag)
+			{
+				DEBUG_PRINTF("Physics stalled, waiting for batch\n");
+				++stalls;
+				physics_tasks.wait();
+			}
+		}
+		
+		batch_due = true;
+		due_tick = ticks - 16;
+	}
+	
+	//Publish the results of a finished batch between ticks
+	if(batch_state == Batch_Ready)
+		commit_ready();
+	
+	if(batch_due && batch_state == Batch_Idle)
+	{
+		apply_recording_requests(due_tick);
+		
+		lag = 0;
+		batch_due = false;
+		start_batch(due_tick);
+	}
+}
+
+//Drives the pipeline synchronously
+void Physics::flush()
 {
 	physics_tasks.wait();
+	if(batch_state == Batch_Ready)
+		commit_ready();
+	
+	if(batch_due)
+	{
+		batch_due = false;
+		start_batch(due_tick);
+		physics_tasks.wait();
+		commit_ready();
+	}
+}
+
+//Runs a batch in the background
+void Physics::start_batch(uint64_t t)
+{
 	base_tick = t;
+	batch_state = Batch_Running;
+	batch_start = tick_count::now();
+	++batches_run;
+	
 	struct TaskFunc
 	{
 		Physics* phys;
-		void operator()() const { phys->update_main(); }
+		void operator()() const
+		{
+			phys->update_main();
+			
+			double dt = (tick_count::now() - phys->batch_start).seconds();
+			phys->last_batch_time = dt;
+			phys->max_batch_time = max(phys->max_batch_time, dt);
+			phys->batch_state = Batch_Ready;
+		}
 	};
 	physics_tasks.run((TaskFunc){this});
 }
 
+//Commits a finished batch
+void Physics::commit_ready()
+{
+	auto start = tick_count::now();
+	commit();
+	last_commit_time = (tick_count::now() - start).seconds();
+	batch_state = Batch_Idle;
+}
+
+//Writes the staged results of the last batch to the map
+void Physics::commit()
+{
+	//Group the staged chunks by region
+	sort(staged.begin(), staged.end(), [](StagedChunk const& a, StagedChunk const& b)
+	{
+		return a.region < b.region;
+	});
+	
+	vector<int> groups;
+	for(int i=0; i<staged.size(); ++i)
+	{
+		if(i == 0 || !(staged[i-1].region == staged[i].region))
+			groups.push_back(i);
+	}
+	groups.push_back(staged.size());
+	
+	vector<char> committed(staged.size(), false);
+	
+	//Blocks move between the chunks of a region, so a region is committed all or nothing
+	auto write_start = tick_count::now();
+	parallel_for( blocked_range<int>(0, groups.size() - 1),
+		[&]( blocked_range<int> rng )
+	{
+		vector<GameMap::ChunkCommit> chunks;
+		for(auto g = rng.begin(); g != rng.end(); ++g)
+		{
+			chunks.clear();
+			for(int i=groups[g]; i<groups[g+1]; ++i)
+			{
+				auto const& s = staged[i];
+				GameMap::ChunkCommit c = { s.id, s.version, s.t, s.blocks, s.changes.data(), (int)s.changes.size() };
+				chunks.push_back(c);
+			}
+			
+			//Writes to other cells since the batch read the region are merged, only a cell written by both conflicts
+			if(game_map->commit_chunks(&chunks[0], chunks.size()))
+			{
+				for(int i=groups[g]; i<groups[g+1]; ++i)
+					committed[i] = true;
+				continue;
+			}
+			
+			//Something else wrote one of the chunks while the batch ran, recompute the region from the new versions
+			commit_conflicts.fetch_and_increment();
+			for(int i=groups[g]; i<groups[g+1]; ++i)
+			{
+				auto const& s = staged[i];
+				DEBUG_PRINTF("Physics commit conflict on chunk %d,%d,%d\n", s.id.x, s.id.y, s.id.z);
+				for(int j=0; j<s.writes.size(); ++j)
+					intake.push(s.writes[j]);
+				mark_chunk(s.id);
+			}
+		}
+	});
+	add_phase_time(Phase_WriteBack, write_start);
+	
+	//Surfaces are invalidated once the whole batch is in the map
+	auto invalidate_start = tick_count::now();
+	for(int i=0; i<staged.size(); ++i)
+	{
+		if(committed[i])
+			game_map->invalidate_surfaces(staged[i].id);
+	}
+	add_phase_time(Phase_Invalidate, invalidate_start);
+	
+	for(int i=0; i<staged.size(); ++i)
+		scalable_free(staged[i].blocks);
+	staged.clear();
+}
+
+void Physics::add_phase_time(int phase, tick_count start)
+{
+	phase_usec[phase].fetch_and_add((uint64_t)((tick_count::now() - start).seconds() * 1e6));
+}
+
+void Physics::start_recording(string const& path, ChunkID const& lo, ChunkID const& hi)
+{
+	spin_mutex::scoped_lock L(record_lock);
+	record_start = true;
+	record_stop = false;
+	record_path = path;
+	record_lo = lo;
+	record_hi = hi;
+}
+
+void Physics::stop_recording()
+{
+	spin_mutex::scoped_lock L(record_lock);
+	record_stop = true;
+}
+
+//Starts or finishes a recording before the batch at base tick t, no batch may be running
+void Physics::apply_recording_requests(uint64_t t)
+{
+	spin_mutex::scoped_lock L(record_lock);
+	
+	if(record_stop && recording != NULL)
+	{
+		recording->end_tick = t;
+		if(recording->save(record_path))
+		{
+			printf("Wrote physics recording %s, %d chunks, %d writes over %ld ticks\n",
+				record_path.c_str(), (int)recording->chunk_ids.size(), (int)recording->events.size(),
+				recording->end_tick - recording->start_tick);
+		}
+		delete recording;
+		recording = NULL;
+	}
+	record_stop = false;
+	
+	if(!record_start)
+		return;
+	record_start = false;
+	
+	if(recording != NULL)
+		delete recording;
+	recording = new PhysicsRecording();
+	recording->start_tick = t;
+	recording->lo = record_lo;
+	recording->hi = record_hi;
+	
+	//Snapshot the box
+	for(int y=record_lo.y; y<record_hi.y; ++y)
+	for(int z=record_lo.z; z<record_hi.z; ++z)
+	for(int x=record_lo.x; x<record_hi.x; ++x)
+	{
+		recording->chunk_ids.push_back(ChunkID(x, y, z));
+	}
+	recording->blocks.resize(recording->chunk_ids.size() * CHUNK_SIZE);
+	parallel_for( blocked_range<int>(0, recording->chunk_ids.size(), 16),
+		[&]( blocked_range<int> rng )
+	{
+		for(auto i = rng.begin(); i != rng.end(); ++i)
+			game_map->get_chunk(recording->chunk_ids[i], recording->chunk(i));
+	});
+	
+	//Physics state in the box, active cells are widened to whole chunks
+	{
+		queuing_rw_mutex::scoped_lock CL(chunk_set_lock, true);
+		for(auto iter = active_chunks.begin(); iter != active_chunks.end(); ++iter)
+		{
+			if(recording->contains(iter->first))
+				recording->active.push_back(iter->first);
+		}
+	}
+	
+	//Writes held back for a later batch are replayed with the first batch
+	for(auto iter = pending_blocks.begin(); iter != pending_blocks.end(); ++iter)
+	{
+		if(!recording->contains(iter->first))
+			continue;
+		recording->events.insert(recording->events.end(), iter->second.begin(), iter->second.end());
+	}
+	recording->add_events(t, recording->events.size());
+	
+	printf("Recording physics in chunks %d,%d,%d to %d,%d,%d\n",
+		record_lo.x, record_lo.y, record_lo.z,
+		record_hi.x, record_hi.y, record_hi.z);
+}
+
+void Physics::print_stats()
+{
+	printf("Physics: %ld batches run, %ld merged, %ld stalls, %d commit conflicts\n",
+		batches_run, batches_merged, stalls, (int)commit_conflicts);
+	printf("  Last batch %.1f ms, slowest %.1f ms, last commit %.1f ms, %s\n",
+		last_batch_time * 1e3, max_batch_time * 1e3, last_commit_time * 1e3,
+		batch_state == Batch_Running ? "running" : batch_state == Batch_Ready ? "ready" : "idle");
+	printf("  Level of detail: %ld regions run, %ld skipped, %ld catch up steps, %d chunks behind\n",
+		regions_run, regions_deferred, catchup_steps, (int)deferred_ticks.size());
+	printf("  Thread time: decompress %.3f s, step %.3f s, write back %.3f s, surface invalidation %.3f s\n",
+		phase_time(Phase_Decompress), phase_time(Phase_Step), phase_time(Phase_WriteBack), phase_time(Phase_Invalidate));
+}
+
 //The main update loop
 void Physics::update_main()
 {
 	if(base_tick == 0)
 		return;
 		
-	chunk_set_t chunks;
-	block_list_t blocks;
+	//Pick up the writes which arrived since the last batch
+	block_list_t arrived;
+	intake.drain(arrived);
+	if(recording != NULL)
+	{
+		int count = 0;
+		for(int i=0; i<arrived.size(); ++i)
+		{
+			if(!recording->contains(arrived[i].x, arrived[i].y, arrived[i].z))
+				continue;
+			recording->events.push_back(arrived[i]);
+			++count;
+		}
+		recording->add_events(base_tick, count);
+	}
+	
+	if(arrived.size() > 0)
+	{
+		chunk_list_t written;
+		{
+			spin_mutex::scoped_lock AL(active_cells_lock);
+			for(int i=0; i<arrived.size(); ++i)
+			{
+				auto const& rec = arrived[i];
+				ChunkID c(rec.x/CHUNK_X, rec.y/CHUNK_Y, rec.z/CHUNK_Z);
+				if(rec.t > 0)
+					pending_blocks[c].push_back(rec);
+				written.push_back(c);
+				
+				//The written cell and its neighbors need to be evaluated
+				for(int k=0; k<7; ++k)
+				{
+					activate_cell(
+						rec.x + CELL_NEIGHBORS[k][0],
+						rec.y + CELL_NEIGHBORS[k][1],
+						rec.z + CELL_NEIGHBORS[k][2]);
+				}
+			}
+		}
+		
+		//Deduplicate the written chunks and their neighborhoods before touching the shared set
+		sort(written.begin(), written.end());
+		written.erase(unique(written.begin(), written.end()), written.end());
+		
+		chunk_list_t marks;
+		for(int i=0; i<written.size(); ++i)
+		{
+			auto c = written[i];
+			for(int dx=-1; dx<=1; ++dx)
+			for(int dy=-1; dy<=1; ++dy)
+			for(int dz=-1; dz<=1; ++dz)
+			{
+				marks.push_back(ChunkID(c.x+dx, c.y+dy, c.z+dz));
+			}
+		}
+		sort(marks.begin(), marks.end());
+		marks.erase(unique(marks.begin(), marks.end()), marks.end());
+		
+		DEBUG_PRINTF("Picked up %d writes to %d chunks, marking %d\n", (int)arrived.size(), (int)written.size(), (int)marks.size());
+		
+		queuing_rw_mutex::scoped_lock L(chunk_set_lock, false);
+		for(int i=0; i<marks.size(); ++i)
+			active_chunks.insert(make_pair(marks[i], true));
+	}
+	
+	chunk_set_t chunk_set;
+	block_map_t blocks;
+	cell_map_t cells;
 	{
 		queuing_rw_mutex::scoped_lock L(chunk_set_lock, true);
-		chunks.swap(active_chunks);
+		spin_mutex::scoped_lock AL(active_cells_lock);
+		chunk_set.swap(active_chunks);
 		blocks.swap(pending_blocks);
+		cells.swap(active_cells);
 	}
 	
-	if(chunks.size() == 0)
+	if(chunk_set.size() == 0)
 		return;
 	
 	DEBUG_PRINTF("Updating physics, base_tick = %ld\n", base_tick);
@@ -105,34 +534,71 @@ void Physics::update_main()
 	//An update task
 	struct PhysicsUpdateTask
 	{
-		Physics*		physics;
-		chunk_list_t	regions;
-		block_list_t	region_blocks;
+		Physics*			physics;
+		cell_map_t const*	cells;
+		chunk_list_t		regions;
+		block_list_t		region_blocks;
+		uint64_t			base;
+		int					steps;
 		
 		void operator()()
 		{
 			//Sort regions for fast look up
 			sort(regions.begin(), regions.end());
 			
-			//Sort blocks by time of write
-			sort(region_blocks.begin(), region_blocks.end());
+			//Sort blocks by time of write, keeping the arrival order of simultaneous writes
+			stable_sort(region_blocks.begin(), region_blocks.end());
 			
-			physics->update_region(regions, region_blocks);
+			physics->update_region(regions, region_blocks, *cells, base, steps);
 		}
 	};
 	
+	//Flatten the active set so regions can be found without touching the concurrent map
+	chunk_list_t chunks;
+	chunks.reserve(chunk_set.size());
+	for(auto iter = chunk_set.begin(); iter != chunk_set.end(); ++iter)
+		chunks.push_back(iter->first);
+	sort(chunks.begin(), chunks.end());
+	
+	vector<bool> visited(chunks.size(), false);
+	auto find_chunk = [&](ChunkID const& c) -> int
+	{
+		auto pos = lower_bound(chunks.begin(), chunks.end(), c);
+		if(pos == chunks.end() || !(*pos == c))
+			return -1;
+		return pos - chunks.begin();
+	};
+	
+	//Writes which can not be applied in this batch
+	block_list_t residual;
+	
+	//Chunks of the regions skipped in this batch
+	chunk_list_t skipped;
+	
+	chunk_list_t lod_observers;
+	bool lod;
+	{
+		spin_mutex::scoped_lock L(observers_lock);
+		lod_observers = observers;
+		lod = lod_enabled;
+	}
+	
 	//Partition the active chunk set into connected components
 	task_group update_tasks;
-	while(chunks.begin() != chunks.end())
+	for(int s=0; s<chunks.size(); ++s)
 	{
+		if(visited[s])
+			continue;
+	
 		DEBUG_PRINTF("Region: ");
 		
 		PhysicsUpdateTask task;
 		task.physics = this;
+		task.cells = &cells;
 
 		//Construct region via breadth first search
-		task.regions.push_back( chunks.begin()->first );
-		chunks.unsafe_erase(chunks.begin());
+		task.regions.push_back(chunks[s]);
+		visited[s] = true;
 	
 		int idx = 0;
 			
@@ -146,54 +612,125 @@ void Physics::update_main()
 			for(int dy=-1; dy<=1; ++dy)
 			for(int dz=-1; dz<=1; ++dz)
 			{
-				ChunkID n(c.x+dx, c.y+dy, c.z+dz);
-			
-				auto iter = chunks.find(n);
-				if(iter == chunks.end())
+				int n = find_chunk(ChunkID(c.x+dx, c.y+dy, c.z+dz));
+				if(n < 0 || visited[n])
 					continue;
 				
-				chunks.unsafe_erase(iter);
-				task.regions.push_back(n);
+				visited[n] = true;
+				task.regions.push_back(chunks[n]);
 			}
 		}
 		
-		//Add all blocks to this region
-		for(int i=0; i<blocks.size(); ++i)
+		//Regions which were skipped resume from their oldest chunk
+		uint64_t region_base = base_tick;
+		for(int i=0; i<task.regions.size(); ++i)
 		{
-			DEBUG_PRINTF("Processing pending write: %d,%d,%d; t=%ld\n", blocks[i].x, blocks[i].y, blocks[i].z, blocks[i].t);
+			auto iter = deferred_ticks.find(task.regions[i]);
+			if(iter != deferred_ticks.end())
+				region_base = min(region_base, iter->second);
+		}
 		
-			if(blocks[i].t >= base_tick + 16)
+		int distance = lod ? observer_distance(task.regions, lod_observers) : 0;
+		if(distance > full_radius &&
+			(distance > reduced_radius || base_tick + 16 - region_base < 16 * reduced_interval))
+		{
+			DEBUG_PRINTF("Skipping region of %d chunks, distance %d\n", (int)task.regions.size(), distance);
+			
+			//Keep the region awake with its writes pending until it runs
+			++regions_deferred;
+			for(int i=0; i<task.regions.size(); ++i)
 			{
-				DEBUG_PRINTF("Got a packet out of order....\n");
-				continue;
+				auto c = task.regions[i];
+				deferred_ticks.insert(make_pair(c, base_tick));
+				skipped.push_back(c);
+				
+				auto iter = blocks.find(c);
+				if(iter == blocks.end())
+					continue;
+				residual.insert(residual.end(), iter->second.begin(), iter->second.end());
+				blocks.erase(iter);
 			}
+			continue;
+		}
+		
+		//Catch up on the skipped batches, older ones are dropped
+		task.steps = min(base_tick + 16 - region_base, (uint64_t)(16 * max_catchup));
+		task.base = base_tick + 16 - task.steps;
+		catchup_steps += task.steps - 16;
+		++regions_run;
+		for(int i=0; i<task.regions.size(); ++i)
+			deferred_ticks.erase(task.regions[i]);
 		
-			ChunkID c(
-				blocks[i].x/CHUNK_X,
-				blocks[i].y/CHUNK_Y,
-				blocks[i].z/CHUNK_Z);
+		//Hand the region the writes to its chunks
+		for(int i=0; i<task.regions.size(); ++i)
+		{
+			auto iter = blocks.find(task.regions[i]);
+			if(iter == blocks.end())
+				continue;
 			
-			//Check if chunk for this block write was removed.  if so, write must be in this region
-			if(chunks.find(c) == chunks.end())
+			auto& list = iter->second;
+			for(int j=0; j<list.size(); ++j)
 			{
-				task.region_blocks.push_back(blocks[i]);
+				DEBUG_PRINTF("Processing pending write: %d,%d,%d; t=%ld\n", list[j].x, list[j].y, list[j].z, list[j].t);
 				
-				//Remove block from the pending write queue
-				blocks[i] = blocks[blocks.size()-1];
-				blocks.pop_back();
-				--i;
+				if(list[j].t >= base_tick + 16)
+				{
+					DEBUG_PRINTF("Got a packet out of order....\n");
+					residual.push_back(list[j]);
+				}
+				else
+				{
+					task.region_blocks.push_back(list[j]);
+				}
 			}
+			blocks.erase(iter);
 		}
 		
 		//Run the task
 		update_tasks.run(task);
 	}
 	
-	//Put all the unhandled writes back in the work queue
-	for(int i=0; i<blocks.size(); ++i)
+	//Writes to chunks which were not marked
+	for(auto iter = blocks.begin(); iter != blocks.end(); ++iter)
+		residual.insert(residual.end(), iter->second.begin(), iter->second.end());
+	
+	//Put all the unhandled writes back in the work queue, their cells get activated once they apply
+	if(residual.size() > 0)
 	{
-		DEBUG_PRINTF("Got a residual block: %d,%d,%d\n", blocks[i].x, blocks[i].y, blocks[i].z);
-		set_block(blocks[i].b, blocks[i].t, blocks[i].x, blocks[i].y, blocks[i].z);
+		queuing_rw_mutex::scoped_lock L(chunk_set_lock, false);
+		for(int i=0; i<residual.size(); ++i)
+		{
+			auto const& rec = residual[i];
+			DEBUG_PRINTF("Got a residual block: %d,%d,%d\n", rec.x, rec.y, rec.z);
+			
+			ChunkID c(rec.x/CHUNK_X, rec.y/CHUNK_Y, rec.z/CHUNK_Z);
+			active_chunks.insert(make_pair(c, true));
+			pending_blocks[c].push_back(rec);
+		}
+	}
+	
+	//Skipped regions stay in the active set with their active cells
+	if(skipped.size() > 0)
+	{
+		queuing_rw_mutex::scoped_lock L(chunk_set_lock, false);
+		spin_mutex::scoped_lock AL(active_cells_lock);
+		for(int i=0; i<skipped.size(); ++i)
+		{
+			auto c = skipped[i];
+			active_chunks.insert(make_pair(c, true));
+			
+			auto iter = cells.find(c);
+			if(iter == cells.end())
+				continue;
+			
+			auto& list = active_cells[c];
+			if(list.size() == 1 && list[0] == ALL_CELLS)
+				continue;
+			if(iter->second.size() == 1 && iter->second[0] == ALL_CELLS)
+				list = iter->second;
+			else
+				list.insert(list.end(), iter->second.begin(), iter->second.end());
+		}
 	}
 	
 	//Wait for all pending physics tasks to complete
@@ -213,20 +750,8 @@ Block Physics::update_block(
 	Block front, 	//-z
 	Block back)		//+z
 {
-	//FIXME: Physics implementation goes here
-	
-	if( center.type() == BlockType_Air &&
-		top.type() == BlockType_Sand )
-	{
-		return Block( BlockType_Sand );
-	}
-	else if( center.type() == BlockType_Sand  &&
-		bottom.type() == BlockType_Air )
-	{
-		return Block( BlockType_Air );
-	}
-	
-	return center;
+	Block neighbors[RuleDir_Count] = { left, right, bottom, top, front, back };
+	return RULE_TABLE.apply(center, neighbors);
 }
 
 
@@ -283,221 +808,732 @@ bool Physics::update_chunk(
 	return changed;
 }
 
-//Updates a list of chunks
-void Physics::update_region(chunk_list_t const& marked_chunks, block_list_t const& blocks)
+//Tile layout, a chunk padded by one cell on each side
+static const int TILE_STRIDE_X	= CHUNK_X + 2;
+static const int TILE_STRIDE_XZ	= TILE_STRIDE_X * (CHUNK_Z + 2);
+static const int TILE_SIZE		= TILE_STRIDE_XZ * (CHUNK_Y + 2);
+static const int TILE_ORIGIN	= 1 + TILE_STRIDE_X + TILE_STRIDE_XZ;
+
+//Offset of a cell within a tile
+static inline int tile_offset(int x, int y, int z)
 {
-	uint32_t
-		x_min = (1<<30), y_min = (1<<30), z_min = (1<<30),
-		x_max = 0, y_max = 0, z_max = 0;
+	return TILE_ORIGIN + x + z * TILE_STRIDE_X + y * TILE_STRIDE_XZ;
+}
+
+//Copies the face of a neighboring chunk into the halo of a tile.  dst points at cell (0,0,0) of the tile,
+//src at cell (0,0,0) of the neighbor in direction dir.
+static void copy_face(Block* dst, Block const* src, int stride_x, int stride_xz, int dir)
+{
+	bool up = dir & 1;
+	Block const* s;
+	Block* d;
+	int s_du, s_dv, d_du, d_dv;
+	
+	switch(dir >> 1)
+	{
+		//x faces, u = y, v = z
+		case 0:
+			s = src + (up ? 0 : CHUNK_X-1);
+			d = dst + (up ? CHUNK_X : -1);
+			s_du = stride_xz;		s_dv = stride_x;
+			d_du = TILE_STRIDE_XZ;	d_dv = TILE_STRIDE_X;
+		break;
+		
+		//y faces, u = z, v = x
+		case 1:
+			s = src + (up ? 0 : CHUNK_Y-1) * stride_xz;
+			d = dst + (up ? CHUNK_Y : -1) * TILE_STRIDE_XZ;
+			s_du = stride_x;		s_dv = 1;
+			d_du = TILE_STRIDE_X;	d_dv = 1;
+		break;
 		
-	//Construct the offset chunk list
-	chunk_set_nl_t offset_chunk_set;
+		//z faces, u = y, v = x
+		default:
+			s = src + (up ? 0 : CHUNK_Z-1) * stride_x;
+			d = dst + (up ? CHUNK_Z : -1) * TILE_STRIDE_X;
+			s_du = stride_xz;		s_dv = 1;
+			d_du = TILE_STRIDE_XZ;	d_dv = 1;
+		break;
+	}
 	
+	for(int u=0; u<16; ++u)
+	for(int v=0; v<16; ++v)
+	{
+		d[u * d_du + v * d_dv] = s[u * s_du + v * s_dv];
+	}
+}
+
+Block* Physics::RegionTiles::tile(int i) const
+{
+	return blocks + i * TILE_SIZE;
+}
+
+//Index of a marked chunk, or -1
+int Physics::RegionTiles::find(ChunkID const& c) const
+{
+	auto pos = lower_bound(chunks->begin(), chunks->end(), c);
+	if(pos == chunks->end() || !(*pos == c))
+		return -1;
+	return pos - chunks->begin();
+}
+
+//Offset of a pending write in the tile buffer, or -1 if it is outside the region
+int Physics::RegionTiles::block_offset(BlockRecord const& rec) const
+{
+	int i = find(ChunkID(rec.x / CHUNK_X, rec.y / CHUNK_Y, rec.z / CHUNK_Z));
+	if(i < 0)
+		return -1;
+	return i * TILE_SIZE + tile_offset(rec.x % CHUNK_X, rec.y % CHUNK_Y, rec.z % CHUNK_Z);
+}
+
+//World position of a cell in the tile buffer
+Physics::CellPos Physics::RegionTiles::position(int offset) const
+{
+	auto c = (*chunks)[offset / TILE_SIZE];
+	int l = offset % TILE_SIZE;
+	
+	CellPos p;
+	p.x = c.x * CHUNK_X + l % TILE_STRIDE_X - 1;
+	p.y = c.y * CHUNK_Y + l / TILE_STRIDE_XZ - 1;
+	p.z = c.z * CHUNK_Z + (l % TILE_STRIDE_XZ) / TILE_STRIDE_X - 1;
+	return p;
+}
+
+//Updates a list of chunks
+void Physics::update_region(chunk_list_t const& marked_chunks, block_list_t const& blocks, cell_map_t const& cells, uint64_t base, int steps)
+{
+	int n = marked_chunks.size();
+
 	DEBUG_PRINTF("Updating region: ");
+	for(int i=0; i<n; ++i)
+	{
+		DEBUG_PRINTF("(%d,%d,%d), ", marked_chunks[i].x, marked_chunks[i].y, marked_chunks[i].z);
+	}
+	DEBUG_PRINTF("\n");
+	
+	RegionTiles tiles;
+	tiles.chunks = &marked_chunks;
+	tiles.blocks = (Block*)scalable_malloc(n * TILE_SIZE * sizeof(Block));
+	tiles.versions.resize(n);
+	
+	//Link the tiles, faces without a marked neighbor are read once and stay constant
+	chunk_set_nl_t face_chunk_set;
+	tiles.neighbors.resize(n * RuleDir_Count);
+	for(int i=0; i<n; ++i)
+	{
+		auto c = marked_chunks[i];
+		for(int d=0; d<RuleDir_Count; ++d)
+		{
+			ChunkID nc(
+				c.x + CELL_NEIGHBORS[d+1][0],
+				c.y + CELL_NEIGHBORS[d+1][1],
+				c.z + CELL_NEIGHBORS[d+1][2]);
+				
+			int j = tiles.find(nc);
+			tiles.neighbors[i * RuleDir_Count + d] = j;
+			if(j < 0)
+				face_chunk_set.insert(nc);
+		}
+	}
+	chunk_list_t face_chunks(face_chunk_set.begin(), face_chunk_set.end());
+	
+	DEBUG_PRINTF("tiles = %d, constant faces from %d chunks\n", n, (int)face_chunks.size());
+	
+	//Read the marked chunks into their tiles and the face chunks into scratch space.  A copy of each tile as
+	//read is kept, the cells which differ from it are what the batch changed.
+	auto read_start = tick_count::now();
+	auto face_blocks = (Block*)scalable_malloc(face_chunks.size() * CHUNK_SIZE * sizeof(Block));
+	auto read_blocks = (Block*)scalable_malloc(n * TILE_SIZE * sizeof(Block));
+	parallel_for( blocked_range<int>(0, n + face_chunks.size(), 16),
+		[&](blocked_range<int> rng)
+	{
+		for(auto i = rng.begin(); i != rng.end(); ++i)
+		{
+			if(i < n)
+			{
+				tiles.versions[i] = game_map->get_chunk(marked_chunks[i], tiles.tile(i) + TILE_ORIGIN, TILE_STRIDE_X, TILE_STRIDE_XZ);
+				memcpy(read_blocks + i * TILE_SIZE, tiles.tile(i), TILE_SIZE * sizeof(Block));
+			}
+			else
+				game_map->get_chunk(face_chunks[i - n], face_blocks + (i - n) * CHUNK_SIZE);
+		}
+	});
+	add_phase_time(Phase_Decompress, read_start);
 	
-	for(int i=0; i<marked_chunks.size(); ++i)
+	//Fill in the halos
+	parallel_for( blocked_range<int>(0, n, 16),
+		[&](blocked_range<int> rng)
 	{
-		auto c = marked_chunks[i];			
+		for(auto i = rng.begin(); i != rng.end(); ++i)
+		{
+			auto c = marked_chunks[i];
+			for(int d=0; d<RuleDir_Count; ++d)
+			{
+				int j = tiles.neighbors[i * RuleDir_Count + d];
+				if(j >= 0)
+				{
+					copy_face(tiles.tile(i) + TILE_ORIGIN, tiles.tile(j) + TILE_ORIGIN, TILE_STRIDE_X, TILE_STRIDE_XZ, d);
+					continue;
+				}
+				
+				ChunkID nc(
+					c.x + CELL_NEIGHBORS[d+1][0],
+					c.y + CELL_NEIGHBORS[d+1][1],
+					c.z + CELL_NEIGHBORS[d+1][2]);
+				int k = lower_bound(face_chunks.begin(), face_chunks.end(), nc) - face_chunks.begin();
+				copy_face(tiles.tile(i) + TILE_ORIGIN, face_blocks + k * CHUNK_SIZE, CHUNK_X, CHUNK_X * CHUNK_Z, d);
+			}
+		}
+	});
+	scalable_free(face_blocks);
 	
-		DEBUG_PRINTF("(%d,%d,%d), ", c.x, c.y, c.z);
+	auto update_times = (int16_t*)scalable_malloc(n * sizeof(int16_t));
+	memset(update_times, -1, n * sizeof(int16_t));
 	
-		x_min = min(x_min, c.x - 1);
-		x_max = max(x_max, c.x + 2);
-		y_min = min(y_min, c.y - 1);
-		y_max = max(y_max, c.y + 2);
-		z_min = min(z_min, c.z - 1);
-		z_max = max(z_max, c.z + 2);
+	//Gather the active cells, falling back to a dense update once the frontier is too large
+	int dense_limit = dense_fraction * n * CHUNK_SIZE;
+	bool dense = false;
+	offset_list_t frontier;
+	for(int i=0; i<n && !dense; ++i)
+	{
+		auto iter = cells.find(marked_chunks[i]);
+		if(iter == cells.end())
+			continue;
 		
-		for(int dx=-1; dx<=1; ++dx)
-		for(int dy=-1; dy<=1; ++dy)
-		for(int dz=-1; dz<=1; ++dz)
+		int base = i * TILE_SIZE;
+		auto const& list = iter->second;
+		for(int j=0; j<list.size(); ++j)
 		{
-			offset_chunk_set.insert( ChunkID(
-				c.x + dx,
-				c.y + dy,
-				c.z + dz) );
+			if(list[j] == ALL_CELLS)
+			{
+				if(frontier.size() + CHUNK_SIZE > dense_limit)
+				{
+					dense = true;
+					break;
+				}
+				
+				for(int k=0; k<CHUNK_SIZE; ++k)
+				{
+					frontier.push_back(base + tile_offset(
+						k & (CHUNK_X-1),
+						k >> (CHUNK_X_S + CHUNK_Z_S),
+						(k >> CHUNK_X_S) & (CHUNK_Z-1)));
+				}
+
+				//The layers of the neighboring tiles which touch the chunk read its boundary, so a pair
+				//of cells across the face is always stepped together
+				for(int d=0; d<RuleDir_Count; ++d)
+				{
+					int nb = tiles.neighbors[i * RuleDir_Count + d];
+					if(nb < 0)
+						continue;
+
+					int dx = CELL_NEIGHBORS[d+1][0],
+						dy = CELL_NEIGHBORS[d+1][1],
+						dz = CELL_NEIGHBORS[d+1][2],
+						x0 = dx < 0 ? CHUNK_X-1 : 0, x1 = dx == 0 ? CHUNK_X : x0+1,
+						y0 = dy < 0 ? CHUNK_Y-1 : 0, y1 = dy == 0 ? CHUNK_Y : y0+1,
+						z0 = dz < 0 ? CHUNK_Z-1 : 0, z1 = dz == 0 ? CHUNK_Z : z0+1;
+					for(int y=y0; y<y1; ++y)
+					for(int z=z0; z<z1; ++z)
+					for(int x=x0; x<x1; ++x)
+						frontier.push_back(nb * TILE_SIZE + tile_offset(x, y, z));
+				}
+				continue;
+			}
+			
+			int k = list[j];
+			frontier.push_back(base + tile_offset(
+				k & (CHUNK_X-1),
+				k >> (CHUNK_X_S + CHUNK_Z_S),
+				(k >> CHUNK_X_S) & (CHUNK_Z-1)));
 		}
 	}
-	DEBUG_PRINTF("\n");	
+	if(frontier.size() > dense_limit)
+		dense = true;
 	
-	//Unpack the update chunk list
-	vector<ChunkID, scalable_allocator<ChunkID> > 
-		chunks(offset_chunk_set.begin(), offset_chunk_set.end());
+	DEBUG_PRINTF("Region frontier: %d cells, %s update\n", (int)frontier.size(),
+		!dense ? "sparse" : bitplane_kernel ? "bitplane" : "dense");
 	
-	DEBUG_PRINTF("chunks.size = %d, bounds = (%d-%d), (%d-%d), (%d-%d)\n", (int)chunks.size(),
-		x_min, x_max, y_min, y_max, z_min, z_max);
+	//Cells next to the frontier which lie outside the marked chunks, carried to the next batch
+	cell_pos_list_t carried;
 	
-	//Compute strides, need to pad by 1 in y dimension to avoid going oob
-	int stride_x = (x_max - x_min) * CHUNK_X,
-		stride_xz = stride_x * (z_max - z_min) * CHUNK_Z,
-		size = stride_x * stride_xz * ((y_max - y_min) * CHUNK_Y + 2);
+	auto step_start = tick_count::now();
+	if(!dense)
+		step_frontier(tiles, blocks, base, steps, update_times, frontier, carried);
+	else if(bitplane_kernel)
+		step_bitplane(tiles, blocks, base, steps, update_times);
+	else
+		step_dense(tiles, blocks, base, steps, update_times);
+	add_phase_time(Phase_Step, step_start);
 	
-	//Allocate buffers
-	auto front_buffer = (Block*)scalable_malloc(size * sizeof(Block));
-	auto back_buffer = (Block*)scalable_malloc(size * sizeof(Block));
-	auto update_times = (int8_t*)scalable_malloc(marked_chunks.size());
-	memset(update_times, -1, marked_chunks.size());
+	DEBUG_PRINTF("Staging result of physics computation\n");
 	
-	//Read chunks into memory
-	parallel_for( blocked_range<int>(0, chunks.size(), 128),
-		[&](blocked_range<int> rng)
+	//Writes which landed in each changed chunk
+	auto stage_start = tick_count::now();
+	vector<block_list_t> tile_writes(n);
+	for(int i=0; i<blocks.size(); ++i)
+	{
+		int offset = tiles.block_offset(blocks[i]);
+		if(offset >= 0 && update_times[offset / TILE_SIZE] >= 0)
+			tile_writes[offset / TILE_SIZE].push_back(blocks[i]);
+	}
+	
+	//Copy out the chunks which changed, they are written to the map when the batch commits
+	parallel_for( blocked_range<int>(0, n, 128),
+		[&]( blocked_range<int> rng )
 	{
 		for(auto i = rng.begin(); i != rng.end(); ++i)
 		{
-			auto c = chunks[i];
+			if(update_times[i] < 0)
+				continue;
 		
-			int ox = c.x - x_min,
-				oy = c.y - y_min,
-				oz = c.z - z_min;
+			auto c = marked_chunks[i];
+			
+			StagedChunk s;
+			s.region = marked_chunks[0];
+			s.id = c;
+			s.version = tiles.versions[i];
+			s.t = base + update_times[i];
+			s.blocks = (Block*)scalable_malloc(CHUNK_SIZE * sizeof(Block));
+			s.writes.swap(tile_writes[i]);
+			
+			auto src = tiles.tile(i) + TILE_ORIGIN;
+			for(int y=0; y<CHUNK_Y; ++y)
+			for(int z=0; z<CHUNK_Z; ++z)
+			{
+				memcpy(
+					s.blocks + y * CHUNK_X * CHUNK_Z + z * CHUNK_X,
+					src + y * TILE_STRIDE_XZ + z * TILE_STRIDE_X,
+					CHUNK_X * sizeof(Block));
+			}
+			
+			//The cells the batch changed, so the commit can be merged with writes to the other cells
+			auto prev = read_blocks + i * TILE_SIZE + TILE_ORIGIN;
+			for(int k=0; k<CHUNK_SIZE; ++k)
+			{
+				int o = tile_offset(k & (CHUNK_X-1), k >> (CHUNK_X_S + CHUNK_Z_S), (k >> CHUNK_X_S) & (CHUNK_Z-1)) - TILE_ORIGIN;
+				if(s.blocks[k] != prev[o])
+					s.changes.push_back((GameMap::CellChange){ (uint16_t)k, prev[o] });
+			}
 		
-			int offset =  ox * CHUNK_X + 
-						  oz * CHUNK_Z * stride_x + 
-						 (oy * CHUNK_Y + 1) * stride_xz;
-
-
-			DEBUG_PRINTF("Reading chunk: %d,%d,%d; %d,%d,%d; %d\n",
+			DEBUG_PRINTF("Staging chunk: %d,%d,%d, t=%ld\n",
 				c.x, c.y, c.z,
-				ox, oy, oz,
-				offset);
-		
-			game_map->get_chunk(c, front_buffer + offset, stride_x, stride_xz);
+				s.t);
+			
+			{
+				spin_mutex::scoped_lock L(staged_lock);
+				staged.push_back(s);
+			}
+
+			if(dense && update_times[i] == steps - 1)
+			{
+				DEBUG_PRINTF("Writing chunk: %d,%d,%d\n", c.x, c.y, c.z);
+				mark_chunk(c);
+			}
 		}
 	});
+	add_phase_time(Phase_WriteBack, stage_start);
+	
+	//Wake the chunks around the remaining frontier, the rest of the region goes to sleep
+	if(carried.size() > 0)
+	{
+		sort(carried.begin(), carried.end());
+		carried.erase(unique(carried.begin(), carried.end()), carried.end());
+		
+		chunk_set_nl_t woken;
+		queuing_rw_mutex::scoped_lock L(chunk_set_lock, false);
+		spin_mutex::scoped_lock AL(active_cells_lock);
+		for(int i=0; i<carried.size(); ++i)
+		{
+			auto const& p = carried[i];
+			activate_cell(p.x, p.y, p.z);
+			woken.insert(ChunkID(p.x / CHUNK_X, p.y / CHUNK_Y, p.z / CHUNK_Z));
+		}
+		
+		for(auto iter = woken.begin(); iter != woken.end(); ++iter)
+		{
+			for(int dx=-1; dx<=1; ++dx)
+			for(int dy=-1; dy<=1; ++dy)
+			for(int dz=-1; dz<=1; ++dz)
+			{
+				active_chunks.insert(make_pair(ChunkID(iter->x+dx, iter->y+dy, iter->z+dz), true));
+			}
+		}
+	}
+	
+	DEBUG_PRINTF("Write complete\n");
 	
+	scalable_free(update_times);
+	scalable_free(read_blocks);
+	scalable_free(tiles.blocks);
+}
+
+//Steps every cell of the marked chunks with update_chunk
+void Physics::step_dense(
+	RegionTiles& tiles,
+	block_list_t const& blocks,
+	uint64_t base,
+	int steps,
+	int16_t* update_times)
+{
+	int n = tiles.chunks->size();
+	auto front_buffer = tiles.blocks;
+
+	//Constant halos are never exchanged, so both buffers start with the same contents
+	auto back_buffer = (Block*)scalable_malloc(n * TILE_SIZE * sizeof(Block));
+	memcpy(back_buffer, front_buffer, n * TILE_SIZE * sizeof(Block));
+
 	//The current block index in the pending write queue
 	int b_idx = 0;
-	
+
 	//Update the chunks (x16 to reduce overhead)
-	for(int t=0; t<16; ++t)
+	for(int t=0; t<steps; ++t)
 	{
 		DEBUG_PRINTF("Update, t = %d\n", t);
 		
 		//Compute physics for this region
-		parallel_for( blocked_range<int>(0, marked_chunks.size(), 64),
+		parallel_for( blocked_range<int>(0, n, 16),
 			[&]( blocked_range<int> rng )
 		{
 			for(auto i = rng.begin(); i != rng.end(); ++i)
 			{
-				auto c = marked_chunks[i];
-		
-				int ox = c.x - x_min,
-					oy = c.y - y_min,
-					oz = c.z - z_min;
-					
-				int offset =  ox * CHUNK_X + 
-							  oz * CHUNK_Z * stride_x + 
-							 (oy * CHUNK_Y + 1) * stride_xz;
-				
 				if(update_chunk(
-					back_buffer  + offset,
-					front_buffer + offset,
-					stride_x,
-					stride_xz))
+					back_buffer  + i * TILE_SIZE + TILE_ORIGIN,
+					front_buffer + i * TILE_SIZE + TILE_ORIGIN,
+					TILE_STRIDE_X,
+					TILE_STRIDE_XZ))
 				{
-					//Check if the chunk was in the marked set
-					auto pos = lower_bound(marked_chunks.begin(), marked_chunks.end(), c);
-					if(pos != marked_chunks.end() && *pos == c)
-					{
-						int idx = pos - marked_chunks.begin();
-						update_times[idx] = t;
-					}
+					update_times[i] = t;
 				}
 			}
 		});
 		
 		//Apply pending writes (must be done sequentially)
 		while(b_idx < blocks.size() &&
-			blocks[b_idx].t <= t + base_tick)
+			blocks[b_idx].t <= t + base)
 		{
-			int x = blocks[b_idx].x,
-				y = blocks[b_idx].y,
-				z = blocks[b_idx].z;
-				
-			auto b = blocks[b_idx].b;
-		
-			int cx = x / CHUNK_X,
-				cy = y / CHUNK_Y,
-				cz = z / CHUNK_Z;
-						
-			int ox = cx - x_min,
-				oy = cy - y_min,
-				oz = cz - z_min;
-		
-			int offset = (ox * CHUNK_X + (x % CHUNK_X)) +
-						 (oz * CHUNK_Z + (z % CHUNK_Z)) * stride_x + 
-						 (oy * CHUNK_Y + (y % CHUNK_Y) + 1) * stride_xz;
-		
-			DEBUG_PRINTF("Writing block: %d,%d,%d, b = %d, c=%d,%d,%d\n, o=%d,%d,%d, offs=%d\n", x, y, z, b.int_val, cx, cy, cz, ox, oy, oz, offset);
-			back_buffer[offset] = b;
-			
-			//Check if the chunk was in the marked set and update modify time stamp
-			ChunkID c(cx, cy, cz);
-			auto pos = lower_bound(marked_chunks.begin(), marked_chunks.end(), c);
-			if(pos != marked_chunks.end() && *pos == c)
+			int offset = tiles.block_offset(blocks[b_idx]);
+		
+			DEBUG_PRINTF("Writing block: %d,%d,%d, b = %d, offs=%d\n",
+				blocks[b_idx].x, blocks[b_idx].y, blocks[b_idx].z, blocks[b_idx].b.int_val, offset);
+			if(offset >= 0)
 			{
-				int idx = pos - marked_chunks.begin();
-				update_times[idx] = t;
-			
-				DEBUG_PRINTF("Updated chunk: %d at t=%d", idx, t);
+				back_buffer[offset] = blocks[b_idx].b;
+				update_times[offset / TILE_SIZE] = t;
 			}
 			
 			//Increment pointer
 			++b_idx;
 		}
 		
+		//Exchange halos between neighboring tiles
+		parallel_for( blocked_range<int>(0, n, 16),
+			[&]( blocked_range<int> rng )
+		{
+			for(auto i = rng.begin(); i != rng.end(); ++i)
+			for(int d=0; d<RuleDir_Count; ++d)
+			{
+				int j = tiles.neighbors[i * RuleDir_Count + d];
+				if(j < 0)
+					continue;
+				
+				copy_face(
+					back_buffer + i * TILE_SIZE + TILE_ORIGIN,
+					back_buffer + j * TILE_SIZE + TILE_ORIGIN,
+					TILE_STRIDE_X,
+					TILE_STRIDE_XZ,
+					d);
+			}
+		});
+		
 		auto tmp = back_buffer;
 		back_buffer = front_buffer;
 		front_buffer = tmp;
 	}
 	
-	DEBUG_PRINTF("Writing result of physics computation back to database\n");
+	//After an even number of swaps the result is back in the tile buffer
+	scalable_free(back_buffer);
+}
+
+//Steps the marked chunks as bitplanes, converting back only the cells which changed
+void Physics::step_bitplane(
+	RegionTiles& tiles,
+	block_list_t const& blocks,
+	uint64_t base,
+	int steps,
+	int16_t* update_times)
+{
+	int n = tiles.chunks->size();
+	
+	//Plane index of each marked chunk and its vertical neighbors.  Constant neighbors get planes of their own
+	//built from the halo, placed after the marked chunks.
+	vector<int, scalable_allocator<int> > plane_index(3 * n);
+	int num_planes = n;
+	for(int i=0; i<n; ++i)
+	{
+		int above = tiles.neighbors[i * RuleDir_Count + RuleDir_Top],
+			below = tiles.neighbors[i * RuleDir_Count + RuleDir_Bottom];
+		plane_index[3*i]   = i;
+		plane_index[3*i+1] = above >= 0 ? above : num_planes++;
+		plane_index[3*i+2] = below >= 0 ? below : num_planes++;
+	}
 	
-	//Check for chunks which changed, and update them in the map
-	parallel_for( blocked_range<int>(0, marked_chunks.size(), 128),
+	//Padding planes stay constant in both copies
+	auto front_planes = (ChunkPlanes*)scalable_malloc(num_planes * sizeof(ChunkPlanes));
+	auto back_planes = (ChunkPlanes*)scalable_malloc(num_planes * sizeof(ChunkPlanes));
+	
+	parallel_for( blocked_range<int>(0, n, 16),
 		[&]( blocked_range<int> rng )
 	{
-		DEBUG_PRINTF("Updating range: %d to %d\n", rng.begin(), rng.end());
 		for(auto i = rng.begin(); i != rng.end(); ++i)
 		{
-			if(update_times[i] < 0)
+			auto origin = tiles.tile(i) + TILE_ORIGIN;
+			front_planes[i].load(origin, TILE_STRIDE_X, TILE_STRIDE_XZ);
+			back_planes[i] = front_planes[i];
+			
+			//The halo above becomes the bottom layer of a constant chunk, the halo below its top layer
+			int above = plane_index[3*i+1],
+				below = plane_index[3*i+2];
+			if(above >= n)
+			{
+				front_planes[above].load(origin + CHUNK_Y * TILE_STRIDE_XZ, TILE_STRIDE_X, TILE_STRIDE_XZ, 0, 1);
+				back_planes[above] = front_planes[above];
+			}
+			if(below >= n)
+			{
+				front_planes[below].load(origin - TILE_STRIDE_XZ, TILE_STRIDE_X, TILE_STRIDE_XZ, CHUNK_Y-1, CHUNK_Y);
+				back_planes[below] = front_planes[below];
+			}
+		}
+	});
+	
+	//Cells changed by the rules, which need converting back to blocks
+	vector<uint64_t, scalable_allocator<uint64_t> > touched(PLANE_WORDS * n, 0);
+	
+	//The current block index in the pending write queue
+	int b_idx = 0;
+	
+	for(int t=0; t<steps; ++t)
+	{
+		DEBUG_PRINTF("Update, t = %d\n", t);
+	
+		parallel_for( blocked_range<int>(0, n, 64),
+			[&]( blocked_range<int> rng )
+		{
+			for(auto i = rng.begin(); i != rng.end(); ++i)
+			{
+				if(step_planes(
+					back_planes[plane_index[3*i]],
+					front_planes[plane_index[3*i]],
+					front_planes[plane_index[3*i+1]],
+					front_planes[plane_index[3*i+2]],
+					&touched[PLANE_WORDS * i]))
+				{
+					update_times[i] = t;
+				}
+			}
+		});
+		
+		//Apply pending writes to both the planes and the block buffer
+		while(b_idx < blocks.size() &&
+			blocks[b_idx].t <= t + base)
+		{
+			auto const& rec = blocks[b_idx++];
+			int offset = tiles.block_offset(rec);
+			if(offset < 0)
 				continue;
-				
-			uint64_t ticks = base_tick + update_times[i];
+			
+			DEBUG_PRINTF("Writing block: %d,%d,%d, b = %d, offs=%d\n",
+				rec.x, rec.y, rec.z, rec.b.int_val, offset);
+			
+			int idx = offset / TILE_SIZE,
+				x = rec.x % CHUNK_X,
+				y = rec.y % CHUNK_Y,
+				z = rec.z % CHUNK_Z;
+			
+			tiles.blocks[offset] = rec.b;
+			back_planes[idx].set(x, y, z, rec.b);
+			touched[PLANE_WORDS * idx + ChunkPlanes::word(x, z)] &= ~(1ULL << ChunkPlanes::bit(x, y));
+			update_times[idx] = t;
+		}
 		
-			auto c = marked_chunks[i];
+		swap(front_planes, back_planes);
+	}
 	
-			int ox = c.x - x_min,
-				oy = c.y - y_min,
-				oz = c.z - z_min;
+	//Convert the changed cells back
+	parallel_for( blocked_range<int>(0, n, 64),
+		[&]( blocked_range<int> rng )
+	{
+		for(auto i = rng.begin(); i != rng.end(); ++i)
+		{
+			if(update_times[i] < 0)
+				continue;
 			
-			int offset =  ox * CHUNK_X + 
-						  oz * CHUNK_Z * stride_x + 
-						 (oy * CHUNK_Y + 1) * stride_xz;
+			front_planes[i].store(
+				&touched[PLANE_WORDS * i],
+				tiles.tile(i) + TILE_ORIGIN,
+				TILE_STRIDE_X,
+				TILE_STRIDE_XZ);
+		}
+	});
+	
+	scalable_free(front_planes);
+	scalable_free(back_planes);
+}
+
+//Steps only the cells on the frontier, applying changes in place
+void Physics::step_frontier(
+	RegionTiles& tiles,
+	block_list_t const& blocks,
+	uint64_t base,
+	int steps,
+	int16_t* update_times,
+	offset_list_t& frontier,
+	cell_pos_list_t& carried)
+{
+	auto buffer = tiles.blocks;
+
+	offset_list_t next_frontier;
+	vector<Block, scalable_allocator<Block> > next_state;
+	
+	//Writes a cell, mirroring it into the halos of the tiles which border it
+	auto set_cell = [&](int offset, Block b)
+	{
+		buffer[offset] = b;
 		
-			DEBUG_PRINTF("Writing chunk: %d,%d,%d; %d,%d,%d; %d, t=%d\n",
-				c.x, c.y, c.z,
-				ox, oy, oz,
-				offset, ticks);
+		int i = offset / TILE_SIZE,
+			l = offset % TILE_SIZE,
+			x = l % TILE_STRIDE_X - 1,
+			y = l / TILE_STRIDE_XZ - 1,
+			z = (l % TILE_STRIDE_XZ) / TILE_STRIDE_X - 1;
+		
+		auto mirror = [&](int dir, int halo)
+		{
+			int j = tiles.neighbors[i * RuleDir_Count + dir];
+			if(j >= 0)
+				buffer[j * TILE_SIZE + halo] = b;
+		};
+		
+		if(x == 0)			mirror(RuleDir_Left,	l + CHUNK_X);
+		if(x == CHUNK_X-1)	mirror(RuleDir_Right,	l - CHUNK_X);
+		if(y == 0)			mirror(RuleDir_Bottom,	l + CHUNK_Y * TILE_STRIDE_XZ);
+		if(y == CHUNK_Y-1)	mirror(RuleDir_Top,		l - CHUNK_Y * TILE_STRIDE_XZ);
+		if(z == 0)			mirror(RuleDir_Front,	l + CHUNK_Z * TILE_STRIDE_X);
+		if(z == CHUNK_Z-1)	mirror(RuleDir_Back,	l - CHUNK_Z * TILE_STRIDE_X);
+	};
+	
+	//Records a changed cell and schedules its neighborhood for the next step
+	auto touch = [&](int offset, int t)
+	{
+		int i = offset / TILE_SIZE,
+			l = offset % TILE_SIZE,
+			x = l % TILE_STRIDE_X - 1,
+			y = l / TILE_STRIDE_XZ - 1,
+			z = (l % TILE_STRIDE_XZ) / TILE_STRIDE_X - 1;
+		
+		update_times[i] = t;
+		
+		for(int k=0; k<7; ++k)
+		{
+			int nx = x + CELL_NEIGHBORS[k][0],
+				ny = y + CELL_NEIGHBORS[k][1],
+				nz = z + CELL_NEIGHBORS[k][2];
 			
-			game_map->update_chunk(
-				c, ticks,
-				front_buffer + offset,
-				stride_x,
-				stride_xz);
-
-			if(update_times[i] == 15)
+			if(	nx >= 0 && nx < CHUNK_X &&
+				ny >= 0 && ny < CHUNK_Y &&
+				nz >= 0 && nz < CHUNK_Z )
 			{
-				DEBUG_PRINTF("Writing chunk: %d,%d,%d\n", c.x, c.y, c.z);
-				mark_chunk(c);
+				next_frontier.push_back(i * TILE_SIZE + tile_offset(nx, ny, nz));
+				continue;
+			}
+			
+			//Crossed into a neighboring chunk
+			int j = tiles.neighbors[i * RuleDir_Count + k - 1];
+			if(j >= 0)
+			{
+				next_frontier.push_back(j * TILE_SIZE + tile_offset(
+					nx & (CHUNK_X-1),
+					ny & (CHUNK_Y-1),
+					nz & (CHUNK_Z-1)));
+			}
+			else
+			{
+				auto c = (*tiles.chunks)[i];
+				carried.push_back((CellPos){
+					(int)(c.x * CHUNK_X) + nx,
+					(int)(c.y * CHUNK_Y) + ny,
+					(int)(c.z * CHUNK_Z) + nz });
 			}
 		}
-	});
+	};
 	
-	DEBUG_PRINTF("Write complete\n");
+	//The current block index in the pending write queue
+	int b_idx = 0;
+
+	for(int t=0; t<steps; ++t)
+	{
+		sort(frontier.begin(), frontier.end());
+		frontier.erase(unique(frontier.begin(), frontier.end()), frontier.end());
+		
+		DEBUG_PRINTF("Update, t = %d, frontier = %d\n", t, (int)frontier.size());
+		
+		//Evaluate the frontier against the current state
+		next_state.resize(frontier.size());
+		parallel_for( blocked_range<int>(0, frontier.size(), 1024),
+			[&]( blocked_range<int> rng )
+		{
+			for(auto i = rng.begin(); i != rng.end(); ++i)
+			{
+				auto p = buffer + frontier[i];
+				next_state[i] = update_block(
+					p[ 0],
+					p[-1],
+					p[ 1],
+					p[-TILE_STRIDE_XZ],
+					p[ TILE_STRIDE_XZ],
+					p[-TILE_STRIDE_X],
+					p[ TILE_STRIDE_X]);
+			}
+		});
+		
+		//All reads are done, so the changes can be applied in place
+		next_frontier.clear();
+		for(int i=0; i<frontier.size(); ++i)
+		{
+			if(next_state[i] == buffer[frontier[i]])
+				continue;
+			set_cell(frontier[i], next_state[i]);
+			touch(frontier[i], t);
+		}
+		
+		//Apply pending writes
+		while(b_idx < blocks.size() &&
+			blocks[b_idx].t <= t + base)
+		{
+			int offset = tiles.block_offset(blocks[b_idx]);
+			
+			DEBUG_PRINTF("Writing block: %d,%d,%d, b = %d, offs=%d\n",
+				blocks[b_idx].x, blocks[b_idx].y, blocks[b_idx].z, blocks[b_idx].b.int_val, offset);
+			if(offset >= 0)
+			{
+				set_cell(offset, blocks[b_idx].b);
+				touch(offset, t);
+			}
+			
+			++b_idx;
+		}
+		
+		frontier.swap(next_frontier);
+		
+		//The region has settled
+		if(frontier.empty() && (b_idx == blocks.size() || blocks[b_idx].t >= base + steps))
+			break;
+	}
 	
-	scalable_free(update_times);
-	scalable_free(front_buffer);
-	scalable_free(back_buffer);
+	//Whatever is left on the frontier gets evaluated in the next batch
+	for(int i=0; i<frontier.size(); ++i)
+		carried.push_back(tiles.position(frontier[i]));
 }
 
 };
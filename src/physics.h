@@ -2,17 +2,24 @@
 #define PHYSICS_H
 
 #include <set>
+#include <vector>
+#include <unordered_map>
 
 #include <tbb/task.h>
+#include <tbb/atomic.h>
+#include <tbb/tick_count.h>
 #include <tbb/task_group.h>
 #include <tbb/scalable_allocator.h>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/queuing_rw_mutex.h>
+#include <tbb/spin_mutex.h>
 
 #include "constants.h"
 #include "config.h"
 #include "chunk.h"
 #include "game_map.h"
+#include "block_intake.h"
+#include "physics_recording.h"
 
 namespace Game
 {
@@ -24,31 +31,70 @@ namespace Game
 		
 		void set_block(Block b, uint64_t t, int x, int y, int z);
 		void mark_chunk(ChunkID const& chunk);	
-		void update(uint64_t t);
-	
-	private:
-
-		struct BlockRecord
+		
+		//Reports a block which was written straight to the map, the next batch wakes its neighborhood.  A
+		//batch which read the chunk before the write fails to commit it and recomputes it from the new version.
+		void touch_block(Block b, int x, int y, int z);
+		
+		//Sets the chunks players are in, which decides how often each region is simulated
+		void set_observers(std::vector<ChunkID> const& chunks);
+		
+		//Called once per tick from the world loop.  Commits a finished batch and starts the next one when
+		//due, without ever waiting for a running batch.
+		void tick(uint64_t ticks);
+		
+		//Runs the due batch to completion and commits it, used to drive the physics offline
+		void flush();
+		
+		void print_stats();
+		
+		//Regions which failed to commit and were recomputed
+		int conflicts() const { return commit_conflicts; }
+		
+		//Records the writes to a box of chunks [lo, hi) for offline replay.  Recording starts and stops
+		//between batches.
+		void start_recording(std::string const& path, ChunkID const& lo, ChunkID const& hi);
+		void stop_recording();
+		
+		//Pipeline phases, timed over all threads
+		enum Phase
 		{
-			uint64_t t;
-			int x, y, z;
-			Block b;
-			
-			bool operator==(BlockRecord const& other) const
-			{
-				return t==other.t && x == other.x && y == other.y && z == other.z && b == other.b;
-			}
-			
-			bool operator<(BlockRecord const& other) const
-			{
-				return t < other.t;
-			}
+			Phase_Decompress,
+			Phase_Step,
+			Phase_WriteBack,
+			Phase_Invalidate,
+			Phase_Count,
 		};
+		double phase_time(int phase) const { return phase_usec[phase] * 1e-6; }
+		
+		//Computes the next state of a single block
+		static Block update_block(
+			Block center,
+			Block left, Block right,
+			Block bottom, Block top,
+			Block front, Block back);
+
+		//Updates a single chunk	
+		static bool update_chunk(
+			Block* next,
+			Block* prev,
+			int stride_x,
+			int stride_xz);
 	
+	private:
+
 		typedef tbb::concurrent_unordered_map<ChunkID, bool, ChunkIDHashCompare> chunk_set_t;
 		typedef std::set<ChunkID, std::less<ChunkID>, tbb::scalable_allocator<ChunkID> >  chunk_set_nl_t;
-		typedef std::vector< BlockRecord, tbb::scalable_allocator<BlockRecord> > block_list_t;
 		typedef std::vector< ChunkID, tbb::scalable_allocator<ChunkID> > chunk_list_t;
+		typedef std::unordered_map<ChunkID, block_list_t, ChunkIDHashCompare> block_map_t;
+		
+		//Active cells within a chunk, stored as indices in chunk order
+		typedef std::vector< uint16_t, tbb::scalable_allocator<uint16_t> > cell_list_t;
+		typedef std::unordered_map<ChunkID, cell_list_t, ChunkIDHashCompare> cell_map_t;
+		typedef std::vector< int, tbb::scalable_allocator<int> > offset_list_t;
+		
+		//Marks every cell in a chunk as active
+		static const uint16_t ALL_CELLS = 0xffff;
 
 		//Interface to separate sytems
 		Config* config;
@@ -57,31 +103,150 @@ namespace Game
 		//The physics task group
 		uint64_t base_tick;
 		tbb::task_group	physics_tasks;
+		
+		//Batch state, only the world loop moves a batch out of Batch_Ready
+		enum BatchState
+		{
+			Batch_Idle,
+			Batch_Running,
+			Batch_Ready,
+		};
+		tbb::atomic<int> batch_state;
+		
+		//The next batch to run, requests which arrive while a batch is running are merged
+		bool batch_due;
+		uint64_t due_tick;
+		
+		//Number of batches merged in a row before the world loop waits for the running batch
+		int max_lag, lag;
+		
+		//A chunk computed by a batch, written to the map when the batch commits
+		struct StagedChunk
+		{
+			//Regions are named by their first marked chunk
+			ChunkID region, id;
+			uint64_t version, t;
+			Block* blocks;
+			
+			//Writes applied to the chunk, replayed if the commit conflicts
+			block_list_t writes;
+			
+			//Cells the batch changed with the blocks it read
+			std::vector<GameMap::CellChange> changes;
+		};
+		tbb::spin_mutex staged_lock;
+		std::vector<StagedChunk> staged;
+		
+		//Statistics
+		uint64_t batches_run, batches_merged, stalls;
+		tbb::atomic<int> commit_conflicts;
+		tbb::tick_count batch_start;
+		double last_batch_time, max_batch_time, last_commit_time;
+		tbb::atomic<uint64_t> phase_usec[Phase_Count];
+		void add_phase_time(int phase, tbb::tick_count start);
+		
+		//Recording requests are applied by tick between batches
+		tbb::spin_mutex record_lock;
+		bool record_start, record_stop;
+		std::string record_path;
+		ChunkID record_lo, record_hi;
+		PhysicsRecording* recording;
+		void apply_recording_requests(uint64_t t);
 
-		//The list of active chunks/block events
+		//Block writes from set_block, picked up at the start of each batch
+		BlockIntake intake;
+		
+		//The set of active chunks
 		tbb::queuing_rw_mutex	chunk_set_lock;
 		chunk_set_t active_chunks;
-		block_list_t pending_blocks;
+		
+		//Pending block writes by chunk, only touched by update_main
+		block_map_t pending_blocks;
+		
+		//Cells which may change on the next step.  Chunks with no active cells fall asleep.
+		tbb::spin_mutex	active_cells_lock;
+		cell_map_t active_cells;
+		
+		//Fraction of the marked volume above which a region is stepped densely
+		float dense_fraction;
+		
+		//Use the bitplane kernel for dense updates
+		bool bitplane_kernel;
+		
+		//Simulation level of detail, by chunk distance to the nearest observer.  Regions within full_radius run
+		//every batch, regions within reduced_radius every reduced_interval batches, and regions further out are
+		//frozen.  A region that was skipped catches up on its next run, by at most max_catchup batches.  Until
+		//observers are set every region runs at full rate.
+		bool lod_enabled;
+		int full_radius, reduced_radius, reduced_interval, max_catchup;
+		tbb::spin_mutex observers_lock;
+		chunk_list_t observers;
+		
+		//First tick which has not been simulated, for chunks in skipped regions.  Only touched by update_main.
+		typedef std::unordered_map<ChunkID, uint64_t, ChunkIDHashCompare> tick_map_t;
+		tick_map_t deferred_ticks;
+		uint64_t regions_run, regions_deferred, catchup_steps;
+		
+		//Marks the cell and its neighbors as active, caller must hold active_cells_lock
+		void activate_cell(int x, int y, int z);
 	
-		//Computes the next state of a single block
-		static Block update_block(
-			Block center,
-			Block left, Block right,
-			Block bottom, Block top,
-			Block front, Block back);
-
-		//Updates a single chunk	
-		static bool update_chunk(
-			Block* next,
-			Block* prev,
-			int stride_x,
-			int stride_xz);
+		//A position in world coordinates
+		struct CellPos
+		{
+			int x, y, z;
+			
+			bool operator<(CellPos const& other) const
+			{
+				if(y != other.y) return y < other.y;
+				if(z != other.z) return z < other.z;
+				return x < other.x;
+			}
+			
+			bool operator==(CellPos const& other) const
+			{
+				return x == other.x && y == other.y && z == other.z;
+			}
+		};
+		typedef std::vector< CellPos, tbb::scalable_allocator<CellPos> > cell_pos_list_t;
 	
-		//Updates a region
-		void update_region(chunk_list_t const& chunks, block_list_t const& blocks);
+		//Padded copies of the marked chunks of a region.  Each tile holds one chunk plus a one cell halo
+		//mirroring the faces of its six neighbors, so memory and work scale with the number of marked
+		//chunks rather than the volume of the region's bounding box.
+		struct RegionTiles
+		{
+			//Tile i holds marked chunk i
+			chunk_list_t const* chunks;
+			Block* blocks;
+			
+			//Marked index of the neighbor of each tile in RuleDirection order, or -1 if the face is constant
+			std::vector<int, tbb::scalable_allocator<int> > neighbors;
+			
+			//Version of each chunk when it was read
+			std::vector<uint64_t, tbb::scalable_allocator<uint64_t> > versions;
+			
+			Block* tile(int i) const;
+			int find(ChunkID const&) const;
+			int block_offset(BlockRecord const&) const;
+			CellPos position(int offset) const;
+		};
+		
+		//Updates a region for the given number of steps starting at tick base, steps is a multiple of 16
+		void update_region(chunk_list_t const& chunks, block_list_t const& blocks, cell_map_t const& cells,
+			uint64_t base, int steps);
+		
+		//Region steppers, each runs the steps of one region update and records the last step each marked chunk changed
+		void step_dense(RegionTiles&, block_list_t const&, uint64_t base, int steps, int16_t* update_times);
+		void step_bitplane(RegionTiles&, block_list_t const&, uint64_t base, int steps, int16_t* update_times);
+		void step_frontier(RegionTiles&, block_list_t const&, uint64_t base, int steps, int16_t* update_times,
+			offset_list_t& frontier, cell_pos_list_t& carried);
 		
 		//Start of the update loop
+		void start_batch(uint64_t t);
 		void update_main();
+		
+		//Writes the staged chunks of a finished batch to the map
+		void commit();
+		void commit_ready();
 	};
 };
 
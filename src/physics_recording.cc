@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+
+#include "constants.h"
+#include "chunk.h"
+#include "block_intake.h"
+#include "physics_recording.h"
+
+using namespace std;
+
+namespace Game
+{
+
+static const char PHYSICS_RECORDING_MAGIC[8] = { 'M', 'H', 'P', 'H', 'Y', 'R', 'E', 'C' };
+
+bool PhysicsRecording::contains(ChunkID const& c) const
+{
+	return	lo.x <= c.x && c.x < hi.x &&
+			lo.y <= c.y && c.y < hi.y &&
+			lo.z <= c.z && c.z < hi.z;
+}
+
+bool PhysicsRecording::contains(int x, int y, int z) const
+{
+	return contains(ChunkID(x / CHUNK_X, y / CHUNK_Y, z / CHUNK_Z));
+}
+
+void PhysicsRecording::add_events(uint64_t t, int count)
+{
+	if(batches.size() == 0 || batches.back().base_tick != t)
+	{
+		PhysicsRecordingBatch b = { t, 0 };
+		batches.push_back(b);
+	}
+	batches.back().num_events += count;
+}
+
+//Writes the recording to a file
+bool PhysicsRecording::save(string const& path) const
+{
+	FILE* fp = fopen(path.c_str(), "wb");
+	if(fp == NULL)
+		return false;
+
+	PhysicsRecordingHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PHYSICS_RECORDING_MAGIC, sizeof(PHYSICS_RECORDING_MAGIC));
+	header.version		= PHYSICS_RECORDING_VERSION;
+	header.chunk_size	= CHUNK_SIZE;
+	header.start_tick	= start_tick;
+	header.end_tick		= end_tick;
+	header.lo[0] = lo.x; header.lo[1] = lo.y; header.lo[2] = lo.z;
+	header.hi[0] = hi.x; header.hi[1] = hi.y; header.hi[2] = hi.z;
+	header.num_chunks	= chunk_ids.size();
+	header.num_active	= active.size();
+	header.num_batches	= batches.size();
+	header.num_events	= events.size();
+
+	bool failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+
+	for(int i=0; !failed && i<chunk_ids.size(); ++i)
+	{
+		PhysicsRecordingChunk c = { chunk_ids[i].x, chunk_ids[i].y, chunk_ids[i].z, 0 };
+		failed =	fwrite(&c, sizeof(c), 1, fp) != 1 ||
+					fwrite(chunk(i), sizeof(Block), CHUNK_SIZE, fp) != CHUNK_SIZE;
+	}
+
+	for(int i=0; !failed && i<active.size(); ++i)
+	{
+		PhysicsRecordingChunk c = { active[i].x, active[i].y, active[i].z, 0 };
+		failed = fwrite(&c, sizeof(c), 1, fp) != 1;
+	}
+
+	if(!failed && batches.size() > 0)
+		failed = fwrite(&batches[0], sizeof(PhysicsRecordingBatch), batches.size(), fp) != batches.size();
+	if(!failed && events.size() > 0)
+		failed = fwrite(&events[0], sizeof(BlockRecord), events.size(), fp) != events.size();
+
+	failed = fclose(fp) != 0 || failed;
+	if(failed)
+		printf("Failed to write physics recording %s\n", path.c_str());
+	return !failed;
+}
+
+//Reads a recording, fails if the file is missing or was written by an incompatible build
+bool PhysicsRecording::load(string const& path)
+{
+	FILE* fp = fopen(path.c_str(), "rb");
+	if(fp == NULL)
+		return false;
+
+	PhysicsRecordingHeader header;
+	if(fread(&header, sizeof(header), 1, fp) != 1 ||
+		memcmp(header.magic, PHYSICS_RECORDING_MAGIC, sizeof(PHYSICS_RECORDING_MAGIC)) != 0 ||
+		header.version != PHYSICS_RECORDING_VERSION ||
+		header.chunk_size != CHUNK_SIZE)
+	{
+		printf("%s is not a physics recording\n", path.c_str());
+		fclose(fp);
+		return false;
+	}
+
+	start_tick	= header.start_tick;
+	end_tick	= header.end_tick;
+	lo			= ChunkID(header.lo[0], header.lo[1], header.lo[2]);
+	hi			= ChunkID(header.hi[0], header.hi[1], header.hi[2]);
+
+	chunk_ids.resize(header.num_chunks);
+	blocks.resize(header.num_chunks * CHUNK_SIZE);
+	active.resize(header.num_active);
+	batches.resize(header.num_batches);
+	events.resize(header.num_events);
+
+	bool failed = false;
+	for(int i=0; !failed && i<header.num_chunks; ++i)
+	{
+		PhysicsRecordingChunk c;
+		failed =	fread(&c, sizeof(c), 1, fp) != 1 ||
+					fread(chunk(i), sizeof(Block), CHUNK_SIZE, fp) != CHUNK_SIZE;
+		chunk_ids[i] = ChunkID(c.x, c.y, c.z);
+	}
+
+	for(int i=0; !failed && i<header.num_active; ++i)
+	{
+		PhysicsRecordingChunk c;
+		failed = fread(&c, sizeof(c), 1, fp) != 1;
+		active[i] = ChunkID(c.x, c.y, c.z);
+	}
+
+	if(!failed && batches.size() > 0)
+		failed = fread(&batches[0], sizeof(PhysicsRecordingBatch), batches.size(), fp) != batches.size();
+	if(!failed && events.size() > 0)
+		failed = fread(&events[0], sizeof(BlockRecord), events.size(), fp) != events.size();
+
+	fclose(fp);
+	if(failed)
+		printf("Physics recording %s is truncated\n", path.c_str());
+	return !failed;
+}
+
+};
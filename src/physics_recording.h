@@ -0,0 +1,85 @@
+#ifndef PHYSICS_RECORDING_H
+#define PHYSICS_RECORDING_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "chunk.h"
+#include "block_intake.h"
+
+namespace Game
+{
+	//Version of the recording format, bump this whenever the layout changes
+	#define PHYSICS_RECORDING_VERSION	1
+
+	//A capture of the physics input for a box of chunks, used to replay load offline.
+	//
+	//Layout:
+	//	PhysicsRecordingHeader
+	//	{ PhysicsRecordingChunk, Block[CHUNK_SIZE] }[num_chunks]	contents of the box when recording started
+	//	PhysicsRecordingChunk[num_active]							chunks which were awake
+	//	PhysicsRecordingBatch[num_batches]							batches run while recording
+	//	BlockRecord[num_events]										writes fed to the physics in intake order, t = 0 for edits
+	//																which were written straight to the map
+	struct PhysicsRecordingHeader
+	{
+		char		magic[8];
+		uint32_t	version, chunk_size;
+		uint64_t	start_tick, end_tick;
+		uint32_t	lo[3], hi[3];
+		uint64_t	num_chunks, num_active, num_batches, num_events;
+	};
+
+	struct PhysicsRecordingChunk
+	{
+		uint32_t	x, y, z, pad;
+	};
+	
+	//A batch and the number of writes it picked up, so a replay drains the writes at the same points
+	struct PhysicsRecordingBatch
+	{
+		uint64_t	base_tick, num_events;
+	};
+
+	struct PhysicsRecording
+	{
+		//Ticks covered by the recording
+		uint64_t start_tick, end_tick;
+
+		//The box [lo, hi) of chunks which was captured
+		ChunkID lo, hi;
+
+		//Initial contents of every chunk in the box, in chunk order
+		std::vector<ChunkID> chunk_ids;
+		std::vector<Block> blocks;
+
+		//Chunks which were awake when recording started
+		std::vector<ChunkID> active;
+
+		//Batches in order, events are consumed by the batches front to back
+		std::vector<PhysicsRecordingBatch> batches;
+		
+		//Block writes, in the order the physics picked them up
+		block_list_t events;
+		
+		//Counts writes picked up by the batch at base tick t
+		void add_events(uint64_t t, int count);
+
+		PhysicsRecording() : start_tick(0), end_tick(0) {}
+
+		bool contains(int x, int y, int z) const;
+		bool contains(ChunkID const&) const;
+
+		//Returns the initial blocks of the i-th chunk
+		Block* chunk(int i) { return &blocks[i * CHUNK_SIZE]; }
+		Block const* chunk(int i) const { return &blocks[i * CHUNK_SIZE]; }
+
+		bool save(std::string const& path) const;
+		bool load(std::string const& path);
+	};
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include <tbb/atomic.h>
+#include <tbb/tick_count.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/enumerable_thread_specific.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "block_intake.h"
+#include "random_tick.h"
+
+//Uncomment this line to get dense logging for the random ticks
+//#define RANDOM_TICK_DEBUG 1
+
+#ifndef RANDOM_TICK_DEBUG
+#define DEBUG_PRINTF(...)
+#else
+#define DEBUG_PRINTF(...)  fprintf(stderr,__VA_ARGS__)
+#endif
+
+using namespace std;
+using namespace tbb;
+
+namespace Game
+{
+
+RandomTicks::RandomTicks(Config* cfg, GameMap* map) :
+	config(cfg),
+	game_map(map),
+	ticks(0),
+	chunks_sampled(0),
+	blocks_sampled(0),
+	changes(0),
+	tick_time_total(0.0),
+	tick_time_max(0.0)
+{
+	samples	= config->readInt("random_tick_samples");
+	radius	= config->readInt("random_tick_radius");
+	seed	= config->readInt("world_seed");
+	skipped	= 0;
+}
+
+//Reads a single block, holding the chunk only for the read so no two chunks are ever locked at once
+bool RandomTicks::read_block(int x, int y, int z, Block& b)
+{
+	if(x < 0 || y < 0 || z < 0 || x >= COORD_MAX_X || y >= COORD_MAX_Y || z >= COORD_MAX_Z)
+		return false;
+
+	GameMap::const_accessor acc;
+	if(!game_map->find_chunk_buffer(acc, ChunkID(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z)))
+		return false;
+	b = acc->second->get_block(x%CHUNK_X, y%CHUNK_Y, z%CHUNK_Z);
+	return true;
+}
+
+//Picks the chunk's samples and queues their changes.  Grass with something on top of it dies back to dirt,
+//otherwise it spreads to a random dirt block nearby which has air above it.
+void RandomTicks::sample_chunk(ChunkID const& chunk_id, uint64_t t, Local& local)
+{
+	{
+		GameMap::const_accessor acc;
+		if(!game_map->find_chunk_buffer(acc, chunk_id))
+		{
+			++skipped;
+			return;
+		}
+	}
+
+	auto& random = local.random;
+	if(random.state == 0)
+		random.state = (seed.fetch_and_increment() + 1) * 0x9E3779B97F4A7C15ULL;
+
+	for(int i=0; i<samples; ++i)
+	{
+		uint32_t r = random.next();
+		int x = chunk_id.x * CHUNK_X + (r & (CHUNK_X-1)),
+			z = chunk_id.z * CHUNK_Z + ((r >> CHUNK_X_S) & (CHUNK_Z-1)),
+			y = chunk_id.y * CHUNK_Y + ((r >> (CHUNK_X_S + CHUNK_Z_S)) & (CHUNK_Y-1));
+
+		Block b, above;
+		if(!read_block(x, y, z, b) || b.type() != BlockType_Grass || !read_block(x, y+1, z, above))
+			continue;
+
+		if(above.type() != BlockType_Air)
+		{
+			BlockRecord w = { t, x, y, z, Block(BlockType_Dirt) };
+			local.writes.push_back(w);
+			local.expected.push_back(b);
+			continue;
+		}
+
+		//The target is within one block sideways, from three blocks below to one above
+		uint32_t s = random.next();
+		int tx = x + (int)(s % 3) - 1,
+			ty = y + (int)((s >> 2) % 5) - 3,
+			tz = z + (int)((s >> 5) % 3) - 1;
+
+		Block target, target_above;
+		if(!read_block(tx, ty, tz, target) || target.type() != BlockType_Dirt ||
+			!read_block(tx, ty+1, tz, target_above) || target_above.type() != BlockType_Air)
+			continue;
+
+		BlockRecord w = { t, tx, ty, tz, Block(BlockType_Grass) };
+		local.writes.push_back(w);
+		local.expected.push_back(target);
+	}
+}
+
+//Orders writes by chunk in lock order
+struct RandomTickWriteOrder
+{
+	bool operator()(pair<BlockRecord, Block> const& a, pair<BlockRecord, Block> const& b) const
+	{
+		return ChunkID(a.first.x/CHUNK_X, a.first.y/CHUNK_Y, a.first.z/CHUNK_Z) <
+			ChunkID(b.first.x/CHUNK_X, b.first.y/CHUNK_Y, b.first.z/CHUNK_Z);
+	}
+};
+
+void RandomTicks::tick(uint64_t t, vector<ChunkID> const& observers)
+{
+	if(samples <= 0 || observers.empty())
+		return;
+
+	auto start = tick_count::now();
+
+	//Every chunk within the radius of an observer is sampled once, however many observers are near it
+	chunks.clear();
+	for(int i=0; i<observers.size(); ++i)
+	{
+		auto const& o = observers[i];
+		for(int dy=-radius; dy<=radius; ++dy)
+		for(int dz=-radius; dz<=radius; ++dz)
+		for(int dx=-radius; dx<=radius; ++dx)
+		{
+			int64_t cx = (int64_t)o.x + dx,
+					cy = (int64_t)o.y + dy,
+					cz = (int64_t)o.z + dz;
+			if(cx < 0 || cy < 0 || cz < 0 || cx >= CHUNK_IDX_MAX || cy >= CHUNK_IDX_MAX || cz >= CHUNK_IDX_MAX)
+				continue;
+			chunks.push_back(ChunkID(cx, cy, cz));
+		}
+	}
+	sort(chunks.begin(), chunks.end());
+	chunks.erase(unique(chunks.begin(), chunks.end()), chunks.end());
+
+	skipped = 0;
+	parallel_for(blocked_range<int>(0, chunks.size(), 16),
+		[&](blocked_range<int> const& range)
+	{
+		auto& local = locals.local();
+		for(int i=range.begin(); i!=range.end(); ++i)
+			sample_chunk(chunks[i], t, local);
+	});
+
+	//Gather the changes and write them a chunk at a time
+	vector< pair<BlockRecord, Block> > writes;
+	for(auto iter = locals.begin(); iter != locals.end(); ++iter)
+	{
+		for(int i=0; i<iter->writes.size(); ++i)
+			writes.push_back(make_pair(iter->writes[i], iter->expected[i]));
+		iter->writes.clear();
+		iter->expected.clear();
+	}
+	stable_sort(writes.begin(), writes.end(), RandomTickWriteOrder());
+
+	block_list_t chunk_writes;
+	vector<Block> chunk_expected;
+	for(int i=0; i<writes.size(); )
+	{
+		ChunkID chunk_id(writes[i].first.x/CHUNK_X, writes[i].first.y/CHUNK_Y, writes[i].first.z/CHUNK_Z);
+		chunk_writes.clear();
+		chunk_expected.clear();
+		for(; i<writes.size(); ++i)
+		{
+			auto const& w = writes[i].first;
+			if(!(ChunkID(w.x/CHUNK_X, w.y/CHUNK_Y, w.z/CHUNK_Z) == chunk_id))
+				break;
+			chunk_writes.push_back(w);
+			chunk_expected.push_back(writes[i].second);
+		}
+
+		//A block the players changed since it was sampled keeps their edit
+		if(game_map->set_blocks(chunk_id, t, &chunk_writes[0], chunk_writes.size(), &chunk_expected[0]))
+			DEBUG_PRINTF("Random ticks changed chunk %d,%d,%d\n", chunk_id.x, chunk_id.y, chunk_id.z);
+	}
+
+	double elapsed = (tick_count::now() - start).seconds();
+	++ticks;
+	chunks_sampled += chunks.size() - skipped;
+	blocks_sampled += (chunks.size() - skipped) * samples;
+	changes += writes.size();
+	tick_time_total += elapsed;
+	tick_time_max = max(tick_time_max, elapsed);
+}
+
+void RandomTicks::print_stats()
+{
+	printf("Random ticks: %ld chunks and %ld blocks sampled, %ld changes over %ld ticks, %d samples per chunk within %d chunks\n",
+		chunks_sampled, blocks_sampled, changes, ticks, samples, radius);
+	printf("  Tick time: mean %.2f ms, max %.2f ms\n",
+		ticks > 0 ? 1000.0 * tick_time_total / ticks : 0.0,
+		1000.0 * tick_time_max);
+
+	ticks = chunks_sampled = blocks_sampled = changes = 0;
+	tick_time_total = tick_time_max = 0.0;
+}
+
+};
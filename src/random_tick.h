@@ -0,0 +1,88 @@
+#ifndef RANDOM_TICK_H
+#define RANDOM_TICK_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <tbb/atomic.h>
+#include <tbb/enumerable_thread_specific.h>
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "block_intake.h"
+
+namespace Game
+{
+	//Slow block changes, such as grass spreading onto dirt.  Every tick a few random blocks are picked in
+	//each loaded chunk within random_tick_radius chunks of a player, random_tick_samples per chunk, and
+	//only those blocks are updated.  The work per tick is proportional to the number of samples, not to the
+	//number of blocks in the chunks.
+	//
+	//Chunks are sampled in parallel, each thread draws from its own generator.  The changes are grouped by
+	//chunk and written to the map with one lock per chunk.  Chunks which are not in memory are skipped,
+	//the scheduler never causes chunks to be loaded or generated.
+	struct RandomTicks
+	{
+		RandomTicks(Config* config, GameMap* game_map);
+
+		//Samples the chunks around the observers and applies the changes, called once per tick from the world loop
+		void tick(uint64_t t, std::vector<ChunkID> const& observers);
+
+		void print_stats();
+
+	private:
+
+		//Per thread xorshift generator
+		struct Random
+		{
+			uint64_t state;
+
+			Random() : state(0) {}
+
+			uint32_t next()
+			{
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				return (uint32_t)(state >> 32);
+			}
+		};
+
+		//Scratch state for one thread, each write holds the block it replaces
+		struct Local
+		{
+			Random random;
+			block_list_t writes;
+			std::vector<Block> expected;
+		};
+		typedef tbb::enumerable_thread_specific<Local> local_t;
+
+		//Interface to separate sytems
+		Config* config;
+		GameMap* game_map;
+
+		int samples, radius;
+
+		//Seeds the thread generators
+		tbb::atomic<uint64_t> seed;
+		local_t locals;
+
+		//Loaded chunks sampled by the current tick
+		std::vector<ChunkID> chunks;
+
+		//Statistics since the last print
+		uint64_t ticks, chunks_sampled, blocks_sampled, changes;
+		tbb::atomic<uint64_t> skipped;
+		double tick_time_total, tick_time_max;
+
+		//Reads a block from the map if its chunk is in memory
+		bool read_block(int x, int y, int z, Block& b);
+
+		void sample_chunk(ChunkID const& chunk_id, uint64_t t, Local& local);
+	};
+};
+
+#endif
+
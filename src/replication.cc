@@ -0,0 +1,558 @@
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <tbb/atomic.h>
+#include <tbb/tick_count.h>
+#include <tbb/compat/thread>
+#include <tbb/spin_mutex.h>
+#include <tbb/concurrent_queue.h>
+
+#include "network.pb.h"
+#include "map.pb.h"
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "replication.h"
+
+using namespace std;
+using namespace tbb;
+
+#define REPLICATION_DEBUG 1
+
+#ifndef REPLICATION_DEBUG
+#define DEBUG_PRINTF(...)
+#else
+#define DEBUG_PRINTF(...)  fprintf(stderr,__VA_ARGS__)
+#endif
+
+namespace Game
+{
+
+//Poll interval for the replication sockets, in milliseconds
+#define REPLICATION_POLL_MS		100
+
+//Wall clock time in seconds, comparable between processes on the same host
+static double wall_time()
+{
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+//Fills out a unix socket address
+static bool make_address(string const& path, sockaddr_un& addr)
+{
+	if(path.size() >= sizeof(addr.sun_path))
+		return false;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+
+//-------------------------------------------------------------------
+// Primary
+//-------------------------------------------------------------------
+
+ReplicationPrimary::ReplicationPrimary(Config* cfg, GameMap* gmap) :
+	config(cfg),
+	game_map(gmap),
+	listen_fd(-1),
+	client_fd(-1),
+	worker_thread(NULL)
+{
+	running = false;
+	connected = false;
+	queue_size = 0;
+	records_sent = 0;
+}
+
+ReplicationPrimary::~ReplicationPrimary()
+{
+	stop();
+}
+
+//Starts listening for a follower
+bool ReplicationPrimary::start()
+{
+	auto path = config->readString("replication_listen");
+	
+	sockaddr_un addr;
+	if(!make_address(path, addr))
+	{
+		printf("Bad replication socket path: %s\n", path.c_str());
+		return false;
+	}
+	
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listen_fd == -1)
+	{
+		perror("socket");
+		return false;
+	}
+	
+	unlink(path.c_str());
+	if(bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) == -1 ||
+		listen(listen_fd, 1) == -1)
+	{
+		perror("bind");
+		close(listen_fd);
+		listen_fd = -1;
+		return false;
+	}
+	
+	struct ReplicationWorker
+	{
+		ReplicationPrimary* primary;
+		void operator()() { primary->worker_loop(); }
+	};
+	
+	running = true;
+	worker_thread = new thread((ReplicationWorker){this});
+	
+	printf("Replication primary listening on %s\n", path.c_str());
+	return true;
+}
+
+void ReplicationPrimary::stop()
+{
+	if(worker_thread != NULL)
+	{
+		running = false;
+		worker_thread->join();
+		delete worker_thread;
+		worker_thread = NULL;
+	}
+	
+	disconnect();
+	
+	if(listen_fd != -1)
+	{
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(config->readString("replication_listen").c_str());
+	}
+}
+
+//Queues a record, records are dropped while no follower is connected
+void ReplicationPrimary::enqueue(Map::ReplicationRecord const& record)
+{
+	if(!connected)
+		return;
+	
+	auto str = new string();
+	record.SerializeToString(str);
+	queue.push(str);
+	++queue_size;
+}
+
+void ReplicationPrimary::push_chunk(ChunkID const& chunk_id, ChunkBuffer const& chunk)
+{
+	if(!connected)
+		return;
+
+	Map::ReplicationRecord record;
+	auto c = record.mutable_chunk();
+	if(!chunk.serialize_to_protocol_buffer(*c))
+		return;
+	c->set_x(chunk_id.x);
+	c->set_y(chunk_id.y);
+	c->set_z(chunk_id.z);
+	record.set_sent(wall_time());
+	enqueue(record);
+}
+
+void ReplicationPrimary::push_tick(uint64_t ticks)
+{
+	if(!connected)
+		return;
+
+	Map::ReplicationRecord record;
+	record.set_tick(ticks);
+	record.set_sent(wall_time());
+	enqueue(record);
+}
+
+void ReplicationPrimary::clear_queue()
+{
+	string* str;
+	while(queue.try_pop(str))
+	{
+		delete str;
+		--queue_size;
+	}
+}
+
+void ReplicationPrimary::disconnect()
+{
+	connected = false;
+	if(client_fd != -1)
+	{
+		close(client_fd);
+		client_fd = -1;
+	}
+	clear_queue();
+}
+
+//Writes one framed record to the follower
+bool ReplicationPrimary::send_record(string const& str)
+{
+	uint8_t header[4];
+	uint32_t len = str.size();
+	for(int i=0; i<4; ++i)
+		header[i] = (len >> (8*i)) & 0xff;
+
+	const char* parts[2] = { (const char*)header, str.data() };
+	int sizes[2] = { 4, (int)str.size() };
+	
+	for(int p=0; p<2; ++p)
+	{
+		int sent = 0;
+		while(sent < sizes[p])
+		{
+			int r = send(client_fd, parts[p] + sent, sizes[p] - sent, MSG_NOSIGNAL);
+			if(r < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				return false;
+			}
+			sent += r;
+		}
+	}
+	
+	++records_sent;
+	return true;
+}
+
+//Sends the contents of the map database to a newly connected follower
+bool ReplicationPrimary::send_snapshot()
+{
+	//Everything modified before this point is in the database after the flush, everything
+	//after is already being queued.  The flush waits for any flush the DB worker has in
+	//progress, so no chunk is left between the dirty set and the database while it is read.
+	//The follower only applies newer versions of a chunk, so the overlap is harmless.
+	game_map->flush();
+	
+	uint64_t count = 0;
+	bool ok = game_map->read_stored_chunks([&](Network::Chunk const& chunk) -> bool
+	{
+		Map::ReplicationRecord record;
+		record.mutable_chunk()->CopyFrom(chunk);
+		record.set_sent(wall_time());
+		
+		string str;
+		record.SerializeToString(&str);
+		++count;
+		return running && send_record(str);
+	});
+	
+	if(!ok)
+		return false;
+	
+	Map::ReplicationRecord done;
+	done.set_snapshot_done(true);
+	done.set_sent(wall_time());
+	
+	string str;
+	done.SerializeToString(&str);
+	
+	printf("Replication snapshot sent, %ld chunks\n", count);
+	return send_record(str);
+}
+
+void ReplicationPrimary::worker_loop()
+{
+	int max_queue = config->readInt("replication_max_queue");
+
+	while(running)
+	{
+		//Wait for a follower
+		if(client_fd == -1)
+		{
+			pollfd pfd;
+			pfd.fd = listen_fd;
+			pfd.events = POLLIN;
+			if(poll(&pfd, 1, REPLICATION_POLL_MS) <= 0)
+				continue;
+			
+			client_fd = accept(listen_fd, NULL, NULL);
+			if(client_fd == -1)
+				continue;
+			
+			printf("Replication follower connected\n");
+			
+			connected = true;
+			if(!send_snapshot())
+			{
+				printf("Replication follower lost during snapshot\n");
+				disconnect();
+			}
+			continue;
+		}
+		
+		//A follower that falls too far behind has to start over
+		if(queue_size > max_queue)
+		{
+			printf("Replication follower fell behind (%d records queued), disconnecting\n", (int)queue_size);
+			disconnect();
+			continue;
+		}
+		
+		//Drain the queue
+		string* str;
+		bool idle = true;
+		while(running && queue.try_pop(str))
+		{
+			--queue_size;
+			idle = false;
+			
+			bool ok = send_record(*str);
+			delete str;
+			
+			if(!ok)
+			{
+				printf("Replication follower disconnected\n");
+				disconnect();
+				break;
+			}
+		}
+		
+		if(idle)
+			this_thread::sleep_for(tick_count::interval_t(0.001));
+	}
+}
+
+void ReplicationPrimary::print_stats()
+{
+	printf("Replication primary: %s, %ld records sent, %d queued\n",
+		connected ? "follower connected" : "no follower",
+		(uint64_t)records_sent,
+		(int)queue_size);
+}
+
+//-------------------------------------------------------------------
+// Follower
+//-------------------------------------------------------------------
+
+ReplicationFollower::ReplicationFollower(Config* cfg, GameMap* gmap) :
+	config(cfg),
+	game_map(gmap),
+	socket_fd(-1),
+	worker_thread(NULL),
+	records_applied(0),
+	primary_tick(0),
+	lag_last(0.0),
+	lag_max(0.0),
+	lag_total(0.0),
+	lag_count(0)
+{
+	running = false;
+	snapshot_done = false;
+}
+
+ReplicationFollower::~ReplicationFollower()
+{
+	stop();
+}
+
+bool ReplicationFollower::start()
+{
+	struct FollowerWorker
+	{
+		ReplicationFollower* follower;
+		void operator()() { follower->worker_loop(); }
+	};
+	
+	running = true;
+	worker_thread = new thread((FollowerWorker){this});
+	return true;
+}
+
+//Stops following, after this returns the replica is no longer modified
+void ReplicationFollower::stop()
+{
+	if(worker_thread != NULL)
+	{
+		running = false;
+		worker_thread->join();
+		delete worker_thread;
+		worker_thread = NULL;
+	}
+	
+	if(socket_fd != -1)
+	{
+		close(socket_fd);
+		socket_fd = -1;
+	}
+}
+
+//Reads exactly len bytes, polling so that stop() is not blocked
+bool ReplicationFollower::recv_all(void* buf, int len)
+{
+	int got = 0;
+	while(got < len)
+	{
+		if(!running)
+			return false;
+	
+		pollfd pfd;
+		pfd.fd = socket_fd;
+		pfd.events = POLLIN;
+		int r = poll(&pfd, 1, REPLICATION_POLL_MS);
+		if(r == 0 || (r < 0 && errno == EINTR))
+			continue;
+		if(r < 0)
+			return false;
+		
+		r = recv(socket_fd, (char*)buf + got, len - got, 0);
+		if(r == 0 || (r < 0 && errno != EINTR))
+			return false;
+		if(r > 0)
+			got += r;
+	}
+	return true;
+}
+
+void ReplicationFollower::apply(Map::ReplicationRecord const& record)
+{
+	if(record.has_chunk())
+	{
+		game_map->apply_chunk(record.chunk());
+	}
+	
+	if(record.has_tick())
+	{
+		//Keep the tick count current, so a promoted follower continues the primary's clock
+		config->storeInt("ticks", record.tick());
+	}
+	
+	if(record.snapshot_done())
+	{
+		printf("Replication snapshot received\n");
+		snapshot_done = true;
+	}
+	
+	double lag = record.has_sent() ? wall_time() - record.sent() : 0.0;
+	
+	spin_mutex::scoped_lock L(stats_lock);
+	records_applied++;
+	if(record.has_tick())
+		primary_tick = record.tick();
+	
+	//Lag is only meaningful once the follower is streaming live updates
+	if(snapshot_done && !record.snapshot_done())
+	{
+		lag_last = lag;
+		lag_max = max(lag_max, lag);
+		lag_total += lag;
+		lag_count++;
+	}
+}
+
+void ReplicationFollower::worker_loop()
+{
+	auto path = config->readString("replication_follow");
+	
+	sockaddr_un addr;
+	if(!make_address(path, addr))
+	{
+		printf("Bad replication socket path: %s\n", path.c_str());
+		return;
+	}
+	
+	while(running)
+	{
+		//Connect to the primary
+		socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(socket_fd == -1 || connect(socket_fd, (sockaddr*)&addr, sizeof(addr)) == -1)
+		{
+			if(socket_fd != -1)
+				close(socket_fd);
+			socket_fd = -1;
+			this_thread::sleep_for(tick_count::interval_t(1.0));
+			continue;
+		}
+		
+		printf("Connected to replication primary %s\n", path.c_str());
+		snapshot_done = false;
+	
+		//Apply records until the stream breaks
+		string buffer;
+		while(running)
+		{
+			uint8_t header[4];
+			if(!recv_all(header, 4))
+				break;
+			
+			uint32_t len = header[0] | (header[1]<<8) | (header[2]<<16) | (header[3]<<24);
+			buffer.resize(len);
+			if(len > 0 && !recv_all(&buffer[0], len))
+				break;
+			
+			Map::ReplicationRecord record;
+			if(!record.ParseFromString(buffer))
+			{
+				printf("Bad replication record\n");
+				break;
+			}
+			
+			apply(record);
+		}
+		
+		close(socket_fd);
+		socket_fd = -1;
+		
+		if(running)
+			printf("Lost connection to replication primary\n");
+	}
+}
+
+uint64_t ReplicationFollower::last_tick()
+{
+	spin_mutex::scoped_lock L(stats_lock);
+	return primary_tick;
+}
+
+double ReplicationFollower::max_lag()
+{
+	spin_mutex::scoped_lock L(stats_lock);
+	return lag_max;
+}
+
+void ReplicationFollower::print_stats()
+{
+	double tick_rate = config->readFloat("tick_rate");
+
+	spin_mutex::scoped_lock L(stats_lock);
+	printf("Replication follower: %s, %ld records applied, primary tick %ld\n",
+		snapshot_done ? "streaming" : "waiting for snapshot",
+		records_applied,
+		primary_tick);
+	
+	if(lag_count > 0)
+	{
+		printf("Lag: last %.2f ms (%.2f ticks), max %.2f ms (%.2f ticks), mean %.2f ms\n",
+			lag_last * 1000.0, lag_last / tick_rate,
+			lag_max * 1000.0, lag_max / tick_rate,
+			lag_total * 1000.0 / lag_count);
+	}
+	
+	//Reset the window
+	lag_max = 0.0;
+	lag_total = 0.0;
+	lag_count = 0;
+}
+
+};
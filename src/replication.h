@@ -0,0 +1,100 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdint.h>
+#include <string>
+
+#include <tbb/atomic.h>
+#include <tbb/compat/thread>
+#include <tbb/spin_mutex.h>
+#include <tbb/concurrent_queue.h>
+
+#include "map.pb.h"
+
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+
+namespace Game
+{
+	struct GameMap;
+
+	//Streams chunk updates from the primary server to a hot standby follower over a local socket.
+	//When a follower connects it first receives a snapshot of the map database, then every chunk
+	//update as it happens, plus a heartbeat each tick.  Only one follower is served at a time.
+	struct ReplicationPrimary
+	{
+		ReplicationPrimary(Config* config, GameMap* game_map);
+		~ReplicationPrimary();
+		
+		bool start();
+		void stop();
+		
+		//Queues a chunk update, the chunk's protocol buffer data must be cached
+		void push_chunk(ChunkID const&, ChunkBuffer const&);
+		
+		//Queues a heartbeat
+		void push_tick(uint64_t ticks);
+		
+		void print_stats();
+		
+	private:
+		Config*		config;
+		GameMap*	game_map;
+		
+		int listen_fd, client_fd;
+		tbb::atomic<bool> running, connected;
+		tbb::atomic<int> queue_size;
+		tbb::atomic<uint64_t> records_sent;
+		tbb::concurrent_queue<std::string*>	queue;
+		std::thread* worker_thread;
+		
+		void enqueue(Map::ReplicationRecord const&);
+		void clear_queue();
+		bool send_record(std::string const&);
+		bool send_snapshot();
+		void disconnect();
+		void worker_loop();
+	};
+	
+	//Receives the replication stream and applies it to a local replica of the map.  The replica's
+	//own DB worker keeps its database current, so the follower can be promoted by stopping it and
+	//starting the world.
+	struct ReplicationFollower
+	{
+		ReplicationFollower(Config* config, GameMap* game_map);
+		~ReplicationFollower();
+		
+		bool start();
+		void stop();
+		
+		//True once the snapshot has been applied and live updates are streaming
+		bool streaming() const { return snapshot_done; }
+		
+		//Tick of the last heartbeat applied, and the largest lag since the last print in seconds
+		uint64_t last_tick();
+		double max_lag();
+		
+		void print_stats();
+		
+	private:
+		Config*		config;
+		GameMap*	game_map;
+		
+		int socket_fd;
+		tbb::atomic<bool> running, snapshot_done;
+		std::thread* worker_thread;
+		
+		//Replication statistics
+		tbb::spin_mutex stats_lock;
+		uint64_t records_applied, primary_tick;
+		double lag_last, lag_max, lag_total;
+		uint64_t lag_count;
+		
+		bool recv_all(void* buf, int len);
+		void apply(Map::ReplicationRecord const&);
+		void worker_loop();
+	};
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#include "constants.h"
+#include "chunk.h"
+#include "rules.h"
+
+using namespace std;
+
+namespace Game
+{
+
+const uint8_t RuleTable::KEEP;
+
+RuleTable::RuleTable(BlockRule const* rule_list, int num_rules) :
+	rules(rule_list, rule_list + num_rules)
+{
+	//Every type which appears in a pattern gets its own class, class 0 is everything else
+	memset(classes, 0, sizeof(classes));
+	num_classes = 1;
+	for(int i=0; i<num_rules; ++i)
+	for(int d=0; d<RuleDir_Count; ++d)
+	{
+		uint8_t t = rules[i].neighbors[d];
+		if(t != ANY_BLOCK && classes[t] == 0)
+			classes[t] = num_classes++;
+	}
+	
+	//Build a table for each center type over the directions its rules use
+	memset(kernels, 0, sizeof(kernels));
+	for(int c=0; c<256; ++c)
+	{
+		bool used[RuleDir_Count] = { false };
+		bool any = false;
+		for(int i=0; i<num_rules; ++i)
+		{
+			if(rules[i].center != c)
+				continue;
+			any = true;
+			for(int d=0; d<RuleDir_Count; ++d)
+			{
+				if(rules[i].neighbors[d] != ANY_BLOCK)
+					used[d] = true;
+			}
+		}
+		
+		if(!any)
+			continue;
+		
+		auto& k = kernels[c];
+		k.active = false;
+		k.base = table.size();
+		for(int d=0; d<RuleDir_Count; ++d)
+		{
+			if(used[d])
+				k.dirs[k.num_dirs++] = d;
+		}
+		
+		//A center whose rules ignore the neighbors still gets one entry
+		int size = 1;
+		for(int i=0; i<k.num_dirs; ++i)
+			size *= num_classes;
+		
+		if(size > (1<<24))
+		{
+			fprintf(stderr, "Physics rules for block type %d use too many neighbor classes\n", c);
+			abort();
+		}
+		
+		table.resize(k.base + size, KEEP);
+		
+		//Evaluate the rules once for every combination of neighbor classes
+		for(int idx=0; idx<size; ++idx)
+		{
+			int cls[RuleDir_Count];
+			for(int d=0, r=idx; d<k.num_dirs; ++d, r/=num_classes)
+				cls[k.dirs[d]] = r % num_classes;
+		
+			for(int i=0; i<num_rules; ++i)
+			{
+				if(rules[i].center != c)
+					continue;
+				
+				bool match = true;
+				for(int d=0; d<RuleDir_Count && match; ++d)
+				{
+					uint8_t t = rules[i].neighbors[d];
+					if(t != ANY_BLOCK && classes[t] != cls[d])
+						match = false;
+				}
+				
+				if(match)
+				{
+					table[k.base + idx] = rules[i].result;
+					break;
+				}
+			}
+		}
+		
+		//Centers whose table never changes anything are skipped outright
+		for(int idx=0; idx<size; ++idx)
+		{
+			if(table[k.base + idx] != KEEP)
+				k.active = true;
+		}
+	}
+}
+
+bool RuleTable::same_rules(BlockRule const* rule_list, int num_rules) const
+{
+	if(num_rules != rules.size())
+		return false;
+	return memcmp(rules.data(), rule_list, num_rules * sizeof(BlockRule)) == 0;
+}
+
+};
@@ -0,0 +1,81 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "constants.h"
+#include "chunk.h"
+
+namespace Game
+{
+	//Neighbor directions, in the argument order of Physics::update_block
+	enum RuleDirection
+	{
+		RuleDir_Left,		//-x
+		RuleDir_Right,		//+x
+		RuleDir_Bottom,		//-y
+		RuleDir_Top,		//+y
+		RuleDir_Front,		//-z
+		RuleDir_Back,		//+z
+		
+		RuleDir_Count
+	};
+	
+	//Matches any neighbor type in a rule
+	const uint8_t ANY_BLOCK = 0xff;
+	
+	//A block rule.  Fires when the center block has the given type and every neighbor matches its
+	//pattern entry, replacing the center with a fresh block of the result type.
+	struct BlockRule
+	{
+		uint8_t		center;
+		uint8_t		neighbors[RuleDir_Count];
+		uint8_t		result;
+	};
+	
+	//A list of rules compiled into lookup tables.  Neighbor types are reduced to classes (one per type
+	//mentioned in a pattern, plus one for everything else), and each center type gets a table indexed
+	//by the classes of only the directions its rules look at.  Evaluating a block is then a handful of
+	//byte loads no matter how many rules there are.  Rules are checked in order, the first match wins.
+	struct RuleTable
+	{
+		RuleTable(BlockRule const* rules, int num_rules);
+		
+		//Computes the next state of a block, neighbors are in RuleDirection order
+		Block apply(Block center, Block const* neighbors) const
+		{
+			auto const& k = kernels[center.type()];
+			if(!k.active)
+				return center;
+			
+			int idx = 0;
+			for(int i=k.num_dirs-1; i>=0; --i)
+				idx = idx * num_classes + classes[neighbors[k.dirs[i]].type()];
+			
+			uint8_t r = table[k.base + idx];
+			return r == KEEP ? center : Block(r);
+		}
+		
+		//Checks if this table was compiled from exactly the given rules
+		bool same_rules(BlockRule const* rules, int num_rules) const;
+		
+	private:
+		static const uint8_t KEEP = 0xff;
+		
+		struct Kernel
+		{
+			bool		active;
+			int			num_dirs, base;
+			uint8_t		dirs[RuleDir_Count];
+		};
+		
+		std::vector<BlockRule> rules;
+		int num_classes;
+		uint8_t classes[256];
+		Kernel kernels[256];
+		std::vector<uint8_t> table;
+	};
+};
+
+#endif
@@ -32,6 +32,8 @@ Session::Session(SessionID const& id, string const& name) :
 	last_activity(tick_count::now()),
 	last_updated(tick_count::now()),
 	player_name(name),
+	player_pitch(0.0f),
+	player_yaw(0.0f),
 	update_socket(NULL),
 	map_socket(NULL)
 {
@@ -44,6 +44,7 @@ namespace Game
 		//Player state/entity information
 		std::string			player_name;
 		Coord				player_coord;
+		float				player_pitch, player_yaw;
 		
 		//Map state information
 		typedef tbb::concurrent_unordered_map<ChunkID, uint64_t, ChunkIDHashCompare> chunk_records_t;
@@ -1,5 +1,6 @@
 #include <string>
 #include <cstdio>
+#include <cmath>
 
 #include <stdint.h>
 
@@ -18,6 +19,9 @@
 #include "session.h"
 #include "game_map.h"
 #include "physics.h"
+#include "fluid.h"
+#include "random_tick.h"
+#include "lighting.h"
 #include "world.h"
 
 using namespace tbb;
@@ -49,11 +53,21 @@ World::World(Config* cfg) : config(cfg)
 	session_manager = new SessionManager();
 	game_map = new GameMap(config);
 	physics = new Physics(config, game_map);
+	fluid = new Fluid(config, game_map, physics);
+	random_ticks = new RandomTicks(config, game_map);
+	lighting = new Lighting(config, game_map);
+	replication_primary = NULL;
+	replication_follower = NULL;
+	world_task = NULL;
 }
 
 //Clean up/saving stuff
 World::~World()
 {
+	stop_follower();
+	delete lighting;
+	delete random_ticks;
+	delete fluid;
 	delete physics;
 	delete game_map;
 	delete session_manager;
@@ -125,6 +139,22 @@ bool World::start()
 		}
 	};
 	
+	//Restore tick count, a promoted follower has been tracking the primary's clock
+	ticks = config->readInt("ticks");
+	
+	//Start streaming updates to a standby server
+	if(config->readString("replication_listen").size() > 0)
+	{
+		replication_primary = new ReplicationPrimary(config, game_map);
+		if(!replication_primary->start())
+		{
+			delete replication_primary;
+			replication_primary = NULL;
+			return false;
+		}
+		game_map->set_replicator(replication_primary);
+	}
+	
 	//Create the thread group
 	running = true;
 	world_task = new (tbb::task::allocate_root()) tbb::empty_task;
@@ -139,7 +169,22 @@ bool World::start()
 void World::stop()
 {
 	running = false;
-	world_task->wait_for_all();
+	
+	//Start may have failed before the task was created
+	if(world_task != NULL)
+	{
+		world_task->wait_for_all();
+		world_task->destroy(*world_task);
+		world_task = NULL;
+	}
+	
+	if(replication_primary != NULL)
+	{
+		game_map->set_replicator(NULL);
+		replication_primary->stop();
+		delete replication_primary;
+		replication_primary = NULL;
+	}
 
 	prev_tick = tick_count::now();
 	lag = 0.0;
@@ -152,6 +197,60 @@ void World::sync()
 {
 }
 
+//Starts following a primary server, the world must not be running
+bool World::start_follower()
+{
+	if(running || replication_follower != NULL)
+		return false;
+	
+	replication_follower = new ReplicationFollower(config, game_map);
+	return replication_follower->start();
+}
+
+//Stops following, the world can then be started to take over from the primary
+void World::stop_follower()
+{
+	if(replication_follower == NULL)
+		return;
+	
+	replication_follower->stop();
+	delete replication_follower;
+	replication_follower = NULL;
+}
+
+void World::print_generation_stats()
+{
+	game_map->print_generation_stats();
+}
+
+void World::print_physics_stats()
+{
+	physics->print_stats();
+	fluid->print_stats();
+	random_ticks->print_stats();
+	lighting->print_stats();
+}
+
+void World::start_physics_recording(string const& path, ChunkID const& lo, ChunkID const& hi)
+{
+	physics->start_recording(path, lo, hi);
+}
+
+void World::stop_physics_recording()
+{
+	physics->stop_recording();
+}
+
+void World::print_replication_stats()
+{
+	if(replication_primary != NULL)
+		replication_primary->print_stats();
+	else if(replication_follower != NULL)
+		replication_follower->print_stats();
+	else
+		printf("Replication not active\n");
+}
+
 void World::main_loop()
 {
 	//FIXME: Spawn the map precache worker
@@ -173,12 +272,30 @@ void World::main_loop()
 			ticks ++;
 			config->storeInt("ticks", ticks);
 			lag -= r;
+			
+			if(replication_primary != NULL)
+				replication_primary->push_tick(ticks);
 		
-			//Only run the physics once every 16 updates
+			//Chunks the players are in
+			vector<ChunkID> observers;
+			for(auto iter = session_manager->sessions.begin(); iter != session_manager->sessions.end(); ++iter)
+				observers.push_back(ChunkID(iter->second->player_coord));
+			
+			//Physics runs at full rate around the players
 			if((ticks % 16) == 0)
-			{
-				physics->update(ticks - 16);
-			}
+				physics->set_observers(observers);
+			
+			//Commit finished physics batches and start the next when due
+			physics->tick(ticks);
+			
+			//Move water within its budget
+			fluid->tick(ticks);
+			
+			//Grass spreads and dies back near the players
+			random_ticks->tick(ticks, observers);
+			
+			//Relight whatever changed this tick
+			lighting->tick(observers);
 			
 			//Run any per tick tasks
 		}
@@ -254,6 +371,10 @@ void World::update_players()
 					session->player_coord.y = input_packet->player_update().y();
 				if(input_packet->player_update().has_z())
 					session->player_coord.z = input_packet->player_update().z();
+				if(input_packet->player_update().has_pitch())
+					session->player_pitch = input_packet->player_update().pitch();
+				if(input_packet->player_update().has_yaw())
+					session->player_yaw = input_packet->player_update().yaw();
 			}
 			else if(input_packet->has_chat_message())
 			{
@@ -321,6 +442,10 @@ void World::send_chunk_updates(Session* session, int r)
 		(int)coord.x, (int)coord.y, (int)coord.z);
 	*/
 	
+	//Horizontal view direction, matches the client's movement code
+	float fx = -sin(session->player_yaw),
+		  fz = -cos(session->player_yaw);
+	
 	//Scan all chunks in visible radius
 	parallel_for(blocked_range3d<int,int,int>(
 		chunk.x-r, chunk.x+r,
@@ -339,8 +464,16 @@ void World::send_chunk_updates(Session* session, int r)
 			if(iter != session->known_chunks.end())
 				last_seen = iter->second;
 			
+			//Chunks near the player and in front of them get generated first
+			float dx = ix + 0.5f - coord.x / CHUNK_X,
+				  dy = iy + 0.5f - coord.y / CHUNK_Y,
+				  dz = iz + 0.5f - coord.z / CHUNK_Z;
+			float dist = sqrt(dx*dx + dy*dy + dz*dz);
+			float facing = dist > 0.0f ? (dx*fx + dz*fz) / dist : 1.0f;
+			float priority = dist * (1.5f - 0.5f * facing);
+			
 			//If not, send the packet to the player
-			auto packet = game_map->get_net_chunk(chunk_id, last_seen);
+			auto packet = game_map->get_net_chunk(chunk_id, last_seen, priority);
 			if(packet != NULL)
 			{
 				session->known_chunks.insert(make_pair(chunk_id, packet->chunk_response().last_modified()));
@@ -378,8 +511,10 @@ void World::broadcast_message(std::string const& str)
 //Sets a block in the world
 void World::set_block(Block b, uint64_t t, int x, int y, int z)
 {
-	//Push the block to the physics simulator
-	physics->set_block(b, t, x, y, z);
+	//Apply the edit to the map right away, the physics only has to work out its effects
+	game_map->set_block(b, t, x, y, z);
+	physics->touch_block(b, x, y, z);
+	fluid->wake(x, y, z);
 	
 	//Form the update packet
 	auto packet = new Network::ServerPacket();
@@ -418,9 +553,19 @@ void World::set_block(Block b, uint64_t t, int x, int y, int z)
 		bb->set_block(game_map->get_block(ox, oy, oz).int_val);
 	}
 	
-	//FIXME: Broadcast this packet in a smarter way (cull by location, use some indexing)
+	//Acknowledge the edit to the sessions which can see the chunk, everyone else picks it up when the chunk streams
+	ChunkID chunk(x/CHUNK_X, y/CHUNK_Y, z/CHUNK_Z);
+	int r = config->readInt("visible_radius");
 	for(auto iter = session_manager->sessions.begin(); iter != session_manager->sessions.end(); ++iter)
 	{
+		ChunkID player_chunk(iter->second->player_coord);
+		if( abs((int)(player_chunk.x - chunk.x)) > r ||
+			abs((int)(player_chunk.y - chunk.y)) > r ||
+			abs((int)(player_chunk.z - chunk.z)) > r )
+		{
+			continue;
+		}
+		
 		iter->second->update_socket->send_packet(new Network::ServerPacket(*packet));
 	}
 	
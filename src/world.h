@@ -17,6 +17,10 @@
 #include "session.h"
 #include "game_map.h"
 #include "physics.h"
+#include "fluid.h"
+#include "random_tick.h"
+#include "lighting.h"
+#include "replication.h"
 
 namespace Game
 {
@@ -33,6 +37,21 @@ namespace Game
 		void stop();
 		void sync();
 		
+		//Hot standby replication
+		bool start_follower();
+		void stop_follower();
+		void print_replication_stats();
+		
+		//Prints background generation metrics
+		void print_generation_stats();
+		
+		//Prints physics pipeline metrics
+		void print_physics_stats();
+		
+		//Captures the physics input in a box of chunks [lo, hi) for physreplay
+		void start_physics_recording(std::string const& path, ChunkID const& lo, ChunkID const& hi);
+		void stop_physics_recording();
+		
 		//Player management functions
 		bool player_create(std::string const& player_name);
 		bool player_delete(std::string const& player_name);
@@ -63,6 +82,11 @@ namespace Game
 		SessionManager	*session_manager;
 		GameMap			*game_map;
 		Physics			*physics;
+		Fluid			*fluid;
+		RandomTicks		*random_ticks;
+		Lighting		*lighting;
+		ReplicationPrimary	*replication_primary;
+		ReplicationFollower	*replication_follower;
 		
 		//Player update stuff
 		void update_players();
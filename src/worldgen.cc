@@ -2,8 +2,10 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
+#include <algorithm>
 
 #include <tbb/task.h>
+#include <tbb/spin_mutex.h>
 
 #include "constants.h"
 #include "config.h"
@@ -27,48 +29,219 @@ using namespace std;
 namespace Game
 {
 
+//Horizontal scale of the terrain height field and of the caves, in blocks per noise unit
+#define HEIGHT_WAVELENGTH	128.0f
+#define CAVE_WAVELENGTH		32.0f
+
+#define HEIGHT_OCTAVES		5
+#define CAVE_OCTAVES		2
+
+//Depth of the dirt layer under the grass
+#define DIRT_DEPTH			4
+
+//Caves only reach this far below the surface, everything deeper is solid stone
+#define CAVE_DEPTH			64
+
+//Sand pile over the spawn point for testing the physics
+#define SAND_PILE_RADIUS	10
+#define SAND_PILE_HEIGHT	20
+
+static bool sand_pile_column(int x, int z)
+{
+	return abs(x - ORIGIN_X) < SAND_PILE_RADIUS && abs(z - ORIGIN_Z) < SAND_PILE_RADIUS;
+}
+
 WorldGen::WorldGen(Config* cfg) : config(cfg)
 {
+	setNoiseSeed(config->readInt("world_seed"));
+	height_scale = config->readFloat("worldgen_height_scale");
+	cave_threshold = config->readFloat("worldgen_cave_threshold");
+	
+	//Round the cache size up to a power of two
+	uint32_t n = 1;
+	while(n < config->readInt("worldgen_column_cache_size"))
+		n <<= 1;
+	column_cache = new ColumnSlot[n];
+	column_cache_mask = n - 1;
 }
 
 WorldGen::~WorldGen()
 {
+	delete[] column_cache;
+}
+
+//Computes the height field for a column of chunks
+void WorldGen::generate_column(uint32_t cx, uint32_t cz, ColumnData& column)
+{
+	int bx = cx*CHUNK_X,
+		bz = cz*CHUNK_Z;
+
+	simplexNoise2DBatch(
+		(bx - ORIGIN_X) / HEIGHT_WAVELENGTH,
+		(bz - ORIGIN_Z) / HEIGHT_WAVELENGTH,
+		1.0f / HEIGHT_WAVELENGTH,
+		CHUNK_X, CHUNK_Z, HEIGHT_OCTAVES, column.height);
+	
+	column.min_height = COORD_MAX_Y;
+	column.max_height = 0;
+	for(int j=0; j<CHUNK_Z; ++j)
+	for(int i=0; i<CHUNK_X; ++i)
+	{
+		float& height = column.height[i + j*CHUNK_X];
+		height = ORIGIN_Y + height * height_scale;
+		
+		int h = (int)floorf(height);
+		column.min_height = min(column.min_height, h);
+		column.max_height = max(column.max_height,
+			sand_pile_column(bx + i, bz + j) ? h + SAND_PILE_HEIGHT + SAND_PILE_RADIUS : h);
+	}
+}
+
+//Retrieves the generation data for a column, computing it if it is not cached
+void WorldGen::get_column(uint32_t cx, uint32_t cz, ColumnData& column)
+{
+	auto& slot = column_cache[(cx * 73856093u ^ cz * 19349663u) & column_cache_mask];
+
+	spin_mutex::scoped_lock L(slot.lock);
+	if(!slot.filled || slot.x != cx || slot.z != cz)
+	{
+		generate_column(cx, cz, slot.data);
+		slot.x = cx;
+		slot.z = cz;
+		slot.filled = true;
+	}
+	column = slot.data;
+}
+
+//Checks if a chunk lies entirely above or below the surface band of its column
+bool WorldGen::classify_chunk(ChunkID const& chunk_id, ColumnData const& column, Block& b) const
+{
+	int y0 = chunk_id.y*CHUNK_Y,
+		y1 = y0 + CHUNK_Y - 1;
+	
+	if(y0 > column.max_height)
+	{
+		b = Block(BlockType_Air);
+		return true;
+	}
+	
+	if(y1 <= column.min_height - CAVE_DEPTH)
+	{
+		b = Block(BlockType_Stone);
+		return true;
+	}
+	
+	return false;
+}
+
+bool WorldGen::uniform_chunk(ChunkID const& chunk_id, Block& b)
+{
+	ColumnData column;
+	get_column(chunk_id.x, chunk_id.z, column);
+	return classify_chunk(chunk_id, column, b);
+}
+
+int WorldGen::column_top(int x, int z)
+{
+	ColumnData column;
+	get_column(x >> CHUNK_X_S, z >> CHUNK_Z_S, column);
+	return (int)floorf(column.height[(x & (CHUNK_X-1)) + (z & (CHUNK_Z-1))*CHUNK_X]);
+}
+
+//Classifies a single voxel, height is the absolute height of the column's surface
+Block WorldGen::terrain_block(int x, int y, int z, float height, float cave) const
+{
+	int h = (int)floorf(height);
+	
+	if(sand_pile_column(x, z) && abs(y - h - SAND_PILE_HEIGHT) < SAND_PILE_RADIUS)
+		return BlockType_Sand;
+	
+	if(y > h)
+		return BlockType_Air;
+	
+	//Caves stay below the surface so they do not leave floating grass
+	if(cave > cave_threshold && y < h - 1 && y > h - CAVE_DEPTH)
+		return BlockType_Air;
+	
+	if(y == h)
+		return BlockType_Grass;
+	else if(y > h - DIRT_DEPTH)
+		return BlockType_Dirt;
+	return BlockType_Stone;
 }
 
 void WorldGen::generate_chunk(ChunkID const& chunk_id, Block* data, int stride_x, int stride_xz)
 {
 	DEBUG_PRINTF("Generating chunk: %d, %d, %d\n", chunk_id.x, chunk_id.y, chunk_id.z);
 
+	int bx = chunk_id.x*CHUNK_X,
+		by = chunk_id.y*CHUNK_Y,
+		bz = chunk_id.z*CHUNK_Z;
+	
+	ColumnData column;
+	get_column(chunk_id.x, chunk_id.z, column);
+	
+	//Chunks above or below the surface band need no noise at all
+	Block uniform;
+	if(classify_chunk(chunk_id, column, uniform))
+	{
+		for(int k=0; k<CHUNK_Y; ++k)
+		for(int j=0; j<CHUNK_Z; ++j)
+		for(int i=0; i<CHUNK_X; ++i)
+			data[i + j * stride_x + k * stride_xz] = uniform;
+		return;
+	}
+
+	//Only evaluate the cave field if the chunk reaches into the cave band
+	float caves[CHUNK_SIZE];
+	if(by < column.max_height - 1 && by + CHUNK_Y > column.min_height - CAVE_DEPTH)
+	{
+		simplexNoise3DBatch(
+			(bx - ORIGIN_X) / CAVE_WAVELENGTH,
+			(by - ORIGIN_Y) / CAVE_WAVELENGTH,
+			(bz - ORIGIN_Z) / CAVE_WAVELENGTH,
+			1.0f / CAVE_WAVELENGTH,
+			CHUNK_X, CHUNK_Y, CHUNK_Z, CAVE_OCTAVES, caves);
+	}
+	else
+	{
+		fill(caves, caves + CHUNK_SIZE, -1.0f);
+	}
+
+	for(int k=0; k<CHUNK_Y; ++k)
+	for(int j=0; j<CHUNK_Z; ++j)
+	for(int i=0; i<CHUNK_X; ++i)
+	{
+		data[i + j * stride_x + k * stride_xz] = terrain_block(
+			bx + i, by + k, bz + j,
+			column.height[i + j*CHUNK_X],
+			caves[i + CHUNK_X*(j + CHUNK_Z*k)]);
+	}
+}
+
+void WorldGen::generate_chunk_scalar(ChunkID const& chunk_id, Block* data, int stride_x, int stride_xz)
+{
 	for(int k=0; k<CHUNK_Y; ++k)
 	for(int j=0; j<CHUNK_Z; ++j)
 	for(int i=0; i<CHUNK_X; ++i)
 	{
-		//Get block coordinate
 		int x = chunk_id.x*CHUNK_X + i,
 			z = chunk_id.z*CHUNK_Z + j,
 			y = chunk_id.y*CHUNK_Y + k;
-			
-		//Compute pointer
-		auto ptr = data + i + j * stride_x + k * stride_xz;
-			
-		if (abs(x - ORIGIN_X) < 10 &&
-			abs(z - ORIGIN_Z) < 10 &&
-			abs(y - ORIGIN_Y - 20) < 10)
-		{
-			*ptr = BlockType_Sand;
-			continue;
-		}	
-
-			
-		//Determine block type
-		if(y + i + j > ORIGIN_Y)
-			*ptr = BlockType_Air;
-		else if(y + i + j == ORIGIN_Y)
-			*ptr = BlockType_Grass;
-		else
-			*ptr = BlockType_Stone;
+		
+		//The scalar functions return values in [0, 1]
+		float height = 2.0f * simplexNoise2D(
+			(x - ORIGIN_X) / HEIGHT_WAVELENGTH,
+			(z - ORIGIN_Z) / HEIGHT_WAVELENGTH,
+			HEIGHT_OCTAVES) - 1.0f;
+		float cave = 2.0f * simplexNoise3D(
+			(x - ORIGIN_X) / CAVE_WAVELENGTH,
+			(y - ORIGIN_Y) / CAVE_WAVELENGTH,
+			(z - ORIGIN_Z) / CAVE_WAVELENGTH,
+			CAVE_OCTAVES) - 1.0f;
+		
+		data[i + j * stride_x + k * stride_xz] = terrain_block(x, y, z, ORIGIN_Y + height * height_scale, cave);
 	}
 }
 
 };
-
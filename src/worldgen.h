@@ -3,12 +3,23 @@
 
 #include <stdint.h>
 
+#include <tbb/spin_mutex.h>
+
 #include "constants.h"
 #include "config.h"
 #include "chunk.h"
 
 namespace Game
 {
+	//Generation data shared by every chunk in a column
+	struct ColumnData
+	{
+		//Absolute surface height of each block column, indexed x + z*CHUNK_X
+		float height[CHUNK_X * CHUNK_Z];
+		
+		//Lowest and highest surface block in the column (including any features above the surface)
+		int min_height, max_height;
+	};
 
 	//The world implements a set of rules for generating chunks
 	struct WorldGen
@@ -23,8 +34,43 @@ namespace Game
 		//It gets called *frequently*.
 		void generate_chunk(ChunkID const&, Block* data, int stride_x, int stride_xz);
 		
+		//Same terrain using the scalar noise functions one sample at a time.  Much slower, only kept
+		//as a baseline for benchmarking.
+		void generate_chunk_scalar(ChunkID const&, Block* data, int stride_x, int stride_xz);
+		
+		//Checks if a chunk is made of a single block type, without generating it
+		bool uniform_chunk(ChunkID const&, Block& b);
+		
+		//Returns the y coordinate of the generated surface block at x,z
+		int column_top(int x, int z);
+		
 	private:
 		Config *config;
+		
+		//Terrain parameters
+		float height_scale, cave_threshold;
+		
+		//Picks the block for a voxel given its column height and cave noise
+		Block terrain_block(int x, int y, int z, float height, float cave) const;
+		
+		//Column cache, direct mapped on the column coordinate.  Each slot is filled once
+		//and only replaced when a different column maps to it.
+		struct ColumnSlot
+		{
+			tbb::spin_mutex lock;
+			bool filled;
+			uint32_t x, z;
+			ColumnData data;
+			
+			ColumnSlot() : filled(false), x(0), z(0) {}
+		};
+		
+		ColumnSlot* column_cache;
+		uint32_t column_cache_mask;
+		
+		void get_column(uint32_t cx, uint32_t cz, ColumnData& column);
+		void generate_column(uint32_t cx, uint32_t cz, ColumnData& column);
+		bool classify_chunk(ChunkID const&, ColumnData const&, Block& b) const;
 	};
 };
 
@@ -0,0 +1,359 @@
+//Water flow benchmark
+//
+// Usage:
+//	fluidbench [-c <chunks across>] [-d <depth>] [-p <tap size>] [-b <budget ms>] [-n <max ticks>]
+//
+// Builds a square stone basin (default 4 chunks across) in a scratch map and fills it to the given
+// depth (default 8 blocks) from a square of taps (default 8 x 8) above its center, which are topped
+// up to full every tick until the basin's volume has been poured.  The fill runs twice, once with a
+// budget of fluid_tick_budget = <budget ms> (default 5) and once without any budget, until the water
+// settles or max ticks (default 20000) have passed.  Reports the ticks needed, the fluid time per
+// tick and how many ticks took longer than the budget in each run.  A third run fills the basin within
+// the budget while the physics runs and sand is dropped into it, and reports how many physics batches
+// failed to commit over the water.  The water must neither leak nor be created, exits with status 1 if
+// the volume in the basin differs from what was poured in any run.  The basin's chunks, and a chunk
+// holding every water level, must also survive being encoded and parsed again.
+
+#include <stdint.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <tbb/tick_count.h>
+
+#include "network.pb.h"
+
+#include "constants.h"
+#include "misc.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "physics.h"
+#include "fluid.h"
+
+#include "scratch_map.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+struct Basin
+{
+	ChunkID lo, hi;
+
+	//Inner area [x0, x1) x [z0, z1) with its floor at y0
+	int x0, x1, z0, z1, y0;
+	int depth, tap;
+
+	int64_t capacity() const { return (int64_t)(x1 - x0) * (z1 - z0) * depth * FLUID_MAX_LEVEL; }
+};
+
+//Overwrites the box of chunks with a stone basin open to the top
+void build_basin(GameMap* game_map, Basin const& basin)
+{
+	Block buffer[CHUNK_SIZE];
+	for(int cy=basin.lo.y; cy<basin.hi.y; ++cy)
+	for(int cz=basin.lo.z; cz<basin.hi.z; ++cz)
+	for(int cx=basin.lo.x; cx<basin.hi.x; ++cx)
+	{
+		for(int y=0; y<CHUNK_Y; ++y)
+		for(int z=0; z<CHUNK_Z; ++z)
+		for(int x=0; x<CHUNK_X; ++x)
+		{
+			int wx = cx * CHUNK_X + x,
+				wy = cy * CHUNK_Y + y,
+				wz = cz * CHUNK_Z + z;
+			bool inside = basin.x0 <= wx && wx < basin.x1 && basin.z0 <= wz && wz < basin.z1;
+			buffer[x + z * CHUNK_X + y * CHUNK_X * CHUNK_Z] =
+				wy < basin.y0 || !inside ? Block(BlockType_Stone) : Block(BlockType_Air);
+		}
+		game_map->update_chunk(ChunkID(cx, cy, cz), 1, buffer);
+	}
+}
+
+//Total water in the box
+int64_t measure_volume(GameMap* game_map, Basin const& basin)
+{
+	Block buffer[CHUNK_SIZE];
+	int64_t volume = 0;
+	for(int cy=basin.lo.y; cy<basin.hi.y; ++cy)
+	for(int cz=basin.lo.z; cz<basin.hi.z; ++cz)
+	for(int cx=basin.lo.x; cx<basin.hi.x; ++cx)
+	{
+		game_map->get_chunk(ChunkID(cx, cy, cz), buffer);
+		for(int i=0; i<CHUNK_SIZE; ++i)
+			volume += max(Fluid::level(buffer[i]), 0);
+	}
+	return volume;
+}
+
+//Encodes a chunk the way it is stored and sent, parses it back and compares
+bool round_trip(Block const* blocks)
+{
+	ChunkBuffer chunk;
+	chunk.compress_chunk((Block*)blocks);
+	chunk.cache_protocol_buffer_data();
+
+	Network::Chunk pbuffer;
+	if(!chunk.serialize_to_protocol_buffer(pbuffer))
+		return false;
+	string data;
+	pbuffer.SerializeToString(&data);
+
+	Network::Chunk parsed;
+	if(!parsed.ParseFromString(data))
+		return false;
+	ChunkBuffer result;
+	result.parse_from_protocol_buffer(parsed);
+
+	Block buffer[CHUNK_SIZE];
+	result.decompress_chunk(buffer);
+	return memcmp(buffer, blocks, sizeof(buffer)) == 0;
+}
+
+//Checks the encoding of the basin, and of runs of every water level with lengths around the varint limits
+bool check_encoding(GameMap* game_map, Basin const& basin)
+{
+	Block buffer[CHUNK_SIZE];
+	for(int cy=basin.lo.y; cy<basin.hi.y; ++cy)
+	for(int cz=basin.lo.z; cz<basin.hi.z; ++cz)
+	for(int cx=basin.lo.x; cx<basin.hi.x; ++cx)
+	{
+		game_map->get_chunk(ChunkID(cx, cy, cz), buffer);
+		if(!round_trip(buffer))
+		{
+			printf("Chunk %d,%d,%d did not survive encoding\n", cx, cy, cz);
+			return false;
+		}
+	}
+
+	const int lengths[] = { 1, 127, 128, 129, 300 };
+	int i = 0, k = 0;
+	while(i < CHUNK_SIZE)
+	{
+		int n = min(lengths[k % 5], CHUNK_SIZE - i);
+		Block b = (k % 3) == 2 ? Block(BlockType_Stone) : Fluid::water(1 + k % FLUID_MAX_LEVEL);
+		for(int j=0; j<n; ++j)
+			buffer[i + j] = b;
+		i += n;
+		++k;
+	}
+	if(!round_trip(buffer))
+	{
+		printf("Water levels did not survive encoding\n");
+		return false;
+	}
+	return true;
+}
+
+struct RunResult
+{
+	int			ticks;
+	bool		settled;
+	int64_t		poured, volume;
+	double		mean_time, max_time, p99_time;
+	int			over_budget;
+	int			max_backlog;
+	int			sand, conflicts;
+};
+
+//Fills the basin from scratch with the given budget, with sand dropped into it every physics batch if sand > 0
+RunResult run(Config* config, GameMap* game_map, Basin const& basin, double budget, int max_updates, double target, int max_ticks, int sand)
+{
+	config->storeFloat("fluid_tick_budget", budget);
+	config->storeInt("fluid_max_updates", max_updates);
+	build_basin(game_map, basin);
+
+	auto physics = ScopeDelete<Physics>(sand > 0 ? new Physics(config, game_map) : NULL);
+	auto fluid = ScopeDelete<Fluid>(new Fluid(config, game_map, physics.ptr));
+
+	int cx = (basin.x0 + basin.x1) / 2,
+		cz = (basin.z0 + basin.z1) / 2,
+		ty = basin.hi.y * CHUNK_Y - 2;
+
+	if(physics.ptr != NULL)
+		physics.ptr->set_observers(vector<ChunkID>(1, ChunkID(cx / CHUNK_X, basin.lo.y, cz / CHUNK_Z)));
+
+	RunResult result;
+	result.poured = 0;
+	result.settled = false;
+	result.over_budget = 0;
+	result.max_backlog = 0;
+	result.sand = 0;
+	result.conflicts = 0;
+	uint64_t rnd = 1;
+
+	vector<double> times;
+	uint64_t t = 2;
+	for(result.ticks=0; result.ticks<max_ticks; ++result.ticks, ++t)
+	{
+		//Top up the taps while the basin still needs water
+		for(int dz=0; dz<basin.tap; ++dz)
+		for(int dx=0; dx<basin.tap; ++dx)
+		{
+			int x = cx - basin.tap/2 + dx,
+				z = cz - basin.tap/2 + dz,
+				missing = FLUID_MAX_LEVEL - Fluid::level(game_map->get_block(x, ty, z));
+			missing = (int)min((int64_t)missing, basin.capacity() - result.poured);
+			if(missing <= 0)
+				continue;
+
+			int l = Fluid::level(game_map->get_block(x, ty, z));
+			game_map->set_block(Fluid::water(l + missing), t, x, ty, z);
+			fluid.ptr->wake(x, ty, z);
+			result.poured += missing;
+		}
+
+		//Sand falls through the air beside the taps while the basin fills, the physics runs alongside the water
+		if(physics.ptr != NULL)
+		{
+			for(int i=0; (t % 16) == 0 && result.poured < basin.capacity() && i<sand; ++i)
+			{
+				rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+				int x = basin.x0 + (int)((rnd >> 33) % (basin.x1 - basin.x0)),
+					z = basin.z0 + (int)((rnd >> 45) % (basin.z1 - basin.z0));
+				bool tap = abs(x - cx) <= basin.tap/2 && abs(z - cz) <= basin.tap/2;
+				if(tap || game_map->get_block(x, ty, z).type() != BlockType_Air)
+					continue;
+				game_map->set_block(Block(BlockType_Sand), t, x, ty, z);
+				physics.ptr->touch_block(Block(BlockType_Sand), x, ty, z);
+				++result.sand;
+			}
+			physics.ptr->tick(t);
+		}
+
+		auto start = tick_count::now();
+		fluid.ptr->tick(t);
+		double elapsed = (tick_count::now() - start).seconds();
+		times.push_back(elapsed);
+		if(elapsed > target)
+			++result.over_budget;
+		result.max_backlog = max(result.max_backlog, fluid.ptr->backlog());
+
+		if(result.poured == basin.capacity() && fluid.ptr->backlog() == 0)
+		{
+			result.settled = true;
+			++result.ticks;
+			break;
+		}
+	}
+
+	double total = 0.0;
+	for(int i=0; i<times.size(); ++i)
+		total += times[i];
+	sort(times.begin(), times.end());
+	result.mean_time = times.empty() ? 0.0 : total / times.size();
+	result.max_time = times.empty() ? 0.0 : times.back();
+	result.p99_time = times.empty() ? 0.0 : times[times.size() * 99 / 100];
+
+	//Let the last batch land before measuring
+	if(physics.ptr != NULL)
+	{
+		physics.ptr->flush();
+		result.conflicts = physics.ptr->conflicts();
+	}
+
+	result.volume = measure_volume(game_map, basin);
+	return result;
+}
+
+void print_result(const char* name, RunResult const& res)
+{
+	printf("%s: %s after %d ticks, largest backlog %d cells\n",
+		name, res.settled ? "settled" : "still flowing", res.ticks, res.max_backlog);
+	printf("    fluid time per tick: mean %.2f ms, p99 %.2f ms, max %.2f ms, %d ticks over the target\n",
+		res.mean_time * 1e3, res.p99_time * 1e3, res.max_time * 1e3, res.over_budget);
+	printf("    poured %ld units, %ld in the basin\n", res.poured, res.volume);
+	if(res.sand > 0)
+		printf("    dropped %d sand, %d physics commit conflicts\n", res.sand, res.conflicts);
+}
+
+void usage()
+{
+	printf("Usage: fluidbench [-c <chunks across>] [-d <depth>] [-p <tap size>] [-b <budget ms>] [-n <max ticks>]\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	int chunks = 4,
+		depth = 8,
+		tap = 8,
+		max_ticks = 20000;
+	double budget = 0.005;
+
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-c" && i+1 < argc)
+			chunks = atoi(argv[++i]);
+		else if(arg == "-d" && i+1 < argc)
+			depth = atoi(argv[++i]);
+		else if(arg == "-p" && i+1 < argc)
+			tap = atoi(argv[++i]);
+		else if(arg == "-b" && i+1 < argc)
+			budget = atof(argv[++i]) * 1e-3;
+		else if(arg == "-n" && i+1 < argc)
+			max_ticks = atoi(argv[++i]);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	//The basin fills a box of chunks two chunks high, with a one block wall and the taps near the top
+	Basin basin;
+	ChunkID c(PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z);
+	basin.lo = ChunkID(c.x - chunks/2, c.y, c.z - chunks/2);
+	basin.hi = ChunkID(basin.lo.x + chunks, c.y + 2, basin.lo.z + chunks);
+	basin.x0 = basin.lo.x * CHUNK_X + 1;
+	basin.x1 = basin.hi.x * CHUNK_X - 1;
+	basin.z0 = basin.lo.z * CHUNK_Z + 1;
+	basin.z1 = basin.hi.z * CHUNK_Z - 1;
+	basin.y0 = basin.lo.y * CHUNK_Y + 4;
+	basin.depth = min(depth, 2 * CHUNK_Y - 8);
+	basin.tap = min(tap, basin.x1 - basin.x0);
+
+	//Run against a scratch map with the default settings
+	bool ok = true;
+	{
+		ScratchMap scratch("/tmp/fluidbench");
+		if(!scratch.valid())
+			return 1;
+		auto config = scratch.config;
+		auto game_map = scratch.game_map;
+
+		printf("Filling a %d x %d basin %d blocks deep from %d x %d taps, %ld units\n",
+			basin.x1 - basin.x0, basin.z1 - basin.z0, basin.depth, basin.tap, basin.tap, basin.capacity());
+
+		int max_updates = config->readInt("fluid_max_updates");
+		auto budgeted = run(config, game_map, basin, budget, max_updates, budget, max_ticks, 0);
+		char name[64];
+		snprintf(name, sizeof(name), "Budget %.1f ms", budget * 1e3);
+		print_result(name, budgeted);
+
+		auto unlimited = run(config, game_map, basin, 1e9, INT_MAX, budget, max_ticks, 0);
+		print_result("No budget", unlimited);
+
+		auto sand = run(config, game_map, basin, budget, max_updates, budget, max_ticks, 16);
+		print_result("With falling sand", sand);
+
+		if(budgeted.volume != budgeted.poured || unlimited.volume != unlimited.poured || sand.volume != sand.poured)
+		{
+			printf("Water was lost or created!\n");
+			ok = false;
+		}
+		
+		if(!check_encoding(game_map, basin))
+			ok = false;
+	}
+
+	google::protobuf::ShutdownProtobufLibrary();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+//World generator benchmark and determinism check
+//
+// Usage:
+//	genbench [-r <radius>] [-t <max threads>] [-s]
+//
+// Generates a cube of chunks around the player start with the default generator settings (seed 0),
+// first on one thread and then on 2, 4, ... up to max threads.  Reports chunks per second, scaling
+// efficiency relative to the single threaded run and the compressed size of the output, and checks
+// a hash of the generated blocks against the golden value for the region.  With -s the scalar
+// reference generator is timed as well.
+//
+// Exits with status 1 if the output differs between runs or from the golden value, so it can be used
+// to check that a generator optimization is bit exact.  When the terrain is changed on purpose, update
+// GOLDEN_HASHES with the printed values.  The generator logs every chunk to stderr, redirect it when
+// timing.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <tbb/task_scheduler_init.h>
+#include <tbb/tick_count.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include "constants.h"
+#include "misc.h"
+#include "config.h"
+#include "chunk.h"
+#include "worldgen.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+//Expected output hashes for the default settings, by region radius
+struct GoldenHash
+{
+	int			radius;
+	uint64_t	hash;
+};
+
+static const GoldenHash GOLDEN_HASHES[] =
+{
+	{ 2, 0xdfa4071e1ae7dd1bULL },
+	{ 4, 0x5c53990c9d893426ULL },
+	{ 8, 0xc7b3ea2c1e193fa7ULL },
+};
+
+typedef void (WorldGen::*generator_t)(ChunkID const&, Block*, int, int);
+
+//FNV-1a over the blocks of a chunk
+uint64_t hash_chunk(Block const* buffer)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<CHUNK_SIZE; ++i)
+	{
+		uint32_t v = buffer[i].int_val;
+		for(int b=0; b<4; ++b)
+		{
+			h ^= (v >> (8*b)) & 0xff;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+//Combines the chunk hashes in region order, so the result does not depend on scheduling
+uint64_t combine_hashes(vector<uint64_t> const& hashes)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<hashes.size(); ++i)
+	{
+		h ^= hashes[i];
+		h *= 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+struct RunResult
+{
+	double		rate;
+	uint64_t	hash;
+	uint64_t	compressed_bytes;
+};
+
+//Generates every chunk in the list with the given number of threads
+RunResult run(WorldGen* world_gen, generator_t gen, vector<ChunkID> const& chunk_ids, int threads)
+{
+	task_scheduler_init init(threads);
+
+	vector<uint64_t> hashes(chunk_ids.size()), sizes(chunk_ids.size());
+
+	auto start = tick_count::now();
+	parallel_for(blocked_range<int>(0, chunk_ids.size(), 4), [&](blocked_range<int> rng)
+	{
+		Block buffer[CHUNK_SIZE];
+		for(auto n=rng.begin(); n!=rng.end(); ++n)
+		{
+			(world_gen->*gen)(chunk_ids[n], buffer, CHUNK_X, CHUNK_X * CHUNK_Z);
+			hashes[n] = hash_chunk(buffer);
+		}
+	});
+	double t = (tick_count::now() - start).seconds();
+
+	//Measure the compressed size outside the timed section
+	parallel_for(blocked_range<int>(0, chunk_ids.size(), 4), [&](blocked_range<int> rng)
+	{
+		Block buffer[CHUNK_SIZE];
+		for(auto n=rng.begin(); n!=rng.end(); ++n)
+		{
+			(world_gen->*gen)(chunk_ids[n], buffer, CHUNK_X, CHUNK_X * CHUNK_Z);
+
+			ChunkBuffer chunk;
+			chunk.compress_chunk(buffer, CHUNK_X, CHUNK_X * CHUNK_Z);
+			chunk.cache_protocol_buffer_data();
+			sizes[n] = chunk.encoded_size();
+		}
+	});
+
+	RunResult result;
+	result.rate = chunk_ids.size() / t;
+	result.hash = combine_hashes(hashes);
+	result.compressed_bytes = 0;
+	for(int i=0; i<sizes.size(); ++i)
+		result.compressed_bytes += sizes[i];
+	return result;
+}
+
+void usage()
+{
+	printf("Usage: genbench [-r <radius>] [-t <max threads>] [-s]\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	int r = 4,
+		max_threads = task_scheduler_init::default_num_threads();
+	bool scalar = false;
+
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-r" && i+1 < argc)
+			r = atoi(argv[++i]);
+		else if(arg == "-t" && i+1 < argc)
+			max_threads = atoi(argv[++i]);
+		else if(arg == "-s")
+			scalar = true;
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	vector<ChunkID> chunk_ids;
+	int c[3] = { PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z };
+	for(int y=c[1]-r; y<=c[1]+r; ++y)
+	for(int z=c[2]-r; z<=c[2]+r; ++z)
+	for(int x=c[0]-r; x<=c[0]+r; ++x)
+	{
+		chunk_ids.push_back(ChunkID(x, y, z));
+	}
+
+	//Use a fresh configuration so the generator runs with the default settings
+	char config_dir[] = "/tmp/genbenchXXXXXX";
+	if(mkdtemp(config_dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	string config_path = string(config_dir) + "/config.tch";
+
+	bool ok = true;
+	{
+		auto GC = ScopeDelete<Config>(new Config(config_path));
+		auto GW = ScopeDelete<WorldGen>(new WorldGen(GC.ptr));
+		auto world_gen = GW.ptr;
+
+		printf("Generating %d chunks, radius %d\n", (int)chunk_ids.size(), r);
+
+		auto base = run(world_gen, &WorldGen::generate_chunk, chunk_ids, 1);
+		printf("Compressed: %ld bytes total, %.1f bytes/chunk\n",
+			base.compressed_bytes, (double)base.compressed_bytes / chunk_ids.size());
+		printf("%3d threads: %9.1f chunks/s\n", 1, base.rate);
+
+		for(int n=2; n<=max_threads; n*=2)
+		{
+			auto res = run(world_gen, &WorldGen::generate_chunk, chunk_ids, n);
+			printf("%3d threads: %9.1f chunks/s, efficiency %.1f%%\n", n, res.rate, 100.0 * res.rate / (n * base.rate));
+
+			if(res.hash != base.hash)
+			{
+				printf("  Output differs from the single threaded run! %016lx\n", res.hash);
+				ok = false;
+			}
+		}
+
+		if(scalar)
+		{
+			auto res = run(world_gen, &WorldGen::generate_chunk_scalar, chunk_ids, 1);
+			printf("Scalar:      %9.1f chunks/s (batch speedup %.2fx)\n", res.rate, base.rate / res.rate);
+		}
+
+		//Compare with the golden value
+		printf("Hash: %016lx\n", base.hash);
+		bool found = false;
+		for(int i=0; i<sizeof(GOLDEN_HASHES)/sizeof(GoldenHash); ++i)
+		{
+			if(GOLDEN_HASHES[i].radius != r)
+				continue;
+
+			found = true;
+			if(GOLDEN_HASHES[i].hash == base.hash)
+			{
+				printf("Matches golden hash\n");
+			}
+			else
+			{
+				printf("Golden hash mismatch, expected %016lx\n", GOLDEN_HASHES[i].hash);
+				ok = false;
+			}
+		}
+
+		if(!found)
+			printf("No golden hash for radius %d\n", r);
+	}
+
+	unlink(config_path.c_str());
+	rmdir(config_dir);
+
+	google::protobuf::ShutdownProtobufLibrary();
+	return ok ? 0 : 1;
+}
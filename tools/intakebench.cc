@@ -0,0 +1,159 @@
+//Physics block intake stress test
+//
+// Usage:
+//	intakebench [-p <producers>] [-n <edits per producer>]
+//
+// Starts a number of editor threads which all push block writes as fast as they can while one consumer
+// drains them, the way the HTTP workers and the physics batch share Physics::set_block.  Runs once with
+// the lock free BlockIntake and once with a mutex protected vector for comparison, and reports edits per
+// second for each.  Checks that every write arrives exactly once and that each editor's writes arrive in
+// order, exits with status 1 if not.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include <tbb/atomic.h>
+#include <tbb/tick_count.h>
+#include <tbb/compat/thread>
+
+#include "constants.h"
+#include "misc.h"
+#include "chunk.h"
+#include "block_intake.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+//The baseline, a vector behind a lock
+struct LockedIntake
+{
+	pthread_mutex_t lock;
+	block_list_t records;
+	
+	LockedIntake() { pthread_mutex_init(&lock, NULL); }
+	~LockedIntake() { pthread_mutex_destroy(&lock); }
+	
+	void push(BlockRecord const& rec)
+	{
+		MutexLock L(&lock);
+		records.push_back(rec);
+	}
+	
+	void drain(block_list_t& out)
+	{
+		MutexLock L(&lock);
+		out.insert(out.end(), records.begin(), records.end());
+		records.clear();
+	}
+};
+
+template<typename Intake> struct Editor
+{
+	Intake* intake;
+	int id, edits;
+	tbb::atomic<int>* done;
+	
+	void operator()()
+	{
+		//Editor id in x, sequence number in t
+		for(int i=0; i<edits; ++i)
+			intake->push( (BlockRecord){ (uint64_t)i, id, ORIGIN_Y, ORIGIN_Z, Block(BlockType_Sand) } );
+		done->fetch_and_increment();
+	}
+};
+
+template<typename Intake> bool run(const char* name, int producers, int edits)
+{
+	Intake intake;
+	tbb::atomic<int> done;
+	done = 0;
+	
+	vector<int> next(producers, 0);
+	int64_t received = 0, expected = (int64_t)producers * edits;
+	bool ok = true;
+	
+	auto start = tick_count::now();
+	
+	vector<std::thread*> threads;
+	for(int i=0; i<producers; ++i)
+		threads.push_back(new std::thread((Editor<Intake>){ &intake, i, edits, &done }));
+	
+	//Drain until every editor has finished and the queue is empty
+	block_list_t batch;
+	while(true)
+	{
+		bool finished = done == producers;
+		
+		batch.clear();
+		intake.drain(batch);
+		for(int i=0; i<batch.size(); ++i)
+		{
+			int p = batch[i].x;
+			if(batch[i].t != next[p]++)
+				ok = false;
+		}
+		received += batch.size();
+		
+		if(finished && batch.size() == 0)
+			break;
+	}
+	
+	double t = (tick_count::now() - start).seconds();
+	
+	for(int i=0; i<producers; ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	
+	printf("%-10s %12.1f kedits/s\n", name, expected / t * 1e-3);
+	
+	if(received != expected)
+	{
+		printf("  Received %ld of %ld edits!\n", received, expected);
+		ok = false;
+	}
+	else if(!ok)
+	{
+		printf("  Edits arrived out of order!\n");
+	}
+	return ok;
+}
+
+void usage()
+{
+	printf("Usage: intakebench [-p <producers>] [-n <edits per producer>]\n");
+}
+
+int main(int argc, char** argv)
+{
+	int producers = 8,
+		edits = 1<<20;
+	
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-p" && i+1 < argc)
+			producers = atoi(argv[++i]);
+		else if(arg == "-n" && i+1 < argc)
+			edits = atoi(argv[++i]);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	
+	printf("%d editors, %d edits each\n", producers, edits);
+	
+	bool ok = run<BlockIntake>("lock free", producers, edits);
+	ok = run<LockedIntake>("locked", producers, edits) && ok;
+	
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+//Lighting benchmark
+//
+// Usage:
+//	lightbench [-r <radius>] [-e <edits per round>] [-n <rounds>] [-c <rounds between checks>] [-s <seed>]
+//
+// Lights the generated terrain within radius chunks (default 2) of the player start in a scratch map,
+// then runs the given number of rounds (default 200) of random edits (default 8 per round) near the
+// surface, relighting incrementally after each round.  Every few rounds (default 10) the light is checked
+// against a second lighting engine which lights the same chunks from scratch, and the chunk faces are
+// checked against the chunks they come from.  Finally the player moves away and the light must be dropped.
+// Reports the time per incremental relight and per full relight.  Exits with status 1 if any cell differs.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <tbb/tick_count.h>
+
+#include "constants.h"
+#include "misc.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "lighting.h"
+
+#include "scratch_map.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+//Deterministic generator for the edits
+struct EditRandom
+{
+	uint64_t state;
+
+	EditRandom(uint64_t seed) : state(seed) {}
+
+	int next(int n)
+	{
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (int)((state >> 33) % n);
+	}
+};
+
+//Index of a cell within its chunk
+static int cell_offset(int x, int y, int z)
+{
+	return x + z * CHUNK_X + y * CHUNK_X * CHUNK_Z;
+}
+
+//Compares the light of every chunk against a full relight, returns the number of cells which differ
+int check_light(Config* config, GameMap* game_map, Lighting* lighting, vector<ChunkID> const& observers,
+	vector<ChunkID> const& chunk_ids, double& full_time)
+{
+	auto start = tick_count::now();
+	auto GL = ScopeDelete<Lighting>(new Lighting(config, game_map));
+	GL.ptr->tick(observers);
+	full_time += (tick_count::now() - start).seconds();
+
+	uint8_t light[CHUNK_SIZE], expected[CHUNK_SIZE], face[CHUNK_X * CHUNK_X];
+	int bad = 0;
+	for(int i=0; i<chunk_ids.size(); ++i)
+	{
+		auto const& c = chunk_ids[i];
+		if(lighting->get_chunk_light(c, light) == 0 || GL.ptr->get_chunk_light(c, expected) == 0)
+		{
+			printf("Chunk %d,%d,%d was not lit\n", c.x, c.y, c.z);
+			++bad;
+			continue;
+		}
+
+		for(int j=0; j<CHUNK_SIZE; ++j)
+		{
+			if(light[j] == expected[j])
+				continue;
+			if(bad < 8)
+			{
+				printf("Chunk %d,%d,%d cell %d: block light %d, skylight %d, full relight gives %d, %d\n",
+					c.x, c.y, c.z, j,
+					Lighting::block_light(light[j]), Lighting::sky_light(light[j]),
+					Lighting::block_light(expected[j]), Lighting::sky_light(expected[j]));
+			}
+			++bad;
+		}
+
+		//The faces are the outer layers of the chunk
+		for(int f=0; f<6; ++f)
+		{
+			lighting->get_boundary(c, f, face);
+			for(int v=0; v<CHUNK_X; ++v)
+			for(int u=0; u<CHUNK_X; ++u)
+			{
+				int x = u, y = v, z = v;
+				if(LIGHT_NEIGHBORS[f][0] != 0)
+				{
+					x = LIGHT_NEIGHBORS[f][0] < 0 ? 0 : CHUNK_X-1;
+					y = u;
+				}
+				else if(LIGHT_NEIGHBORS[f][1] != 0)
+					y = LIGHT_NEIGHBORS[f][1] < 0 ? 0 : CHUNK_Y-1;
+				else
+					z = LIGHT_NEIGHBORS[f][2] < 0 ? 0 : CHUNK_Z-1;
+
+				if(face[u + v * CHUNK_X] != light[cell_offset(x, y, z)])
+				{
+					if(bad < 8)
+						printf("Chunk %d,%d,%d face %d differs from the chunk\n", c.x, c.y, c.z, f);
+					++bad;
+				}
+			}
+		}
+	}
+	return bad;
+}
+
+void usage()
+{
+	printf("Usage: lightbench [-r <radius>] [-e <edits per round>] [-n <rounds>] [-c <rounds between checks>] [-s <seed>]\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	int radius = 2,
+		edits = 8,
+		rounds = 200,
+		check_interval = 10,
+		seed = 1;
+
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-r" && i+1 < argc)
+			radius = atoi(argv[++i]);
+		else if(arg == "-e" && i+1 < argc)
+			edits = atoi(argv[++i]);
+		else if(arg == "-n" && i+1 < argc)
+			rounds = atoi(argv[++i]);
+		else if(arg == "-c" && i+1 < argc)
+			check_interval = max(atoi(argv[++i]), 1);
+		else if(arg == "-s" && i+1 < argc)
+			seed = atoi(argv[++i]);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	//Run against a scratch map with the default settings
+	bool ok = true;
+	{
+		ScratchMap scratch("/tmp/lightbench");
+		if(!scratch.valid())
+			return 1;
+		auto config = scratch.config;
+		auto game_map = scratch.game_map;
+		config->storeInt("lighting_radius", radius);
+		config->storeInt("lighting_max_chunks", 1<<30);
+
+		//The player stands on the surface at the start
+		int px = PLAYER_START_X,
+			pz = PLAYER_START_Z,
+			py = game_map->generated_column_top(px, pz);
+		vector<ChunkID> observers(1, ChunkID(px / CHUNK_X, py / CHUNK_Y, pz / CHUNK_Z));
+		auto o = observers[0];
+
+		//Generate the chunks in range, the lighting only uses chunks which are in memory
+		vector<ChunkID> chunk_ids;
+		Block buffer[CHUNK_SIZE];
+		for(int dy=-radius; dy<=radius; ++dy)
+		for(int dz=-radius; dz<=radius; ++dz)
+		for(int dx=-radius; dx<=radius; ++dx)
+		{
+			ChunkID c(o.x + dx, o.y + dy, o.z + dz);
+			game_map->get_chunk(c, buffer);
+			chunk_ids.push_back(c);
+		}
+
+		printf("Lighting %d chunks around %d,%d,%d, %d rounds of %d edits\n",
+			(int)chunk_ids.size(), px, py, pz, rounds, edits);
+
+		auto GL = ScopeDelete<Lighting>(new Lighting(config, game_map));
+		auto lighting = GL.ptr;
+		lighting->tick(observers);
+
+		double full_time = 0.0;
+		int checks = 0, bad = check_light(config, game_map, lighting, observers, chunk_ids, full_time);
+		++checks;
+
+		//Dig and build within a few blocks of the surface
+		int span = (2 * radius + 1) * CHUNK_X,
+			x0 = (o.x - radius) * CHUNK_X,
+			z0 = (o.z - radius) * CHUNK_Z,
+			y_lo = (o.y - radius) * CHUNK_Y,
+			y_hi = (o.y + radius + 1) * CHUNK_Y;
+		EditRandom rnd(seed);
+		double relight_time = 0.0, relight_max = 0.0;
+		uint64_t t = 2;
+		int r = 0;
+		for(; r<rounds && bad == 0; ++r, ++t)
+		{
+			for(int i=0; i<edits; ++i)
+			{
+				int x = x0 + rnd.next(span),
+					z = z0 + rnd.next(span),
+					y = game_map->column_top(x, z) + rnd.next(17) - 8;
+				if(y < y_lo || y >= y_hi)
+					continue;
+				game_map->set_block(rnd.next(2) ? Block(BlockType_Stone) : Block(BlockType_Air), t, x, y, z);
+			}
+
+			auto start = tick_count::now();
+			lighting->tick(observers);
+			double elapsed = (tick_count::now() - start).seconds();
+			relight_time += elapsed;
+			relight_max = max(relight_max, elapsed);
+
+			if((r + 1) % check_interval == 0 || r + 1 == rounds)
+			{
+				bad += check_light(config, game_map, lighting, observers, chunk_ids, full_time);
+				++checks;
+			}
+		}
+
+		printf("Incremental relight: mean %.3f ms, max %.3f ms\n",
+			r > 0 ? 1e3 * relight_time / r : 0.0, 1e3 * relight_max);
+		printf("Full relight: mean %.3f ms over %d checks\n", 1e3 * full_time / checks, checks);
+
+		if(bad > 0)
+		{
+			printf("Incremental light differs from a full relight in %d cells!\n", bad);
+			ok = false;
+		}
+
+		//Once the player is far away nothing is kept
+		vector<ChunkID> away(1, ChunkID(o.x + 2 * radius + 4, o.y, o.z));
+		lighting->tick(away);
+		uint8_t light[CHUNK_SIZE];
+		for(int i=0; i<chunk_ids.size(); ++i)
+		{
+			if(lighting->get_chunk_light(chunk_ids[i], light) != 0)
+			{
+				printf("Light was kept after the player left!\n");
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	google::protobuf::ShutdownProtobufLibrary();
+	return ok ? 0 : 1;
+}
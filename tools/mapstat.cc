@@ -0,0 +1,463 @@
+//Offline map database analyzer and converter
+//
+// Usage:
+//	mapstat stats <map db>								Prints statistics about the chunks in a map database
+//	mapstat convert <src db> <dst db> [<options>]		Re-encodes every chunk into a new database
+//
+// Convert options:
+//	-c none|deflate|bzip|tcbs		Record compression for the destination (default: deflate)
+//	-b <buckets>					Number of hash buckets for the destination (default: 2x record count)
+//	-s								The databases contain surface chunks instead of raw chunks
+//
+// Records are read sequentially from tokyo cabinet, then parsed, analyzed and re-encoded in parallel.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <tcutil.h>
+#include <tchdb.h>
+
+#include <tbb/task_scheduler_init.h>
+#include <tbb/tick_count.h>
+#include <tbb/pipeline.h>
+#include <tbb/combinable.h>
+
+#include "network.pb.h"
+#include "map.pb.h"
+
+#include "constants.h"
+#include "misc.h"
+#include "chunk.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+//Number of records handed to a pipeline token
+#define BATCH_SIZE		256
+
+//Number of log2 buckets in the histograms
+#define HIST_BUCKETS	16
+
+//A batch of raw records read from the database
+struct RecordBatch
+{
+	vector<string>	keys, values;
+};
+
+//Reads batches of chunk records from a database, call from a serial stage only.  Keys which are not a
+//chunk id, like the map image stamp, are counted in skipped and left out.
+struct RecordReader
+{
+	TCHDB* db;
+	TCXSTR *key, *value;
+	uint64_t skipped;
+	
+	RecordReader(TCHDB* db_) : db(db_), key(tcxstrnew()), value(tcxstrnew()), skipped(0)
+	{
+		tchdbiterinit(db);
+	}
+	
+	~RecordReader()
+	{
+		tcxstrdel(key);
+		tcxstrdel(value);
+	}
+	
+	RecordBatch* next()
+	{
+		auto batch = new RecordBatch();
+		while(batch->keys.size() < BATCH_SIZE && tchdbiternext3(db, key, value))
+		{
+			if(tcxstrsize(key) != 3*sizeof(uint32_t))
+			{
+				++skipped;
+				continue;
+			}
+			batch->keys.push_back(string((const char*)tcxstrptr(key), tcxstrsize(key)));
+			batch->values.push_back(string((const char*)tcxstrptr(value), tcxstrsize(value)));
+		}
+		
+		if(batch->keys.size() == 0)
+		{
+			delete batch;
+			return NULL;
+		}
+		return batch;
+	}
+};
+
+//Per thread statistics
+struct MapStats
+{
+	uint64_t chunks, bad_records, uniform, total_runs, total_bytes;
+	uint64_t max_runs, max_bytes;
+	uint64_t run_hist[HIST_BUCKETS], size_hist[HIST_BUCKETS];
+	uint64_t block_count[256];
+	
+	MapStats()
+	{
+		memset(this, 0, sizeof(MapStats));
+	}
+	
+	void merge(MapStats const& other)
+	{
+		chunks		+= other.chunks;
+		bad_records	+= other.bad_records;
+		uniform		+= other.uniform;
+		total_runs	+= other.total_runs;
+		total_bytes	+= other.total_bytes;
+		max_runs	= max(max_runs, other.max_runs);
+		max_bytes	= max(max_bytes, other.max_bytes);
+		for(int i=0; i<HIST_BUCKETS; ++i)
+		{
+			run_hist[i]  += other.run_hist[i];
+			size_hist[i] += other.size_hist[i];
+		}
+		for(int i=0; i<256; ++i)
+			block_count[i] += other.block_count[i];
+	}
+};
+
+//Returns the log2 histogram bucket for a value
+int hist_bucket(uint64_t v)
+{
+	int b = 0;
+	while(v > 1 && b < HIST_BUCKETS-1)
+	{
+		v >>= 1;
+		++b;
+	}
+	return b;
+}
+
+void print_histogram(const char* title, uint64_t const* hist, uint64_t total)
+{
+	printf("%s\n", title);
+	for(int i=0; i<HIST_BUCKETS; ++i)
+	{
+		if(hist[i] == 0)
+			continue;
+		printf("  [%6d, %6d)  %10ld  %6.2f%%\n", 1<<i, 2<<i, hist[i], 100.0 * hist[i] / total);
+	}
+}
+
+//Name of a block type
+const char* block_name(int t)
+{
+	static const char* names[] =
+	{
+		"Air",
+		"Stone",
+		"Dirt",
+		"Grass",
+		"Cobblestone",
+		"Wood",
+		"Log",
+		"Water",
+		"Sand"
+	};
+	
+	if(t < sizeof(names) / sizeof(names[0]))
+		return names[t];
+	return "Unknown";
+}
+
+//Prints statistics about a map database
+int run_stats(const char* path)
+{
+	TCHDB* db = tchdbnew();
+	if(!tchdbopen(db, path, HDBOREADER | HDBONOLCK))
+	{
+		printf("Could not open %s: %s\n", path, tchdberrmsg(tchdbecode(db)));
+		tchdbdel(db);
+		return 1;
+	}
+	
+	auto start = tick_count::now();
+	
+	RecordReader reader(db);
+	combinable<MapStats> local_stats;
+	
+	parallel_pipeline(task_scheduler_init::default_num_threads() * 4,
+		make_filter<void, RecordBatch*>(filter::serial_in_order,
+			[&](flow_control& fc) -> RecordBatch*
+		{
+			auto batch = reader.next();
+			if(batch == NULL)
+				fc.stop();
+			return batch;
+		}) &
+		make_filter<RecordBatch*, void>(filter::parallel,
+			[&](RecordBatch* batch)
+		{
+			auto& stats = local_stats.local();
+			
+			for(int i=0; i<batch->values.size(); ++i)
+			{
+				Network::Chunk pbuffer;
+				if(!pbuffer.ParseFromString(batch->values[i]) || !pbuffer.has_data())
+				{
+					stats.bad_records++;
+					continue;
+				}
+				
+				ChunkBuffer chunk;
+				chunk.parse_from_protocol_buffer(pbuffer);
+				auto tree = chunk.interval_tree();
+				
+				uint64_t runs = tree.size(),
+						 bytes = pbuffer.data().size();
+				
+				stats.chunks++;
+				stats.total_runs += runs;
+				stats.total_bytes += bytes;
+				stats.max_runs = max(stats.max_runs, runs);
+				stats.max_bytes = max(stats.max_bytes, bytes);
+				stats.run_hist[hist_bucket(runs)]++;
+				stats.size_hist[hist_bucket(bytes)]++;
+				if(runs == 1)
+					stats.uniform++;
+				
+				//Count voxels by type
+				for(auto iter = tree.begin(); iter != tree.end(); )
+				{
+					int left = iter->first;
+					int type = iter->second.type();
+					int right = (++iter == tree.end()) ? CHUNK_SIZE : iter->first;
+					stats.block_count[type] += right - left;
+				}
+			}
+			
+			delete batch;
+		}));
+	
+	MapStats stats;
+	local_stats.combine_each([&](MapStats const& s) { stats.merge(s); });
+	
+	double t = (tick_count::now() - start).seconds();
+	
+	tchdbclose(db);
+	tchdbdel(db);
+	
+	//Print report
+	printf("Database:         %s\n", path);
+	printf("Scan time:        %.2f s (%.1f chunks/s)\n", t, stats.chunks / t);
+	printf("Chunks:           %ld\n", stats.chunks);
+	printf("Bad records:      %ld\n", stats.bad_records);
+	printf("Other records:    %ld\n", reader.skipped);
+	
+	if(stats.chunks == 0)
+		return 0;
+	
+	printf("Uniform chunks:   %ld (%.2f%%)\n", stats.uniform, 100.0 * stats.uniform / stats.chunks);
+	printf("Runs per chunk:   mean %.2f, max %ld\n", (double)stats.total_runs / stats.chunks, stats.max_runs);
+	printf("Encoded size:     mean %.2f B, max %ld B, total %ld B\n", 
+		(double)stats.total_bytes / stats.chunks, stats.max_bytes, stats.total_bytes);
+	
+	print_histogram("Run count histogram:", stats.run_hist, stats.chunks);
+	print_histogram("Encoded size histogram (bytes):", stats.size_hist, stats.chunks);
+	
+	uint64_t voxels = stats.chunks * CHUNK_SIZE;
+	printf("Block type frequencies:\n");
+	for(int i=0; i<256; ++i)
+	{
+		if(stats.block_count[i] == 0)
+			continue;
+		printf("  %-12s  %14ld  %6.2f%%\n", block_name(i), stats.block_count[i], 100.0 * stats.block_count[i] / voxels);
+	}
+	
+	return 0;
+}
+
+//Re-encodes a chunk record, returns false if the record is not valid
+bool reencode_chunk(Network::Chunk& pbuffer)
+{
+	if(!pbuffer.has_data())
+		return false;
+
+	//Round trip through the decompressed form, this also merges any redundant runs
+	Block buffer[CHUNK_SIZE];
+	ChunkBuffer chunk;
+	chunk.parse_from_protocol_buffer(pbuffer);
+	chunk.decompress_chunk(buffer);
+	chunk.compress_chunk(buffer);
+	chunk.set_last_modified(pbuffer.last_modified());
+	chunk.cache_protocol_buffer_data();
+	return chunk.serialize_to_protocol_buffer(pbuffer);
+}
+
+//Converts a map database
+int run_convert(const char* src_path, const char* dst_path, string const& compression, int64_t buckets, bool surface)
+{
+	uint8_t opts = HDBTLARGE;
+	if(compression == "deflate")
+		opts |= HDBTDEFLATE;
+	else if(compression == "bzip")
+		opts |= HDBTBZIP;
+	else if(compression == "tcbs")
+		opts |= HDBTTCBS;
+	else if(compression != "none")
+	{
+		printf("Unknown compression: %s\n", compression.c_str());
+		return 1;
+	}
+
+	TCHDB* src = tchdbnew();
+	if(!tchdbopen(src, src_path, HDBOREADER | HDBONOLCK))
+	{
+		printf("Could not open %s: %s\n", src_path, tchdberrmsg(tchdbecode(src)));
+		tchdbdel(src);
+		return 1;
+	}
+	
+	if(buckets <= 0)
+		buckets = max((int64_t)(1<<16), (int64_t)tchdbrnum(src) * 2);
+	
+	TCHDB* dst = tchdbnew();
+	tchdbtune(dst, buckets, 4, 10, opts);
+	if(!tchdbopen(dst, dst_path, HDBOWRITER | HDBOCREAT | HDBOTRUNC))
+	{
+		printf("Could not open %s: %s\n", dst_path, tchdberrmsg(tchdbecode(dst)));
+		tchdbclose(src);
+		tchdbdel(src);
+		tchdbdel(dst);
+		return 1;
+	}
+	
+	auto start = tick_count::now();
+	
+	RecordReader reader(src);
+	uint64_t converted = 0, dropped = 0, bytes_in = 0, bytes_out = 0;
+	
+	parallel_pipeline(task_scheduler_init::default_num_threads() * 4,
+		make_filter<void, RecordBatch*>(filter::serial_in_order,
+			[&](flow_control& fc) -> RecordBatch*
+		{
+			auto batch = reader.next();
+			if(batch == NULL)
+				fc.stop();
+			return batch;
+		}) &
+		make_filter<RecordBatch*, RecordBatch*>(filter::parallel,
+			[&](RecordBatch* batch) -> RecordBatch*
+		{
+			for(int i=0; i<batch->values.size(); ++i)
+			{
+				bool ok;
+				string out;
+				if(surface)
+				{
+					Map::SurfaceChunk record;
+					ok = record.ParseFromString(batch->values[i]) &&
+						 reencode_chunk(*record.mutable_chunk()) &&
+						 record.SerializeToString(&out);
+				}
+				else
+				{
+					Network::Chunk record;
+					ok = record.ParseFromString(batch->values[i]) &&
+						 reencode_chunk(record) &&
+						 record.SerializeToString(&out);
+				}
+				
+				//Empty values mark records that could not be converted
+				if(!ok)
+					out.clear();
+				batch->values[i].swap(out);
+			}
+			return batch;
+		}) &
+		make_filter<RecordBatch*, void>(filter::serial_out_of_order,
+			[&](RecordBatch* batch)
+		{
+			for(int i=0; i<batch->keys.size(); ++i)
+			{
+				if(batch->values[i].size() == 0)
+				{
+					++dropped;
+					continue;
+				}
+				
+				tchdbput(dst,
+					batch->keys[i].data(), batch->keys[i].size(),
+					batch->values[i].data(), batch->values[i].size());
+				bytes_out += batch->values[i].size();
+				++converted;
+			}
+			delete batch;
+		}));
+	
+	double t = (tick_count::now() - start).seconds();
+	bytes_in = tchdbfsiz(src);
+	tchdbsync(dst);
+	bytes_out = tchdbfsiz(dst);
+	
+	//The image stamp is not copied, the converted map rebuilds its image on the first start
+	printf("Converted %ld records (%ld dropped, %ld skipped) in %.2f s (%.1f records/s)\n",
+		converted, dropped, reader.skipped, t, converted / t);
+	printf("File size: %ld B -> %ld B\n", bytes_in, bytes_out);
+	
+	tchdbclose(src);
+	tchdbdel(src);
+	tchdbclose(dst);
+	tchdbdel(dst);
+	return 0;
+}
+
+void usage()
+{
+	printf("Usage:\n");
+	printf("  mapstat stats <map db>\n");
+	printf("  mapstat convert <src db> <dst db> [-c none|deflate|bzip|tcbs] [-b <buckets>] [-s]\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+	
+	task_scheduler_init init;
+	
+	int result = 1;
+	
+	if(argc == 3 && string(argv[1]) == "stats")
+	{
+		result = run_stats(argv[2]);
+	}
+	else if(argc >= 4 && string(argv[1]) == "convert")
+	{
+		string compression = "deflate";
+		int64_t buckets = 0;
+		bool surface = false;
+		
+		for(int i=4; i<argc; ++i)
+		{
+			string arg(argv[i]);
+			if(arg == "-c" && i+1 < argc)
+				compression = argv[++i];
+			else if(arg == "-b" && i+1 < argc)
+				buckets = atoll(argv[++i]);
+			else if(arg == "-s")
+				surface = true;
+			else
+			{
+				usage();
+				return 1;
+			}
+		}
+		
+		result = run_convert(argv[2], argv[3], compression, buckets, surface);
+	}
+	else
+	{
+		usage();
+	}
+	
+	google::protobuf::ShutdownProtobufLibrary();
+	return result;
+}
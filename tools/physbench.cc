@@ -0,0 +1,155 @@
+//Physics kernel benchmark
+//
+// Usage:
+//	physbench [-c <chunks>] [-n <steps>] [-d <sand density>]
+//
+// Fills a vertical stack of chunks with random sand, air and stone, then steps it with the scalar
+// kernel (Physics::update_chunk) and with the bitplane kernel (step_planes) on one thread.  Reports
+// voxel updates per second for each, with the bitplane time both for stepping alone and including
+// the conversion to and from blocks.  The two results must match cell for cell, exits with status 1
+// if they do not.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <tbb/tick_count.h>
+
+#include "constants.h"
+#include "misc.h"
+#include "chunk.h"
+#include "bitplane.h"
+#include "physics.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+void usage()
+{
+	printf("Usage: physbench [-c <chunks>] [-n <steps>] [-d <sand density>]\n");
+}
+
+int main(int argc, char** argv)
+{
+	int num_chunks = 8,
+		steps = 256;
+	double density = 0.3;
+	
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-c" && i+1 < argc)
+			num_chunks = atoi(argv[++i]);
+		else if(arg == "-n" && i+1 < argc)
+			steps = atoi(argv[++i]);
+		else if(arg == "-d" && i+1 < argc)
+			density = atof(argv[++i]);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	
+	//A column of chunks with a constant chunk above and below, plus the row of padding the kernels read past the ends
+	const int stride_x = CHUNK_X,
+			  stride_xz = CHUNK_X * CHUNK_Z;
+	int layers = (num_chunks + 2) * CHUNK_Y + 2,
+		size = layers * stride_xz;
+	
+	vector<Block> initial(size);
+	srand(1);
+	for(int i=0; i<size; ++i)
+	{
+		double r = (double)rand() / RAND_MAX;
+		if(r < density)
+			initial[i] = Block(BlockType_Sand);
+		else if(r < density + 0.1)
+			initial[i] = Block(BlockType_Stone);
+		else
+			initial[i] = Block(BlockType_Air);
+	}
+	
+	//Offset of the first cell of chunk i, chunk 0 is the constant one below the column
+	auto chunk_offset = [&](int i) { return (i * CHUNK_Y + 1) * stride_xz; };
+	
+	uint64_t voxel_updates = (uint64_t)num_chunks * CHUNK_SIZE * steps;
+	printf("Stepping %d chunks x %d steps, sand density %.2f\n", num_chunks, steps, density);
+	
+	//Scalar kernel
+	vector<Block> front(initial), back(initial);
+	auto start = tick_count::now();
+	for(int t=0; t<steps; ++t)
+	{
+		for(int i=1; i<=num_chunks; ++i)
+		{
+			Physics::update_chunk(
+				&back[chunk_offset(i)],
+				&front[chunk_offset(i)],
+				stride_x,
+				stride_xz);
+		}
+		front.swap(back);
+	}
+	double scalar_time = (tick_count::now() - start).seconds();
+	printf("Scalar:   %12.1f Mvoxel updates/s\n", voxel_updates / scalar_time * 1e-6);
+	
+	//Bitplane kernel
+	vector<Block> result(initial);
+	vector<ChunkPlanes> front_planes(num_chunks + 2), back_planes(num_chunks + 2);
+	vector<uint64_t> touched(PLANE_WORDS * (num_chunks + 2), 0);
+	
+	start = tick_count::now();
+	for(int i=0; i<num_chunks+2; ++i)
+	{
+		front_planes[i].load(&result[chunk_offset(i)], stride_x, stride_xz);
+		back_planes[i] = front_planes[i];
+	}
+	auto step_start = tick_count::now();
+	for(int t=0; t<steps; ++t)
+	{
+		for(int i=1; i<=num_chunks; ++i)
+		{
+			step_planes(
+				back_planes[i],
+				front_planes[i],
+				front_planes[i+1],
+				front_planes[i-1],
+				&touched[PLANE_WORDS * i]);
+		}
+		front_planes.swap(back_planes);
+	}
+	auto step_end = tick_count::now();
+	for(int i=1; i<=num_chunks; ++i)
+	{
+		front_planes[i].store(&touched[PLANE_WORDS * i], &result[chunk_offset(i)], stride_x, stride_xz);
+	}
+	double bitplane_time = (tick_count::now() - start).seconds(),
+		   step_time = (step_end - step_start).seconds();
+	
+	printf("Bitplane: %12.1f Mvoxel updates/s stepping, %.1f including conversion (%.1fx scalar)\n",
+		voxel_updates / step_time * 1e-6,
+		voxel_updates / bitplane_time * 1e-6,
+		scalar_time / bitplane_time);
+	
+	//Compare the results
+	int mismatches = 0;
+	for(int i=0; i<size; ++i)
+	{
+		if(result[i] != front[i])
+			++mismatches;
+	}
+	
+	if(mismatches > 0)
+	{
+		printf("Kernels disagree on %d cells!\n", mismatches);
+		return 1;
+	}
+	
+	printf("Kernels agree\n");
+	return 0;
+}
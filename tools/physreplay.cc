@@ -0,0 +1,426 @@
+//Physics record and replay benchmark
+//
+// Usage:
+//	physreplay [-t <max threads>] [-x <extra batches>] <recording>
+//	physreplay [-t <max threads>] [-x <extra batches>] [-o <file>] -s <avalanche | building | columns>
+//
+// Replays a capture made with the server console command "physrec" against a scratch copy of the
+// recorded box of chunks, first on one thread and then on 2, 4, ... up to max threads.  Every batch
+// picks up the same writes it did on the server and is committed before the next one starts, then
+// the extra batches (default 8) let the remaining activity play out.  Reports simulated ticks per
+// second, scaling efficiency and the thread time spent decompressing chunks, stepping, writing back
+// and invalidating surfaces.
+//
+// With -s a synthetic scenario is replayed instead:
+//	avalanche	a box of chunks half full of loose sand over a stone floor, all of it awake
+//	building	players placing stone walls and dropping sand into an empty box every batch
+//	columns		sand columns with a gap near the bottom of each, the gaps rise into the chunk above
+//				during the first, dense batch and the later batches only step the chunks they reached
+// -o writes the synthetic recording out so it can be replayed later.
+//
+// Chunks outside the box are generated with the default settings, the ring next to the box is
+// restored before each run.  Exits with status 1 if the final state differs between thread counts, or
+// if a recording without writes ends up with more or less sand in the box than it started with.
+// The physics logs every batch to stderr, redirect it when timing.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <tbb/task_scheduler_init.h>
+#include <tbb/tick_count.h>
+
+#include "constants.h"
+#include "misc.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "physics.h"
+#include "physics_recording.h"
+
+#include "scratch_map.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+//Deterministic generator for the scenarios
+struct ScenarioRandom
+{
+	uint64_t state;
+
+	ScenarioRandom(uint64_t seed) : state(seed) {}
+
+	int next(int n)
+	{
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (int)((state >> 33) % n);
+	}
+};
+
+//Fills a box of chunks with stone below floor_y and calls fill for every cell above it
+template<typename F> void build_box(PhysicsRecording& rec, ChunkID const& lo, ChunkID const& hi, int floor_y, F fill)
+{
+	rec.lo = lo;
+	rec.hi = hi;
+	for(int y=lo.y; y<hi.y; ++y)
+	for(int z=lo.z; z<hi.z; ++z)
+	for(int x=lo.x; x<hi.x; ++x)
+	{
+		rec.chunk_ids.push_back(ChunkID(x, y, z));
+	}
+
+	rec.blocks.resize(rec.chunk_ids.size() * CHUNK_SIZE);
+	for(int i=0; i<rec.chunk_ids.size(); ++i)
+	{
+		auto c = rec.chunk_ids[i];
+		Block* data = rec.chunk(i);
+		for(int y=0; y<CHUNK_Y; ++y)
+		for(int z=0; z<CHUNK_Z; ++z)
+		for(int x=0; x<CHUNK_X; ++x)
+		{
+			int wx = c.x * CHUNK_X + x,
+				wy = c.y * CHUNK_Y + y,
+				wz = c.z * CHUNK_Z + z;
+			data[x + z * CHUNK_X + y * CHUNK_X * CHUNK_Z] =
+				wy < floor_y ? Block(BlockType_Stone) : fill(wx, wy, wz);
+		}
+	}
+}
+
+//Loose sand filling the upper half of the box, all of it falls at once
+void make_avalanche(PhysicsRecording& rec)
+{
+	ChunkID c(PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z);
+	ChunkID lo(c.x - 2, c.y, c.z - 2), hi(c.x + 2, c.y + 4, c.z + 2);
+	int floor_y = lo.y * CHUNK_Y + 4,
+		sand_y = lo.y * CHUNK_Y + 2 * CHUNK_Y;
+
+	ScenarioRandom rnd(1);
+	build_box(rec, lo, hi, floor_y, [&](int x, int y, int z)
+	{
+		return y >= sand_y && rnd.next(2) ? Block(BlockType_Sand) : Block(BlockType_Air);
+	});
+
+	rec.active = rec.chunk_ids;
+	rec.start_tick = 1024;
+	for(int i=0; i<8; ++i)
+		rec.add_events(rec.start_tick + 16 * i, 0);
+	rec.end_tick = rec.start_tick + 16 * 8;
+}
+
+//Players building in an empty box, walls of stone with sand dropped from the top
+void make_building(PhysicsRecording& rec)
+{
+	ChunkID c(PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z);
+	ChunkID lo(c.x - 2, c.y, c.z - 2), hi(c.x + 2, c.y + 2, c.z + 2);
+	int floor_y = lo.y * CHUNK_Y + 4;
+
+	build_box(rec, lo, hi, floor_y, [&](int x, int y, int z) { return Block(BlockType_Air); });
+
+	int sx = (hi.x - lo.x) * CHUNK_X,
+		sy = (hi.y - lo.y) * CHUNK_Y,
+		sz = (hi.z - lo.z) * CHUNK_Z;
+
+	ScenarioRandom rnd(2);
+	rec.start_tick = 1024;
+	for(int b=0; b<32; ++b)
+	{
+		uint64_t base = rec.start_tick + 16 * b;
+		for(int i=0; i<512; ++i)
+		{
+			BlockRecord w;
+			w.t = base + rnd.next(16);
+			w.x = lo.x * CHUNK_X + rnd.next(sx);
+			w.z = lo.z * CHUNK_Z + rnd.next(sz);
+			if(rnd.next(4))
+			{
+				//Walls rise from the floor
+				w.y = floor_y + rnd.next(sy - (floor_y - lo.y * CHUNK_Y));
+				w.b = Block(BlockType_Stone);
+			}
+			else
+			{
+				w.y = lo.y * CHUNK_Y + sy - 1 - rnd.next(4);
+				w.b = Block(BlockType_Sand);
+			}
+			rec.events.push_back(w);
+		}
+		rec.add_events(base, 512);
+	}
+	rec.end_tick = rec.start_tick + 16 * 32;
+}
+
+//Sand columns over a stone floor, each with a one block gap at a different height in the bottom chunk.
+//The first batch steps the whole box densely and ends with the gaps in the chunk above, just below
+//chunks which have not changed, so the next batches step a few marked chunks and their borders sparsely.
+void make_columns(PhysicsRecording& rec)
+{
+	ChunkID c(PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z);
+	ChunkID lo(c.x - 1, c.y, c.z - 1), hi(c.x + 1, c.y + 4, c.z + 1);
+	int floor_y = lo.y * CHUNK_Y + 1,
+		top_y = lo.y * CHUNK_Y + 3 * CHUNK_Y;
+
+	build_box(rec, lo, hi, floor_y, [&](int x, int y, int z)
+	{
+		//One column every other block, the gap heights cycle through the bottom chunk
+		if((x & 1) || (z & 1) || y >= top_y)
+			return Block(BlockType_Air);
+		int gap = floor_y + 1 + ((x >> 1) + 3 * (z >> 1)) % (CHUNK_Y - 2);
+		return y == gap ? Block(BlockType_Air) : Block(BlockType_Sand);
+	});
+
+	rec.active = rec.chunk_ids;
+	rec.start_tick = 1024;
+	for(int i=0; i<4; ++i)
+		rec.add_events(rec.start_tick + 16 * i, 0);
+	rec.end_tick = rec.start_tick + 16 * 4;
+}
+
+//Counts the sand in a list of chunks
+int64_t count_sand(Block const* blocks, int n)
+{
+	int64_t count = 0;
+	for(int i=0; i<n; ++i)
+	{
+		if(blocks[i].type() == BlockType_Sand)
+			++count;
+	}
+	return count;
+}
+
+//FNV-1a over the blocks of a list of chunks
+uint64_t hash_chunks(GameMap* game_map, vector<ChunkID> const& chunk_ids)
+{
+	Block buffer[CHUNK_SIZE];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<chunk_ids.size(); ++i)
+	{
+		game_map->get_chunk(chunk_ids[i], buffer);
+		for(int j=0; j<CHUNK_SIZE; ++j)
+		{
+			h ^= buffer[j].int_val;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+struct RunResult
+{
+	double		ticks_per_second;
+	double		batch_time;
+	double		phase[Physics::Phase_Count];
+	uint64_t	hash;
+	int64_t		sand;
+};
+
+//Replays the recording with the given number of threads, starting from the saved chunks
+RunResult run(
+	Config* config,
+	GameMap* game_map,
+	PhysicsRecording const& rec,
+	vector<ChunkID> const& ring_ids,
+	vector<Block> const& ring,
+	int extra,
+	int threads)
+{
+	task_scheduler_init init(threads);
+
+	//Restore the box and the ring around it
+	for(int i=0; i<rec.chunk_ids.size(); ++i)
+		game_map->update_chunk(rec.chunk_ids[i], rec.start_tick, (Block*)rec.chunk(i));
+	for(int i=0; i<ring_ids.size(); ++i)
+		game_map->update_chunk(ring_ids[i], rec.start_tick, (Block*)&ring[i * CHUNK_SIZE]);
+
+	auto physics = new Physics(config, game_map);
+	for(int i=0; i<rec.active.size(); ++i)
+		physics->mark_chunk(rec.active[i]);
+
+	int num_batches = rec.batches.size() + extra;
+	uint64_t base = rec.start_tick;
+	int e = 0;
+
+	auto start = tick_count::now();
+	for(int b=0; b<num_batches; ++b)
+	{
+		if(b < rec.batches.size())
+		{
+			base = rec.batches[b].base_tick;
+			for(int i=0; i<rec.batches[b].num_events; ++i, ++e)
+			{
+				auto const& w = rec.events[e];
+				if(w.t == 0)
+				{
+					//A player edit, which the server wrote to the map before the batch
+					game_map->set_block(w.b, base, w.x, w.y, w.z);
+					physics->touch_block(w.b, w.x, w.y, w.z);
+				}
+				else
+				{
+					physics->set_block(w.b, w.t, w.x, w.y, w.z);
+				}
+			}
+		}
+		else
+		{
+			base += 16;
+		}
+
+		physics->tick(base + 16);
+		physics->flush();
+	}
+	double t = (tick_count::now() - start).seconds();
+
+	RunResult result;
+	result.ticks_per_second = 16.0 * num_batches / t;
+	result.batch_time = t / num_batches;
+	for(int i=0; i<Physics::Phase_Count; ++i)
+		result.phase[i] = physics->phase_time(i) / num_batches;
+	delete physics;
+
+	result.hash = hash_chunks(game_map, rec.chunk_ids);
+	result.sand = 0;
+	Block buffer[CHUNK_SIZE];
+	for(int i=0; i<rec.chunk_ids.size(); ++i)
+	{
+		game_map->get_chunk(rec.chunk_ids[i], buffer);
+		result.sand += count_sand(buffer, CHUNK_SIZE);
+	}
+	return result;
+}
+
+void print_phases(RunResult const& res)
+{
+	printf("             per batch %.2f ms: decompress %.2f ms, step %.2f ms, write back %.2f ms, surface invalidation %.2f ms\n",
+		res.batch_time * 1e3,
+		res.phase[Physics::Phase_Decompress] * 1e3,
+		res.phase[Physics::Phase_Step] * 1e3,
+		res.phase[Physics::Phase_WriteBack] * 1e3,
+		res.phase[Physics::Phase_Invalidate] * 1e3);
+}
+
+void usage()
+{
+	printf("Usage:\n");
+	printf("  physreplay [-t <max threads>] [-x <extra batches>] <recording>\n");
+	printf("  physreplay [-t <max threads>] [-x <extra batches>] [-o <file>] -s <avalanche | building | columns>\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	int max_threads = task_scheduler_init::default_num_threads(),
+		extra = 8;
+	string path, scenario, out_path;
+
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-t" && i+1 < argc)
+			max_threads = atoi(argv[++i]);
+		else if(arg == "-x" && i+1 < argc)
+			extra = atoi(argv[++i]);
+		else if(arg == "-s" && i+1 < argc)
+			scenario = argv[++i];
+		else if(arg == "-o" && i+1 < argc)
+			out_path = argv[++i];
+		else if(arg[0] != '-' && path.empty())
+			path = arg;
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	PhysicsRecording rec;
+	if(scenario == "avalanche")
+		make_avalanche(rec);
+	else if(scenario == "building")
+		make_building(rec);
+	else if(scenario == "columns")
+		make_columns(rec);
+	else if(!scenario.empty() || path.empty())
+	{
+		usage();
+		return 1;
+	}
+	else if(!rec.load(path))
+	{
+		printf("Could not read %s\n", path.c_str());
+		return 1;
+	}
+
+	if(!out_path.empty() && !rec.save(out_path))
+		return 1;
+
+	//Run against a scratch map with the default settings
+	bool ok = true;
+	{
+		ScratchMap scratch("/tmp/physreplay");
+		if(!scratch.valid())
+			return 1;
+		auto config = scratch.config;
+		auto game_map = scratch.game_map;
+
+		printf("Replaying %s: %d chunks, %d awake, %d batches + %d extra, %d writes\n",
+			scenario.empty() ? path.c_str() : scenario.c_str(),
+			(int)rec.chunk_ids.size(), (int)rec.active.size(),
+			(int)rec.batches.size(), extra, (int)rec.events.size());
+
+		//Save the ring of chunks around the box, physics may spill into it
+		vector<ChunkID> ring_ids;
+		for(int y=rec.lo.y-1; y<=rec.hi.y; ++y)
+		for(int z=rec.lo.z-1; z<=rec.hi.z; ++z)
+		for(int x=rec.lo.x-1; x<=rec.hi.x; ++x)
+		{
+			ChunkID c(x, y, z);
+			if(!rec.contains(c))
+				ring_ids.push_back(c);
+		}
+		vector<Block> ring(ring_ids.size() * CHUNK_SIZE);
+		for(int i=0; i<ring_ids.size(); ++i)
+			game_map->get_chunk(ring_ids[i], &ring[i * CHUNK_SIZE]);
+
+		//Without writes the sand only moves, a cell which is stepped without its neighbor duplicates or deletes it
+		int64_t sand = count_sand(rec.chunk(0), rec.blocks.size());
+		auto check_sand = [&](RunResult const& res)
+		{
+			if(rec.events.empty() && res.sand != sand)
+			{
+				printf("  Box holds %ld sand, started with %ld!\n", res.sand, sand);
+				ok = false;
+			}
+		};
+
+		auto base = run(config, game_map, rec, ring_ids, ring, extra, 1);
+		printf("%3d threads: %9.1f ticks/s\n", 1, base.ticks_per_second);
+		print_phases(base);
+		check_sand(base);
+
+		for(int n=2; n<=max_threads; n*=2)
+		{
+			auto res = run(config, game_map, rec, ring_ids, ring, extra, n);
+			printf("%3d threads: %9.1f ticks/s, efficiency %.1f%%\n",
+				n, res.ticks_per_second, 100.0 * res.ticks_per_second / (n * base.ticks_per_second));
+			print_phases(res);
+			check_sand(res);
+
+			if(res.hash != base.hash)
+			{
+				printf("  Final state differs from the single threaded run! %016lx\n", res.hash);
+				ok = false;
+			}
+		}
+
+		printf("Hash: %016lx\n", base.hash);
+	}
+
+	google::protobuf::ShutdownProtobufLibrary();
+	return ok ? 0 : 1;
+}
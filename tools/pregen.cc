@@ -0,0 +1,155 @@
+//Offline world pregeneration tool
+//
+// Usage:
+//	pregen <config file> <x0> <y0> <z0> <x1> <y1> <z1>		Generates the box of chunks [x0,x1) * [y0,y1) * [z0,z1)
+//	pregen <config file> -r <radius> [<cx> <cy> <cz>]		Generates a cube of chunks around a point (default: player start)
+//
+// Chunks and their surface chunks are generated on all cores and written straight to the map
+// database.  Chunks which are already stored are loaded instead of regenerated, so an
+// interrupted run can be resumed.  The server must not be running on the same database.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <tbb/task_scheduler_init.h>
+#include <tbb/tick_count.h>
+#include <tbb/atomic.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range3d.h>
+
+#include "network.pb.h"
+
+#include "constants.h"
+#include "misc.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+void usage()
+{
+	printf("Usage:\n");
+	printf("  pregen <config file> <x0> <y0> <z0> <x1> <y1> <z1>\n");
+	printf("  pregen <config file> -r <radius> [<cx> <cy> <cz>]\n");
+	printf("Coordinates are in chunks.\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+	
+	task_scheduler_init init;
+
+	if(argc < 3)
+	{
+		usage();
+		return 1;
+	}
+	
+	//Parse the region
+	int lo[3], hi[3];
+	if(string(argv[2]) == "-r")
+	{
+		if(argc != 4 && argc != 7)
+		{
+			usage();
+			return 1;
+		}
+	
+		int r = atoi(argv[3]);
+		int c[3] = { PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z };
+		if(argc == 7)
+		{
+			for(int i=0; i<3; ++i)
+				c[i] = atoi(argv[4+i]);
+		}
+		
+		for(int i=0; i<3; ++i)
+		{
+			lo[i] = c[i] - r;
+			hi[i] = c[i] + r + 1;
+		}
+	}
+	else
+	{
+		if(argc != 8)
+		{
+			usage();
+			return 1;
+		}
+		
+		for(int i=0; i<3; ++i)
+		{
+			lo[i] = atoi(argv[2+i]);
+			hi[i] = atoi(argv[5+i]);
+		}
+	}
+	
+	if(lo[0] >= hi[0] || lo[1] >= hi[1] || lo[2] >= hi[2])
+	{
+		printf("Empty region\n");
+		return 1;
+	}
+	
+	uint64_t total = (uint64_t)(hi[0]-lo[0]) * (hi[1]-lo[1]) * (hi[2]-lo[2]);
+	printf("Pregenerating %ld chunks in (%d-%d), (%d-%d), (%d-%d)\n", total,
+		lo[0], hi[0], lo[1], hi[1], lo[2], hi[2]);
+
+	{
+		auto GC = ScopeDelete<Config>(new Config(argv[1]));
+		auto GM = ScopeDelete<GameMap>(new GameMap(GC.ptr));
+		auto game_map = GM.ptr;
+		
+		auto start = tick_count::now();
+		
+		//Work through the region one y layer at a time, so the database gets written
+		//in bulk as we go and progress can be reported
+		tbb::atomic<uint64_t> done;
+		done = 0;
+		int written = 0;
+		
+		for(int y=lo[1]; y<hi[1]; ++y)
+		{
+			parallel_for(blocked_range3d<int,int,int>(
+				y, y+1, 
+				lo[2], hi[2], 
+				lo[0], hi[0]), [&](blocked_range3d<int,int,int> rng)
+			{
+				for(auto iy = rng.pages().begin(); iy!=rng.pages().end(); ++iy)
+				for(auto iz = rng.rows().begin();  iz!=rng.rows().end();  ++iz)
+				for(auto ix = rng.cols().begin();  ix!=rng.cols().end();  ++ix)
+				{
+					ChunkID chunk_id(ix, iy, iz);
+					
+					{
+						GameMap::const_accessor acc;
+						game_map->get_chunk_buffer(acc, chunk_id);
+					}
+					{
+						GameMap::const_accessor acc;
+						game_map->get_surface_chunk_buffer(acc, chunk_id);
+					}
+					
+					++done;
+				}
+			});
+			
+			written += game_map->flush();
+			
+			double t = (tick_count::now() - start).seconds();
+			printf("Layer %d: %ld/%ld chunks, %.1f chunks/s\n", y, (uint64_t)done, total, (double)done / t);
+		}
+		
+		double t = (tick_count::now() - start).seconds();
+		printf("Generated %ld chunks in %.2f s (%.1f chunks/s), %d records written\n",
+			total, t, (double)total / t, written);
+	}
+	
+	google::protobuf::ShutdownProtobufLibrary();
+	return 0;
+}
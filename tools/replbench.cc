@@ -0,0 +1,428 @@
+//Replication benchmark
+//
+// Usage:
+//	replbench [-n <ticks>] [-w <writes per tick>] [-l <max lag ticks>]
+//
+// Runs a primary and a hot standby follower as two processes on the same host, each with its own
+// scratch map, connected over a unix socket in the scratch directory.  Once the follower has taken
+// the snapshot, the primary runs for the given number of ticks (default 200) at the configured
+// tick_rate with players placing stone walls and dropping sand into a box of chunks, the given
+// number of writes per tick (default 32), while the physics runs.  Then the physics is run until it
+// settles and a final heartbeat is sent.
+//
+// The follower must end up with the same blocks in the box as the primary.  Reports the lag of the
+// stream in milliseconds and ticks, and how many primary ticks overran the tick rate.  Exits with
+// status 1 if the replicas differ, the follower did not keep up, or its largest lag was over max
+// lag ticks (default 4).  The servers log to stderr, redirect it when timing.
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <tbb/tick_count.h>
+#include <tbb/compat/thread>
+
+#include "constants.h"
+#include "misc.h"
+#include "config.h"
+#include "chunk.h"
+#include "game_map.h"
+#include "physics.h"
+#include "replication.h"
+
+#include "scratch_map.h"
+
+using namespace tbb;
+using namespace std;
+using namespace Game;
+
+//How long the follower gets to connect, take the snapshot and catch up, in seconds
+static const double FOLLOWER_TIMEOUT = 30.0;
+
+//Deterministic generator for the edits
+struct EditRandom
+{
+	uint64_t state;
+
+	EditRandom(uint64_t seed) : state(seed) {}
+
+	int next(int n)
+	{
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (int)((state >> 33) % n);
+	}
+};
+
+//Sent from the follower to the primary when it is done
+struct FollowerReport
+{
+	int			ok;
+	uint64_t	hash;
+	double		max_lag;
+};
+
+//Box of chunks the players build in
+struct Box
+{
+	ChunkID lo, hi;
+	int floor_y;
+
+	Box()
+	{
+		ChunkID c(PLAYER_START_X / CHUNK_X, PLAYER_START_Y / CHUNK_Y, PLAYER_START_Z / CHUNK_Z);
+		lo = ChunkID(c.x - 2, c.y, c.z - 2);
+		hi = ChunkID(c.x + 2, c.y + 2, c.z + 2);
+		floor_y = lo.y * CHUNK_Y + 4;
+	}
+
+	vector<ChunkID> chunk_ids() const
+	{
+		vector<ChunkID> result;
+		for(int y=lo.y; y<hi.y; ++y)
+		for(int z=lo.z; z<hi.z; ++z)
+		for(int x=lo.x; x<hi.x; ++x)
+			result.push_back(ChunkID(x, y, z));
+		return result;
+	}
+};
+
+//FNV-1a over the blocks of a list of chunks
+uint64_t hash_chunks(GameMap* game_map, vector<ChunkID> const& chunk_ids)
+{
+	Block buffer[CHUNK_SIZE];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<chunk_ids.size(); ++i)
+	{
+		game_map->get_chunk(chunk_ids[i], buffer);
+		for(int j=0; j<CHUNK_SIZE; ++j)
+		{
+			h ^= buffer[j].int_val;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+//Reads exactly len bytes from a pipe, giving up after the timeout
+bool read_pipe(int fd, void* buf, int len, double timeout)
+{
+	auto start = tick_count::now();
+	int got = 0;
+	while(got < len)
+	{
+		if((tick_count::now() - start).seconds() > timeout)
+			return false;
+
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		int r = read(fd, (char*)buf + got, len - got);
+		if(r <= 0)
+			return false;
+		got += r;
+	}
+	return true;
+}
+
+bool write_pipe(int fd, const void* buf, int len)
+{
+	return write(fd, buf, len) == len;
+}
+
+//The follower process, reports to the primary once it has seen the final tick
+int run_follower(string const& prefix, string const& socket_path, int to_primary, int from_primary)
+{
+	ScratchMap scratch(prefix);
+	if(!scratch.valid())
+		return 1;
+	scratch.config->storeString("replication_follow", socket_path);
+
+	auto follower = ScopeDelete<ReplicationFollower>(new ReplicationFollower(scratch.config, scratch.game_map));
+	follower.ptr->start();
+
+	//Tell the primary to start once the snapshot is in
+	auto start = tick_count::now();
+	while(!follower.ptr->streaming())
+	{
+		if((tick_count::now() - start).seconds() > FOLLOWER_TIMEOUT)
+			return 1;
+		this_thread::sleep_for(tick_count::interval_t(0.001));
+	}
+	char ready = 'R';
+	if(!write_pipe(to_primary, &ready, 1))
+		return 1;
+
+	//Wait for the final tick, every chunk update before it has been applied once it arrives
+	uint64_t final_tick;
+	if(!read_pipe(from_primary, &final_tick, sizeof(final_tick), 1e9))
+		return 1;
+
+	FollowerReport report;
+	report.ok = 0;
+	start = tick_count::now();
+	while((tick_count::now() - start).seconds() < FOLLOWER_TIMEOUT)
+	{
+		if(follower.ptr->last_tick() >= final_tick)
+		{
+			report.ok = 1;
+			break;
+		}
+		this_thread::sleep_for(tick_count::interval_t(0.001));
+	}
+
+	report.max_lag = follower.ptr->max_lag();
+	follower.ptr->stop();
+	report.hash = hash_chunks(scratch.game_map, Box().chunk_ids());
+
+	return write_pipe(to_primary, &report, sizeof(report)) ? 0 : 1;
+}
+
+//The primary process, builds in the box under physics load while the follower streams
+bool run_primary(string const& prefix, string const& socket_path, int to_follower, int from_follower,
+	int num_ticks, int writes_per_tick, double max_lag_ticks)
+{
+	ScratchMap scratch(prefix);
+	if(!scratch.valid())
+		return false;
+	auto config = scratch.config;
+	auto game_map = scratch.game_map;
+	config->storeString("replication_listen", socket_path);
+	double tick_rate = config->readFloat("tick_rate");
+
+	//Clear the box, the snapshot carries it to the follower
+	Box box;
+	auto chunk_ids = box.chunk_ids();
+	Block buffer[CHUNK_SIZE];
+	for(int i=0; i<chunk_ids.size(); ++i)
+	{
+		auto c = chunk_ids[i];
+		for(int y=0; y<CHUNK_Y; ++y)
+		for(int z=0; z<CHUNK_Z; ++z)
+		for(int x=0; x<CHUNK_X; ++x)
+		{
+			buffer[x + z * CHUNK_X + y * CHUNK_X * CHUNK_Z] =
+				c.y * CHUNK_Y + y < box.floor_y ? Block(BlockType_Stone) : Block(BlockType_Air);
+		}
+		game_map->update_chunk(c, 1, buffer);
+	}
+
+	auto primary = ScopeDelete<ReplicationPrimary>(new ReplicationPrimary(config, game_map));
+	if(!primary.ptr->start())
+		return false;
+	game_map->set_replicator(primary.ptr);
+
+	bool ok = true;
+	char ready;
+	if(!read_pipe(from_follower, &ready, 1, FOLLOWER_TIMEOUT))
+	{
+		printf("Follower did not take the snapshot\n");
+		ok = false;
+	}
+
+	uint64_t t = 1024;
+	int overruns = 0;
+	if(ok)
+	{
+		auto physics = ScopeDelete<Physics>(new Physics(config, game_map));
+		vector<ChunkID> observers(1, ChunkID((box.lo.x + box.hi.x)/2, box.lo.y, (box.lo.z + box.hi.z)/2));
+		physics.ptr->set_observers(observers);
+
+		int sx = (box.hi.x - box.lo.x) * CHUNK_X,
+			sy = (box.hi.y - box.lo.y) * CHUNK_Y,
+			sz = (box.hi.z - box.lo.z) * CHUNK_Z;
+		EditRandom rnd(3);
+
+		printf("Building in %d chunks for %d ticks, %d writes per tick\n",
+			(int)chunk_ids.size(), num_ticks, writes_per_tick);
+
+		auto start = tick_count::now();
+		for(int i=0; i<num_ticks; ++i)
+		{
+			++t;
+			primary.ptr->push_tick(t);
+
+			//Walls rise from the floor, sand is dropped from the top
+			for(int j=0; j<writes_per_tick; ++j)
+			{
+				int x = box.lo.x * CHUNK_X + rnd.next(sx),
+					z = box.lo.z * CHUNK_Z + rnd.next(sz),
+					y;
+				Block b;
+				if(rnd.next(4))
+				{
+					y = box.floor_y + rnd.next(sy - (box.floor_y - box.lo.y * CHUNK_Y));
+					b = Block(BlockType_Stone);
+				}
+				else
+				{
+					y = box.lo.y * CHUNK_Y + sy - 1 - rnd.next(4);
+					b = Block(BlockType_Sand);
+				}
+				game_map->set_block(b, t, x, y, z);
+				physics.ptr->touch_block(b, x, y, z);
+			}
+
+			physics.ptr->tick(t);
+
+			//Keep to the tick rate
+			double wait = (i + 1) * tick_rate - (tick_count::now() - start).seconds();
+			if(wait > 0)
+				this_thread::sleep_for(tick_count::interval_t(wait));
+			else
+				++overruns;
+		}
+
+		//Let the sand come to rest
+		for(int i=0; i<8; ++i)
+		{
+			t += 16;
+			physics.ptr->tick(t);
+			physics.ptr->flush();
+		}
+	}
+
+	//Every update is queued before the final heartbeat
+	if(ok)
+		primary.ptr->push_tick(t);
+
+	uint64_t hash = hash_chunks(game_map, chunk_ids);
+
+	FollowerReport report;
+	if(ok && (!write_pipe(to_follower, &t, sizeof(t)) ||
+		!read_pipe(from_follower, &report, sizeof(report), 2 * FOLLOWER_TIMEOUT)))
+	{
+		printf("Follower did not report\n");
+		ok = false;
+	}
+
+	if(ok)
+	{
+		printf("Lag: max %.2f ms (%.2f ticks), %d of %d primary ticks overran\n",
+			report.max_lag * 1e3, report.max_lag / tick_rate, overruns, num_ticks);
+		printf("Hash: primary %016lx, follower %016lx\n", hash, report.hash);
+
+		if(!report.ok)
+		{
+			printf("Follower never saw the final tick!\n");
+			ok = false;
+		}
+		else if(report.hash != hash)
+		{
+			printf("Follower differs from the primary!\n");
+			ok = false;
+		}
+		else if(report.max_lag > max_lag_ticks * tick_rate)
+		{
+			printf("Follower fell more than %.1f ticks behind!\n", max_lag_ticks);
+			ok = false;
+		}
+	}
+
+	game_map->set_replicator(NULL);
+	primary.ptr->stop();
+	return ok;
+}
+
+void usage()
+{
+	printf("Usage: replbench [-n <ticks>] [-w <writes per tick>] [-l <max lag ticks>]\n");
+}
+
+int main(int argc, char** argv)
+{
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	int num_ticks = 200,
+		writes_per_tick = 32;
+	double max_lag_ticks = 4.0;
+
+	for(int i=1; i<argc; ++i)
+	{
+		string arg(argv[i]);
+		if(arg == "-n" && i+1 < argc)
+			num_ticks = atoi(argv[++i]);
+		else if(arg == "-w" && i+1 < argc)
+			writes_per_tick = atoi(argv[++i]);
+		else if(arg == "-l" && i+1 < argc)
+			max_lag_ticks = atof(argv[++i]);
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	char scratch_dir[] = "/tmp/replbenchXXXXXX";
+	if(mkdtemp(scratch_dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	string scratch(scratch_dir),
+		socket_path = scratch + "/replication.sock";
+
+	//Fork before either side starts any threads
+	int to_follower[2], to_primary[2];
+	if(pipe(to_follower) == -1 || pipe(to_primary) == -1)
+	{
+		perror("pipe");
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if(pid == -1)
+	{
+		perror("fork");
+		return 1;
+	}
+	if(pid == 0)
+	{
+		close(to_follower[1]);
+		close(to_primary[0]);
+		int r = run_follower(scratch + "/follower", socket_path, to_primary[1], to_follower[0]);
+		google::protobuf::ShutdownProtobufLibrary();
+		_exit(r);
+	}
+	close(to_follower[0]);
+	close(to_primary[1]);
+
+	bool ok = run_primary(scratch + "/primary", socket_path, to_follower[1], to_primary[0],
+		num_ticks, writes_per_tick, max_lag_ticks);
+
+	//A follower still waiting for the final tick is not coming back
+	close(to_follower[1]);
+	int status;
+	if(!ok)
+		kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(to_primary[0]);
+
+	//A killed follower leaves its map behind
+	DIR* dir = opendir(scratch_dir);
+	if(dir != NULL)
+	{
+		for(struct dirent* e = readdir(dir); e != NULL; e = readdir(dir))
+		{
+			if(strncmp(e->d_name, "follower", 8) == 0)
+				ScratchMap::remove(scratch + "/" + e->d_name);
+		}
+		closedir(dir);
+	}
+	unlink(socket_path.c_str());
+	rmdir(scratch_dir);
+
+	google::protobuf::ShutdownProtobufLibrary();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#ifndef SCRATCH_MAP_H
+#define SCRATCH_MAP_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "misc.h"
+#include "config.h"
+#include "game_map.h"
+
+//A game map with the default settings in a fresh temporary directory, for the benchmarks.  The directory
+//is named prefix followed by six random characters, and everything in it is removed by the destructor.
+//Settings which the map itself does not read can still be stored in the config once it is open.
+struct ScratchMap
+{
+	std::string dir;
+	Game::Config* config;
+	Game::GameMap* game_map;
+
+	ScratchMap(std::string const& prefix) : config(NULL), game_map(NULL)
+	{
+		std::vector<char> path(prefix.begin(), prefix.end());
+		path.insert(path.end(), 6, 'X');
+		path.push_back('\0');
+		if(mkdtemp(&path[0]) == NULL)
+		{
+			perror("mkdtemp");
+			return;
+		}
+		dir = &path[0];
+
+		config = new Game::Config(file("config.tch"));
+		config->storeString("map_db_path", file("map.tch"));
+		config->storeString("surface_db_path", file("surface.tch"));
+		config->storeString("map_image_path", file("map.img"));
+		game_map = new Game::GameMap(config);
+	}
+
+	~ScratchMap()
+	{
+		if(dir.empty())
+			return;
+
+		delete game_map;
+		delete config;
+		remove(dir);
+	}
+
+	//Removes a scratch directory, also for maps whose process was killed
+	static void remove(std::string const& dir)
+	{
+		static const char* FILES[] = { "config.tch", "map.tch", "surface.tch", "map.img", "map.img.tmp" };
+		for(int i=0; i<sizeof(FILES)/sizeof(FILES[0]); ++i)
+			unlink((dir + "/" + FILES[i]).c_str());
+		rmdir(dir.c_str());
+	}
+
+	//False if the directory could not be created
+	bool valid() const { return game_map != NULL; }
+
+	//Path of a file in the scratch directory
+	std::string file(const char* name) const { return dir + "/" + name; }
+};
+
+#endif
@@ -45,6 +45,20 @@ var Transparent =
 	false,	//Sand
 ];
 
+//Number of state bytes stored after each block type in a chunk
+var StateBytes =
+[
+	0,	//Air
+	0,	//Stone
+	0, 	//Dirt
+	0,	//Grass
+	0, 	//Cobble
+	0,	//Wood
+	0,	//Log
+	1, 	//Water
+	0,	//Sand
+];
+
 //A pending block write
 function PendingWrite(t, x, y, z, b)
 {
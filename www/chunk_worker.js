@@ -525,8 +525,9 @@ function decode_pbuffer(buffer)
 				break;
 		}
 		
-		//Decode block
+		//Decode block, the client does not use the state bytes
 		b = buffer[i++];
+		i += StateBytes[b];
 		
 		res.push( [l, b] );
 	}
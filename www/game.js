@@ -301,6 +301,8 @@ var Game =
 		p_upd.SetField("x", Math.round(pos[0]));
 		p_upd.SetField("y", Math.round(pos[1]));
 		p_upd.SetField("z", Math.round(pos[2]));
+		p_upd.SetField("pitch", orient[0]);
+		p_upd.SetField("yaw", orient[1]);
 		
 		pbuf.SetField("player_update", p_upd);
 		